@@ -13,16 +13,22 @@
 
 namespace tracker {
 
+template<IndexT NDims, IndexT NFeatures> class GaussianCostPolicy;
+
 class LAPTrack : public Tracker {
 public:
     using SpMatT = arma::SpMat<FloatT> ;
     using UVecT = arma::Col<arma::uword> ;
     using UMatT = arma::umat;
+    enum MotionModelT {BROWNIAN=0, CONSTANT_VELOCITY=1};
+    enum LinkStrategyT {LINK_OPTIMAL=0, LINK_GREEDY=1};
     
     FloatT D; //  D - um^2/s
     FloatT kon;//  kon  - s^-1
     FloatT koff;//  koff - s^-1
     FloatT rho;
+    //Per-species D, kon, koff, and rho when the parameter is given with one value per species label.  Empty when shared.
+    VecT speciesD, speciesKon, speciesKoff, speciesRho;
     VecT featureVar; //(nFeatures,1) The sigma^2 of error allowed in each feature dimension.  Should have same units as feature.
     FloatT maxSpeed = 0;  //Maximum speed
     FloatT maxPositionDisplacementSigma = 5.0; //Maximum standard deviations out to propose a connection
@@ -30,24 +36,56 @@ public:
     IdxT maxGapCloseFrames = 20;
     IdxT minGapCloseTrackLength = 1;
     IdxT minFinalTrackLength = 1;
+    IdxT gapCloseBlockFrames = 0; //Frames per temporal block for parallel gap closing.  0 solves a single global gap-close LAP.
+    bool gapCloseBlockExact = false; //Split into connected components instead of fixed blocks.  Gives the same optimum as the global solve.
+    bool gapCloseImplicit = false; //Solve gap closing with rows generated on demand instead of a stored cost matrix
+    size_t gapCloseRowCacheBytes = size_t(1)<<28; //Memory budget for caching generated rows with gapCloseImplicit
+    MotionModelT motionModel = BROWNIAN; //CONSTANT_VELOCITY gates and costs connections on positions predicted by a per-track Kalman velocity state
+    FloatT velocityVar0 = 0; //CONSTANT_VELOCITY prior variance of each velocity component for new tracks. Units: (position/frame)^2
+    FloatT velocityD = 0; //CONSTANT_VELOCITY velocity process noise variance added per frame. Units: (position/frame)^2/frame
+    size_t gapCloseMemoryBudget = 0; //Bytes of working memory for assembling the gap-close matrix beyond the matrix itself and one count per track. Sorted edges beyond this spill to a temporary file.  0 disables.
+    //Keep only the k lowest cost connections for each row and column of the F2F and gap-close LAPs.  0 disables.
+    //An edge is kept if it is in the k best of its row or of its column, so a row can keep more than k edges
+    //through its columns.  The total is at most k*(nRows+nCols).
+    IdxT maxCandidatesPerLoc = 0;
+    IdxT denseLinkMaxSize = 12; //Solve F2F LAPs with nCur+nNext up to this size with the dense kernel.  0 disables.  From the benchTrackerDenseSolver timings.
+    LinkStrategyT linkStrategy = LINK_OPTIMAL; //LINK_GREEDY approximates the F2F and gap-close LAPs by greedy matching for fast previews
+    IdxT greedySwapPasses = 0; //LINK_GREEDY maximum local move/swap passes after the greedy matching
+    bool reportCostGap = false; //LINK_GREEDY also solves each LAP optimally to report the cost gap in getStats()
+    FloatT frameTimeBudget = 0; //Seconds allowed for each LINK_OPTIMAL F2F LAP before completing it greedily.  0 disables.
     
     
     const FloatT cost_epsilon = std::numeric_limits<FloatT>::epsilon();
 
     LAPTrack(const VecParamT &param);
+    ~LAPTrack();
     VecParamT getStats() const;
+    VecParamT getProgress() const override;
     void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_);
     void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_);
+    void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_,
+                          const IVecT &species_);
     void linkF2F();
     void closeGaps();
-    SpMatT computeF2FCostMat(int curFrame, int nextFrame) const;
-    void debugF2F(int frameIdx, IVecT &cur_locs, IVecT &next_locs, SpMatT &cost, IMatT &connections, VecT &conn_costs) const;
+    void appendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_);
+    void appendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_);
+    SpMatT computeF2FCostMat(IdxT curFrame, IdxT nextFrame) const;
+    SpMatT computeF2FEdgeMat(IdxT curFrame, IdxT nextFrame) const;
+    void debugF2F(IdxT frameIdx, IVecT &cur_locs, IVecT &next_locs, SpMatT &cost, IMatT &connections, VecT &conn_costs) const;
     void debugCloseGaps(SpMatT &cost, IMatT &connections, VecT &conn_costs) const;
     
     SpMatT computeGapCloseMatrix() const;
+    SpMatT computeGapCloseEdgeMatrix() const;
     void generateTracks();
     void checkFrameIdxs();
+    void sweep(const std::vector<VecParamT> &configs, std::vector<TrackVecT> &configTracks, std::vector<VecParamT> &configStats) const;
+    template<class CostPolicyT>
+    void setCostPolicy(); //Defined in Tracker/LAPTrackCostPolicy.h
+
+    static const IdxT DynamicSize = -1; //GaussianCostPolicy template argument to use the run-time nDims or nFeatures
 protected:
+    template<IndexT NDims, IndexT NFeatures> friend class GaussianCostPolicy;
+
     FloatT minCost = 1e-6; // The minimum cost to put in the matrix.  Should this be bigger than machine eps?
     FloatT log1mkoff; //log(1-koff);
     FloatT log1mkon; //log(1-kon);
@@ -56,11 +94,121 @@ protected:
     FloatT logkoff; //log(koff);
 
     enum StateT {UNTRACKED, F2F_LINKED, GAPS_CLOSED};
-    StateT state;
+    StateT state = UNTRACKED;
     //These member variables make it easier for gap closing to get the information on the track beginning/ends
     //We can assemble the gap closing index without searching for tracks that are born at a particular frame.
     IndexVectorT birthFrameIdx; //frame index for the beginning of each track.
     IVecT frameBirthStartIdx; //for each frameIdx list the first track to start at that frame Idx or later.
+
+    enum ProgressPhaseT {PHASE_IDLE=0, PHASE_LINKING=1, PHASE_GAP_CLOSING=2, PHASE_DONE=3};
+    std::atomic<int> progressPhase{PHASE_IDLE}; //Progress of the current tracking for getProgress()
+    std::atomic<IdxT> progressFrame{0}; //Number of frames linked by linkF2F()
+
+    void linkFrames(IdxT curFrame);
+    void joinGapClosedTracks(const IVecT &track_assignment);
+    void rebuildTrackIndex();
+    void closeAppendedGaps(IdxT boundaryFrame);
+
+    void writeState(std::ostream &out) const override;
+    void readState(std::istream &in) override;
+    IdxT nGapCloseSubproblems = 0; //Number of independent LAPs solved by the last closeGaps()
+    IdxT nGapCloseRowEvaluations = 0; //Number of rows generated by the last gapCloseImplicit closeGaps()
+    mutable IdxT nGapCloseSpillRuns = 0; //Number of sorted runs spilled to disk by the last gapCloseMemoryBudget assembly
+    //Total LAP costs of the last linkF2F() and closeGaps() for reportCostGap
+    FloatT f2fLinkCost = 0;
+    FloatT f2fOptimalCost = 0;
+    mutable FloatT gapCloseLinkCost = 0;
+    mutable FloatT gapCloseOptimalCost = 0;
+    IVecT solveLink(const SpMatT &cost, const VecT &deathC, const VecT &birthC, FloatT &linkCost, FloatT &optimalCost) const;
+    //Motion state for CONSTANT_VELOCITY.  The state of a track is stored at its most recent localization.
+    MatT velocity; // N x nDims;  Velocity estimate (position/frame)
+    MatT velocityVar; // N x nDims; Variance of the velocity estimate
+
+    void updateMotionState(IdxT prevLoc, IdxT loc, IdxT deltaT);
+    void enumerateF2FEdges(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const;
+    static SpMatT makeEdgeMatrix(IdxT nRows, IdxT nCols, const IndexVectorT &rows, const IndexVectorT &cols, const std::vector<FloatT> &costs);
+
+    mutable IdxT nF2FCandidateCapHits = 0; //Number of rows and columns truncated by maxCandidatesPerLoc in the last linkF2F()
+    //Per-frame F2F linking latency for frameTimeBudget, indexed by the frame linked to its successor
+    VecT f2fFrameSeconds; //Seconds to link each frame
+    IVecT f2fFrameDegraded; //1 where the frameTimeBudget was exceeded and the LAP was completed greedily
+    IdxT nF2FDegradedFrames = 0; //Number of frames completed greedily in the last linkF2F() and appendLocalizations()
+    mutable IdxT nGapCloseCandidateCapHits = 0; //Number of rows and columns truncated by maxCandidatesPerLoc in the last gap-close enumeration
+    /** Bounded max-heaps holding the k lowest cost candidates for each of nLocs locations */
+    class CandidateHeapT {
+    public:
+        using EntryT = std::pair<FloatT,IdxT>; //(cost, candidate index)
+        CandidateHeapT(IdxT nLocs, IdxT k);
+        void push(IdxT loc, FloatT cost, IdxT candidate);
+        IdxT nLocs() const {return static_cast<IdxT>(count.size());}
+        IdxT size(IdxT loc) const {return count[loc];}
+        const EntryT& entry(IdxT loc, IdxT n) const {return heap[static_cast<size_t>(loc)*k+n];}
+        IdxT nCapped() const {return n_capped;} //Number of locations offered more than k candidates
+    private:
+        IdxT k;
+        std::vector<EntryT> heap; //k entries for each location
+        IndexVectorT count;
+        std::vector<bool> capped_loc;
+        IdxT n_capped = 0;
+    };
+    static void mergeCandidates(const CandidateHeapT &rowCands, const CandidateHeapT &colCands,
+                                IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs);
+
+    /** Parameter-independent terms of the F2F candidates enumerated once for sweep() */
+    struct SweepCandidatesT {
+        IdxT nTerms; //nDims+nFeatures
+        IndexVectorT pairStart; //(nFrames+1) Offset of the first candidate linking from each frame, indexed from firstFrame
+        IndexVectorT rows; //F2F cost matrix row of each candidate
+        IndexVectorT cols; //F2F cost matrix column of each candidate
+        std::vector<FloatT> distSq; //nTerms per candidate: squared displacement in each dimension then each feature
+        std::vector<FloatT> seSum; //nTerms per candidate: sum of the two localization SE terms in each dimension then each feature
+    };
+    const SweepCandidatesT *sweepCandidates = nullptr; //When set, linkF2F() re-weights these candidates instead of enumerating
+    void enumerateSweepCandidates(const std::vector<const LAPTrack*> &configs, SweepCandidatesT &candidates) const;
+    void reweightSweepCandidates(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const;
+
+    bool isGapCloseEnd(IdxT i) const;
+    template<class CostPolicyT>
+    bool computeGapCloseCost(const std::vector<CostPolicyT> &policies, IdxT i, IdxT j, FloatT &C) const;
+    void enumerateGapCloseEdges(IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const;
+    void enumerateGapCloseEdges(IdxT endBegin, IdxT endEnd, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const;
+    SpMatT computeGapCloseMatrixBudgeted() const;
+    IVecT solveGapCloseImplicit(IdxT &nEvaluations) const;
+
+    //Cost kernels templated on the cost policy, defined in Tracker/LAPTrackCostPolicy.h.  The default
+    //GaussianCostPolicy is specialized at compile time for nDims and nFeatures by selectCostKernels().
+    template<class CostPolicyT>
+    void enumerateF2FEdgesKernel(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const;
+    template<class CostPolicyT>
+    void enumerateGapCloseEdgesKernel(IdxT endBegin, IdxT endEnd, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const;
+    template<class CostPolicyT>
+    void enumerateAppendedGapCloseEdgesKernel(IdxT boundaryFrame, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const;
+    template<class CostPolicyT>
+    IVecT solveGapCloseImplicitKernel(IdxT &nEvaluations) const;
+    template<class CostPolicyT>
+    void unlinkedCostsKernel(IdxT species, FloatT &birthC, FloatT &deathC) const;
+    struct CostKernelsT {
+        void (LAPTrack::*enumerateF2FEdges)(IdxT, IdxT, IndexVectorT&, IndexVectorT&, std::vector<FloatT>&) const;
+        void (LAPTrack::*enumerateGapCloseEdges)(IdxT, IdxT, IndexVectorT&, IndexVectorT&, std::vector<FloatT>&) const;
+        void (LAPTrack::*enumerateAppendedGapCloseEdges)(IdxT, IndexVectorT&, IndexVectorT&, std::vector<FloatT>&) const;
+        IVecT (LAPTrack::*solveGapCloseImplicit)(IdxT&) const;
+        void (LAPTrack::*unlinkedCosts)(IdxT, FloatT&, FloatT&) const;
+        bool isGaussian; //GaussianCostPolicy, whose costs sweep() can re-weight from stored terms
+    };
+    CostKernelsT costKernels;
+    bool customCostPolicy = false; //Set by setCostPolicy().  Keeps selectCostKernels() from replacing the policy.
+    template<class CostPolicyT>
+    static CostKernelsT makeCostKernels();
+    void selectCostKernels();
+    void checkSpeciesParams(IdxT nSpecies_) const;
+    void initializeTrackingState();
+    void unlinkedCosts(VecT &birthC, VecT &deathC) const;
+    IdxT trackSpecies(IdxT i) const {return locSpecies(tracks[i].front());}
+    FloatT speciesParam(const VecT &values, FloatT shared, IdxT s) const {return values.is_empty() ? shared : values(s);}
+    IVecT solveSpeciesBlocks(IdxT curFrame, IdxT nextFrame, const VecT &deathC, const VecT &birthC, FloatT &linkCost, FloatT &optimalCost) const;
+    IVecT solveGapCloseBlocks(IdxT &nSubproblems) const;
+    void solveGapCloseSubproblem(const IndexVectorT &ends, const IndexVectorT &starts, const std::vector<FloatT> &costs,
+                                 const IndexVectorT &edgeIdxs, IVecT &track_assignment) const;
 };
 
 } /* namespace tracker */
@@ -0,0 +1,443 @@
+/** @file LAPTrackCostPolicy.h
+* @author Mark J. Olah (mjo\@cs.unm.edu)
+* @date 2015-2019
+* @brief Cost policies for LAPTrack and the cost kernels templated on them.
+*
+* A cost policy supplies the gating, the connection costs, and the birth/death costs used to build the
+* F2F and gap-closing LAPs.  The enumeration kernels are templated on the policy so its costs are
+* inlined into the loops over candidate pairs.  GaussianCostPolicy is the default model.  A custom
+* model is a class with the same members as GaussianCostPolicy, selected with
+* LAPTrack::setCostPolicy<MyPolicy>() from a translation unit that includes this header.
+*
+* The policy members are:
+*  - CostPolicyT(const LAPTrack &tracker) Constructed once per enumeration to pre-compute any
+*    parameter-dependent terms.  Shared read-only by the enumeration threads.  A policy may instead provide
+*    CostPolicyT(const LAPTrack &tracker, IdxT species) to use per-species parameters.  One policy is then
+*    constructed for each species label, and used for the connections within that species.
+*  - bool pairCost(IdxT locI, IdxT locJ, IdxT deltaT, FloatT &C) const The cost of connecting
+*    localization locI to locJ deltaT frames later, or false if the connection is gated out.
+*  - FloatT f2fLinkCost() const Transition cost added to each frame-to-frame connection.
+*  - FloatT gapCloseLinkCost(IdxT deltaT) const Transition cost added to each gap-closing connection.
+*  - FloatT birthCost() const, FloatT deathCost() const The costs of starting and ending a track.
+*/
+
+#ifndef TRACKER_LAPTRACKCOSTPOLICY_H
+#define TRACKER_LAPTRACKCOSTPOLICY_H
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <type_traits>
+#include <vector>
+
+#include "Tracker/LAPTrack.h"
+#include "Tracker/LAP_JVSparse.h"
+
+namespace tracker {
+
+/**
+ * The Gaussian diffusion cost model.
+ * 
+ * Connection costs are the negative log-likelihood of the displacement in position and feature space,
+ * without the birth/death transition terms which are given separately.  With the CONSTANT_VELOCITY
+ * motionModel, the displacement is measured from the position predicted by the velocity state of the
+ * track at locI, and the velocity uncertainty is added to the displacement variance.  The maxSpeed
+ * constraint is always applied to the observed displacement.
+ * 
+ * NDims and NFeatures fix the loop bounds at compile time so the loops can be unrolled, or are
+ * LAPTrack::DynamicSize to use the run-time nDims and nFeatures.
+ */
+template<IndexT NDims, IndexT NFeatures>
+class GaussianCostPolicy {
+public:
+    using FloatT = LAPTrack::FloatT;
+    using IdxT = LAPTrack::IdxT;
+    using VecT = LAPTrack::VecT;
+
+    //Gating thresholds pre-computed from the parameters
+    FloatT position_exponent_cutoff;
+    VecT feature_exponent_cutoff;
+    FloatT norm_const;
+
+    explicit GaussianCostPolicy(const LAPTrack &tracker, IdxT species=0);
+    bool pairCost(IdxT locI, IdxT locJ, IdxT deltaT, FloatT &C) const;
+    FloatT f2fLinkCost() const {return -log1mkoff;}
+    FloatT gapCloseLinkCost(IdxT deltaT) const {return -(logkon + logkoff*deltaT);}
+    FloatT birthCost() const {return -logrho-logkon;}
+    FloatT deathCost() const {return -logkoff;}
+private:
+    const LAPTrack &t;
+    //The species parameters
+    FloatT D;
+    FloatT log1mkoff;
+    FloatT logkon;
+    FloatT logkoff;
+    FloatT logrho;
+};
+
+/** True for the GaussianCostPolicy specializations, which sweep() can re-weight from stored terms */
+template<class CostPolicyT> struct IsGaussianCostPolicy : std::false_type {};
+template<IndexT NDims, IndexT NFeatures> struct IsGaussianCostPolicy<GaussianCostPolicy<NDims,NFeatures>> : std::true_type {};
+
+template<IndexT NDims, IndexT NFeatures>
+GaussianCostPolicy<NDims,NFeatures>::GaussianCostPolicy(const LAPTrack &tracker, IdxT species) : t(tracker)
+{
+    D = t.speciesParam(t.speciesD, t.D, species);
+    FloatT kon = t.speciesParam(t.speciesKon, t.kon, species);
+    FloatT koff = t.speciesParam(t.speciesKoff, t.koff, species);
+    log1mkoff = log(1-koff);
+    logkon = log(kon);
+    logkoff = log(koff);
+    logrho = log(t.speciesParam(t.speciesRho, t.rho, species));
+    position_exponent_cutoff = (t.maxPositionDisplacementSigma*t.maxPositionDisplacementSigma)/2.; //Only allow connections within maxPositionDisplacementSigma
+    feature_exponent_cutoff = (t.maxFeatureDisplacementSigma%t.maxFeatureDisplacementSigma)/2.; //Only allow connections within maxFeatureDisplacementSigma
+    norm_const = (t.nDims+t.nFeatures)*LAPTrack::log2pi; //Pre-compute this
+}
+
+/**
+ * The gated Gaussian cost of connecting localization locI to localization locJ deltaT frames later.
+ * 
+ * @param[in] locI Localization index of the earlier localization
+ * @param[in] locJ Localization index of the later localization
+ * @param[in] deltaT Number of frames between locI and locJ
+ * @param[out] C The cost of the connection if feasible
+ * @returns true if the connection is within the gating thresholds
+ */
+template<IndexT NDims, IndexT NFeatures>
+bool GaussianCostPolicy<NDims,NFeatures>::pairCost(IdxT locI, IdxT locJ, IdxT deltaT, FloatT &C) const
+{
+    const IdxT nd = (NDims==LAPTrack::DynamicSize) ? t.nDims : NDims; //Compile-time constant for specialized kernels
+    const IdxT nf = (NFeatures==LAPTrack::DynamicSize) ? t.nFeatures : NFeatures;
+    FloatT DdT = 2*D*deltaT;
+    FloatT total_dist_sq=0;
+    C=0;
+    for(IdxT d=0; d<nd; d++){
+        FloatT dist_var = DdT + (t.SE_position(locI,d) + t.SE_position(locJ,d));
+        FloatT dist = t.position(locI,d) - t.position(locJ,d);
+        total_dist_sq += dist*dist;
+        if(t.motionModel==LAPTrack::CONSTANT_VELOCITY) { //Displacement from the predicted position
+            dist += t.velocity(locI,d)*deltaT;
+            dist_var += (t.velocityVar(locI,d) + t.velocityD*deltaT)*deltaT*deltaT;
+        }
+        FloatT cost_exponent = dist*dist/dist_var;
+        if(cost_exponent > position_exponent_cutoff) return false; //Too far away to be connected
+        C+= cost_exponent + log(dist_var);
+    }
+    if(t.maxSpeed>0 && sqrt(total_dist_sq)/deltaT > t.maxSpeed) return false; //maxSpeed constraint violated
+    for(IdxT f=0; f<nf; f++){
+        FloatT feat_var = t.featureVar(f) + (t.SE_feature(locI,f) + t.SE_feature(locJ,f));
+        FloatT feat_dist = t.feature(locI,f) - t.feature(locJ,f);
+        FloatT cost_exponent = feat_dist*feat_dist/feat_var;
+        if(cost_exponent > feature_exponent_cutoff(f)) return false; //Too far away to be connected
+        C+= cost_exponent + log(feat_var);
+    }
+    //Otherwise we have a valid cost so normalize it
+    C+= norm_const;
+    C*= 0.5;
+    return true;
+}
+
+/** The policy for a species label, for policies with a species constructor */
+template<class CostPolicyT>
+typename std::enable_if<std::is_constructible<CostPolicyT,const LAPTrack&,IndexT>::value, CostPolicyT>::type
+makeSpeciesPolicy(const LAPTrack &tracker, IndexT species)
+{
+    return CostPolicyT(tracker, species);
+}
+
+/** The policy for a species label, for policies without a species constructor which are shared by all species */
+template<class CostPolicyT>
+typename std::enable_if<!std::is_constructible<CostPolicyT,const LAPTrack&,IndexT>::value, CostPolicyT>::type
+makeSpeciesPolicy(const LAPTrack &tracker, IndexT)
+{
+    return CostPolicyT(tracker);
+}
+
+/** The policy for each species label, indexed by species */
+template<class CostPolicyT>
+std::vector<CostPolicyT> makeSpeciesPolicies(const LAPTrack &tracker)
+{
+    std::vector<CostPolicyT> policies;
+    policies.reserve(tracker.nSpecies);
+    for(IndexT s=0; s<tracker.nSpecies; s++) policies.push_back(makeSpeciesPolicy<CostPolicyT>(tracker, s));
+    return policies;
+}
+
+template<class CostPolicyT>
+LAPTrack::CostKernelsT LAPTrack::makeCostKernels()
+{
+    CostKernelsT kernels;
+    kernels.enumerateF2FEdges = &LAPTrack::enumerateF2FEdgesKernel<CostPolicyT>;
+    kernels.enumerateGapCloseEdges = &LAPTrack::enumerateGapCloseEdgesKernel<CostPolicyT>;
+    kernels.enumerateAppendedGapCloseEdges = &LAPTrack::enumerateAppendedGapCloseEdgesKernel<CostPolicyT>;
+    kernels.solveGapCloseImplicit = &LAPTrack::solveGapCloseImplicitKernel<CostPolicyT>;
+    kernels.unlinkedCosts = &LAPTrack::unlinkedCostsKernel<CostPolicyT>;
+    kernels.isGaussian = IsGaussianCostPolicy<CostPolicyT>::value;
+    return kernels;
+}
+
+/**
+ * Use CostPolicyT for the connection, birth, and death costs of all following tracking instead of
+ * the default GaussianCostPolicy.
+ * 
+ * The policy is kept by later initializeTracks() and loadState() calls.  CostPolicyT is fixed at
+ * compile time, so its costs are inlined into the enumeration loops.
+ */
+template<class CostPolicyT>
+void LAPTrack::setCostPolicy()
+{
+    if(isTrackingRunning()) throw LogicalError("setCostPolicy: tracking is running");
+    costKernels = makeCostKernels<CostPolicyT>();
+    customCostPolicy = true;
+}
+
+template<class CostPolicyT>
+void LAPTrack::unlinkedCostsKernel(IdxT species, FloatT &birthC, FloatT &deathC) const
+{
+    const CostPolicyT policy = makeSpeciesPolicy<CostPolicyT>(*this, species);
+    birthC = policy.birthCost();
+    deathC = policy.deathCost();
+}
+
+/**
+ * Enumerate the feasible connections from localizations in curFrame to localizations in nextFrame.
+ * 
+ * Only the real connections are returned, in terms of the row (curFrame) and column (nextFrame)
+ * indexes of the F2F cost matrix.  The birth/death and dummy entries are added by computeF2FCostMat().
+ */
+template<class CostPolicyT>
+void LAPTrack::enumerateF2FEdgesKernel(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const
+{
+    IdxT nCur = nFrameLocs(curFrame-firstFrame);
+    IdxT nNext = nFrameLocs(nextFrame-firstFrame);
+    IdxT reserve_size = std::min(nCur*nNext, std::max(nCur,nNext)*10); //Guesstimate amount of entries used
+    rows.reserve(reserve_size);
+    cols.reserve(reserve_size);
+    costs.reserve(reserve_size);
+    IdxT deltaT = nextFrame - curFrame; //The number of frames spanned in the link
+    const std::vector<CostPolicyT> policies = makeSpeciesPolicies<CostPolicyT>(*this);
+
+    const IVecT &curFrameLocs = frameLocIdx(curFrame-firstFrame);
+    const IVecT &nextFrameLocs = frameLocIdx(nextFrame-firstFrame);
+//     std::cout<<"nCur:"<<nCur<<" nNext:"<<nNext<<"\n";
+//     std::cout<<"nFrameLocs:"<<nFrameLocs.t()<<"\n";
+    bool capped = maxCandidatesPerLoc>0; //Keep only the maxCandidatesPerLoc lowest cost candidates for each row and column
+    CandidateHeapT curCands(capped ? nCur : 0, maxCandidatesPerLoc);
+    CandidateHeapT nextCands(capped ? nNext : 0, maxCandidatesPerLoc);
+    //connecting locI in current frame to locJ in next frame
+    for(IdxT j=0; j<nNext; j++) {
+        IdxT next_idx = nextFrameLocs(j);
+        for(IdxT i=0; i<nCur; i++){
+            IdxT cur_idx = curFrameLocs(i);
+            IdxT s = locSpecies(cur_idx);
+            if(s != locSpecies(next_idx)) continue; //Only link within a species
+            FloatT C;
+            if(!policies[s].pairCost(cur_idx, next_idx, deltaT, C)) continue; //gating constraint violated: move to next pair.
+            C+= policies[s].f2fLinkCost();
+            if(capped) {
+                curCands.push(i, C, j);
+                nextCands.push(j, C, i);
+            } else {
+                rows.push_back(i);
+                cols.push_back(j);
+                costs.push_back(C);
+            }
+        }
+    }
+    if(capped) {
+        mergeCandidates(curCands, nextCands, rows, cols, costs);
+        nF2FCandidateCapHits += curCands.nCapped() + nextCands.nCapped();
+    }
+}
+
+/**
+ * The cost of closing the gap from the end of track i to the start of track j.
+ * 
+ * Track j must start at least 2 frames after track i ends.
+ * @param[in] policies cost policy for each species
+ * @returns false if the connection is not allowed or is outside the gates.
+ */
+template<class CostPolicyT>
+bool LAPTrack::computeGapCloseCost(const std::vector<CostPolicyT> &policies, IdxT i, IdxT j, FloatT &C) const
+{
+    if(static_cast<IdxT>(tracks[j].size()) < minGapCloseTrackLength) return false; //Don't connect tracks shorter than minGapCloseTrackLength
+    IdxT locI = tracks[i].back(); //last localization for track I.
+    IdxT deltaT = birthFrameIdx[j] - frameIdx(locI);
+//     std::cout<<"i("<<i<<") -> j("<<j<<"): deltaT:"<<deltaT<<"\n";
+    if(deltaT<1) throw LogicalError("DeltaT should be positive.");
+    if(deltaT>=maxGapCloseFrames) return false; //Gap must be at most maxGapCloseFrames
+    IdxT s = locSpecies(locI);
+    if(s != trackSpecies(j)) return false; //Only link within a species
+    if(!policies[s].pairCost(locI, tracks[j].front(), deltaT, C)) return false; //gating constraint violated
+    C+= policies[s].gapCloseLinkCost(deltaT);
+    return true;
+}
+
+template<class CostPolicyT>
+void LAPTrack::enumerateGapCloseEdgesKernel(IdxT endBegin, IdxT endEnd, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    const std::vector<CostPolicyT> policies = makeSpeciesPolicies<CostPolicyT>(*this);
+
+    //Blocks of track ends are enumerated in parallel
+    const IdxT blockSize = 64;
+    IdxT nBlocks = (endEnd-endBegin+blockSize-1)/blockSize;
+    auto enumerateBlock = [&](IdxT b, IndexVectorT &bEnds, IndexVectorT &bStarts, std::vector<FloatT> &bCosts) {
+        //connect trackI to trackJ so trackJ must start after trackI ends.
+        for(IdxT i=endBegin+b*blockSize; i<std::min(endEnd, endBegin+(b+1)*blockSize); i++){
+            if(!isGapCloseEnd(i)) continue;
+            IdxT trackIend = frameIdx(tracks[i].back()); //frame death
+            //Tracks are in birth order, so the tracks born within maxGapCloseFrames are a contiguous range
+            IdxT jBegin = frameBirthStartIdx(trackIend+2-firstFrame);
+            IdxT gapEndFrame = trackIend+maxGapCloseFrames-firstFrame; //First frame too far to connect
+            IdxT jEnd = gapEndFrame<nFrames ? frameBirthStartIdx(gapEndFrame) : nTracks;
+            for(IdxT j=jBegin; j<jEnd; j++){
+                FloatT C;
+                if(!computeGapCloseCost(policies, i, j, C)) continue;
+                //Record cost
+                bEnds.push_back(i);
+                bStarts.push_back(j);
+                bCosts.push_back(C);
+            }
+        }
+    };
+    std::vector<std::exception_ptr> errors(nBlocks); //Exceptions cannot leave the parallel region
+
+    if(maxCandidatesPerLoc>0) {
+        //Keep only the maxCandidatesPerLoc lowest cost candidates for each track end and start.  Each block is
+        //pushed into the heaps as soon as it is enumerated, so only the heaps and the blocks in progress are
+        //held.  The heaps break ties by candidate index, so the result does not depend on the block order.
+        CandidateHeapT endCands(nTracks, maxCandidatesPerLoc);
+        CandidateHeapT startCands(nTracks, maxCandidatesPerLoc);
+        #pragma omp parallel
+        {
+            IndexVectorT bEnds, bStarts;
+            std::vector<FloatT> bCosts;
+            #pragma omp for schedule(dynamic)
+            for(IdxT b=0; b<nBlocks; b++) {
+                try {
+                    bEnds.clear();
+                    bStarts.clear();
+                    bCosts.clear();
+                    enumerateBlock(b, bEnds, bStarts, bCosts);
+                    #pragma omp critical(gapCloseCandidates)
+                    for(size_t e=0; e<bCosts.size(); e++) {
+                        endCands.push(bEnds[e], bCosts[e], bStarts[e]);
+                        startCands.push(bStarts[e], bCosts[e], bEnds[e]);
+                    }
+                } catch(...) {
+                    errors[b] = std::current_exception();
+                }
+            }
+        }
+        for(auto &error: errors) if(error) std::rethrow_exception(error);
+        mergeCandidates(endCands, startCands, ends, starts, costs);
+        nGapCloseCandidateCapHits = endCands.nCapped() + startCands.nCapped();
+        return;
+    }
+
+    //Without a cap each block is enumerated into its own buffers.  Concatenating the buffers in block order
+    //gives the serial enumeration order for any number of threads.
+    std::vector<IndexVectorT> blockEnds(nBlocks), blockStarts(nBlocks);
+    std::vector<std::vector<FloatT>> blockCosts(nBlocks);
+    #pragma omp parallel for schedule(dynamic)
+    for(IdxT b=0; b<nBlocks; b++) {
+        try {
+            enumerateBlock(b, blockEnds[b], blockStarts[b], blockCosts[b]);
+        } catch(...) {
+            errors[b] = std::current_exception();
+        }
+    }
+    for(auto &error: errors) if(error) std::rethrow_exception(error);
+
+    std::vector<size_t> blockOffsets(nBlocks+1, 0);
+    for(IdxT b=0; b<nBlocks; b++) blockOffsets[b+1] = blockOffsets[b] + blockCosts[b].size();
+    ends.resize(blockOffsets[nBlocks]);
+    starts.resize(blockOffsets[nBlocks]);
+    costs.resize(blockOffsets[nBlocks]);
+    #pragma omp parallel for schedule(static)
+    for(IdxT b=0; b<nBlocks; b++) {
+        std::copy(blockEnds[b].begin(), blockEnds[b].end(), ends.begin()+blockOffsets[b]);
+        std::copy(blockStarts[b].begin(), blockStarts[b].end(), starts.begin()+blockOffsets[b]);
+        std::copy(blockCosts[b].begin(), blockCosts[b].end(), costs.begin()+blockOffsets[b]);
+    }
+}
+
+template<class CostPolicyT>
+void LAPTrack::enumerateAppendedGapCloseEdgesKernel(IdxT boundaryFrame, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    IdxT firstStart = frameBirthStartIdx(boundaryFrame+1-firstFrame); //First track born after the boundary
+    IdxT firstEndFrame = std::max(firstFrame, boundaryFrame+2-maxGapCloseFrames);
+    const std::vector<CostPolicyT> policies = makeSpeciesPolicies<CostPolicyT>(*this);
+    for(IdxT f=firstEndFrame; f<=lastFrame; f++){
+        const IVecT &locs = frameLocIdx(f-firstFrame);
+        for(IdxT n=0; n<static_cast<IdxT>(locs.n_elem); n++){
+            IdxT i = trackAssignment(locs(n));
+            if(i<0 || tracks[i].back()!=locs(n) || !isGapCloseEnd(i)) continue; //Not a track end
+            for(IdxT j=std::max(firstStart, frameBirthStartIdx(f+2-firstFrame)); j<nTracks; j++){
+                if(birthFrameIdx[j]-f >= maxGapCloseFrames) break; //Tracks are in birth order
+                FloatT C;
+                if(!computeGapCloseCost(policies, i, j, C)) continue;
+                ends.push_back(i);
+                starts.push_back(j);
+                costs.push_back(C);
+            }
+        }
+    }
+}
+
+template<class CostPolicyT>
+LAPTrack::IVecT
+LAPTrack::solveGapCloseImplicitKernel(IdxT &nEvaluations) const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    const std::vector<CostPolicyT> policies = makeSpeciesPolicies<CostPolicyT>(*this);
+    VecT birthC, deathC;
+    unlinkedCosts(birthC, deathC);
+    //Index the possible gap-close track ends by end frame with a counting sort
+    IVecT frameEndStartIdx(nFrames+1, arma::fill::zeros);
+    for(IdxT i=0; i<nTracks; i++) if(isGapCloseEnd(i)) frameEndStartIdx(frameIdx(tracks[i].back())-firstFrame+1)++;
+    for(IdxT f=0; f<nFrames; f++) frameEndStartIdx(f+1) += frameEndStartIdx(f);
+    IndexVectorT endOrder(frameEndStartIdx(nFrames));
+    IndexVectorT next_pos(frameEndStartIdx.begin(), frameEndStartIdx.end()-1);
+    for(IdxT i=0; i<nTracks; i++) if(isGapCloseEnd(i)) endOrder[next_pos[frameIdx(tracks[i].back())-firstFrame]++] = i;
+
+    auto oracle = [&](IdxT r, std::vector<IdxT> &cols, std::vector<FloatT> &vals) {
+        if(r<nTracks) { //Track end r: connections to later track starts and death
+            IdxT i = r;
+            if(isGapCloseEnd(i)) {
+                IdxT trackIend = frameIdx(tracks[i].back());
+                for(IdxT j=frameBirthStartIdx(trackIend+2-firstFrame); j<nTracks; j++){
+                    if(birthFrameIdx[j]-trackIend >= maxGapCloseFrames) break; //Tracks are in birth order
+                    FloatT C;
+                    if(!computeGapCloseCost(policies, i, j, C)) continue;
+                    cols.push_back(j);
+                    vals.push_back(C);
+                }
+            }
+            cols.push_back(nTracks+i);
+            vals.push_back(deathC(trackSpecies(i)));
+        } else { //Track start j: birth and the dummy entries mirroring each connection into j
+            IdxT j = r-nTracks;
+            cols.push_back(j);
+            vals.push_back(birthC(trackSpecies(j)));
+            IdxT trackJstart = birthFrameIdx[j];
+            IdxT firstEndFrame = std::max(firstFrame, trackJstart-maxGapCloseFrames+1);
+            IdxT lastEndFrame = trackJstart-2;
+            if(lastEndFrame < firstEndFrame) return;
+            for(IdxT e=frameEndStartIdx(firstEndFrame-firstFrame); e<frameEndStartIdx(lastEndFrame-firstFrame+1); e++){
+                IdxT i = endOrder[e];
+                FloatT C;
+                if(!computeGapCloseCost(policies, i, j, C)) continue;
+                cols.push_back(nTracks+i);
+                vals.push_back(cost_epsilon);
+            }
+        }
+    };
+    return LAP_JVSparse<FloatT>::solveOracle(2*nTracks, oracle, gapCloseRowCacheBytes, nEvaluations, cancelHook());
+}
+
+} /* namespace tracker */
+
+#endif /* TRACKER_LAPTRACKCOSTPOLICY_H */
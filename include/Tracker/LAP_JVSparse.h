@@ -13,30 +13,58 @@
 #define TRACKER_LAP_JVSPARSE_H
 
 #include <armadillo>
+#include <chrono>
+#include <functional>
 #include <vector>
 
+#include "Tracker/TrackerIndex.h"
+
 namespace tracker {
 
 template<class FloatT>
 class LAP_JVSparse {
-    using IdxT = int32_t; //The type for the indexes
+    using IdxT = IndexT; //The type for the indexes.  int32_t, or int64_t with OPT_INDEX64
     using SpMatT = arma::SpMat<FloatT>;
     using VecT = arma::Col<FloatT>;
     using IVecT = arma::Col<IdxT>;
     using IMatT = arma::Mat<IdxT>;
 
 public:
+    using RowOracleT = std::function<void(IdxT row, std::vector<IdxT> &cols, std::vector<FloatT> &vals)>; /**< Generates the entries of a row on demand */
+    using StopT = std::function<bool()>; /**< Polled while solving.  Returning true stops the solver early. */
+
     static IVecT solve(const SpMatT &C);
-    static void solveLAP_orig(const SpMatT &C, IVecT &x, IVecT &y, VecT &u, VecT &v);
+    static const IdxT DefaultSparseAugmentMinSize = 257; /**< Smallest n for which lap_orig augments with the touched-column heap */
+    static void solveLAP_orig(const SpMatT &C, IVecT &x, IVecT &y, VecT &u, VecT &v,
+                              IdxT sparseAugmentMinSize=DefaultSparseAugmentMinSize);
+    static IVecT solveOracle(IdxT n, const RowOracleT &oracle, size_t cacheBytes, IdxT &nEvaluations, const StopT &stop=StopT());
+    static IVecT solvePadded(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                             const StopT &stop=StopT());
+    static const IdxT MaxDenseSize = 32; /**< Largest padded size nR+nC accepted by solvePaddedDense() */
+    static IVecT solvePaddedDense(IdxT nR, IdxT nC, const std::vector<IdxT> &rows, const std::vector<IdxT> &cols,
+                                  const std::vector<FloatT> &costs, const VecT &rowUnassigned, const VecT &colUnassigned,
+                                  FloatT dummyCost);
+    static IVecT solveGreedy(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                             IdxT nSwapPasses);
+    static IVecT solvePaddedBudgeted(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                                     double timeBudget, bool &completed);
+    static FloatT computePaddedCost(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned,
+                                   FloatT dummyCost, const IVecT &x);
     static VecT computeCost(const SpMatT &C, const IVecT &row_sol);
 
     static bool checkCosts(const SpMatT &C);
     static bool checkSolution(const SpMatT &C,const IVecT &x, const IVecT &y, const VecT &u, const VecT &v);
 
 private:
-    /* The original sparse lapjv code which is outdated and should be updated. */
-    static void lap_orig(IdxT n, const FloatT C_vals[], const IdxT C_cols[], const IdxT C_row_ptrs[],
-                           IdxT x[], IdxT y[], FloatT u[], FloatT v[]);    
+    using ClockT = std::chrono::steady_clock;
+    static void greedyMatch(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                            std::vector<IdxT> &row_match, std::vector<IdxT> &col_match, std::vector<FloatT> &match_cost);
+    static IVecT paddedSolution(const std::vector<IdxT> &row_match, const std::vector<IdxT> &col_match);
+
+    /* The original sparse lapjv code which is outdated and should be updated.  Returns false if stopped by stop. */
+    template<class RowsT>
+    static bool lap_orig(IdxT n, RowsT &rows, IdxT x[], IdxT y[], FloatT u[], FloatT v[], const StopT &stop=StopT(),
+                         IdxT sparseAugmentMinSize=DefaultSparseAugmentMinSize);
 };
 
 } /* namespace tracker */
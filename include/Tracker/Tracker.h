@@ -14,14 +14,21 @@
 #ifndef TRACKER_TRACKER_H
 #define TRACKER_TRACKER_H
 
+#include <atomic>
 #include <cstdint>
 #include <armadillo>
+#include <exception>
+#include <functional>
+#include <iostream>
 #include <map>
+#include <limits>
 #include <string>
 #include <list>
+#include <thread>
 #include <vector>
 
 #include "BacktraceException/BacktraceException.h"
+#include "Tracker/TrackerIndex.h"
 namespace tracker {
 
 
@@ -42,10 +49,17 @@ struct LogicalError : public TrackerError
     LogicalError(std::string message) : TrackerError("LogicalError",message) {}
 };
 
+/** @brief Tracking was stopped by cancelTracking().
+ */
+struct CancelledError : public TrackerError
+{
+    CancelledError(std::string message) : TrackerError("CancelledError",message) {}
+};
+
 class Tracker {
 public:
     using FloatT = double; /* Set this to control float/double settings */
-    using IdxT = int32_t;
+    using IdxT = IndexT; /* int32_t, or int64_t with OPT_INDEX64 */
     using VecT = arma::Col<FloatT>;
     using MatT = arma::Mat<FloatT>;
     using IVecT = arma::Col<IdxT>;
@@ -65,9 +79,13 @@ public:
     MatT SE_position; // N x nDims;
     MatT feature; // N x nFeatures;
     MatT SE_feature; // N x nFeatures;
+    IVecT species; // length: N, or empty for a single species.  Species labels 0..nSpecies-1.  Localizations are only linked within a species.
+    IdxT nSpecies = 1;
     IdxT firstFrame = 0; //index of first frame
     IdxT lastFrame = 0; //index of last frame
     IdxT nFrames = 0; //lastFrame-firstFrame+1
+    enum SpatialOrderT {ORDER_INPUT=0, ORDER_MORTON=1, ORDER_HILBERT=2};
+    SpatialOrderT spatialOrder = ORDER_INPUT; //Sort each frame's localizations along a space-filling curve so nearby localizations get nearby LAP rows and columns
 
     //Pre-computed on initialization
     IVecT nFrameLocs; //number of localizations for each frame, continuous indexing from firstFrame=0 to lastFrame=nFrames-1
@@ -81,18 +99,134 @@ public:
      * the higher-level matlab code allowing each subclass to take in arbitrary floating point arguments.
      */
     Tracker(const VecParamT &param);
-    virtual ~Tracker() {}
+    virtual ~Tracker();
     virtual VecParamT getStats() const;
     virtual void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_);
     virtual void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_);
+    virtual void initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_,
+                                  const IVecT &species_);
+    IdxT locSpecies(IdxT loc) const {return species.is_empty() ? 0 : species(loc);}
     virtual void generateTracks()=0;
     
     void printTracks() const;
+    IVecT getTrackIds() const;
+    void getTrackOffsets(IVecT &offsets, IVecT &locs) const;
+    VecParamT getTrackStats(IdxT maxMSDLag) const;
+    void buildQueryIndex();
+    IVecT queryTracks(IdxT startFrame, IdxT endFrame, const VecT &roiMin, const VecT &roiMax) const;
+    void saveState(const std::string &filename) const;
+    void loadState(const std::string &filename);
+
+    //Background tracking on a worker thread
+    void startGenerateTracks();
+    void cancelTracking();
+    bool isTrackingRunning() const;
+    void waitTracking();
+    virtual VecParamT getProgress() const;
 protected:
     static const FloatT log2pi;// = log(2*pi);
+    static const char checkpointMagic[8]; //Identifies a saveState() file
+    static const uint32_t checkpointVersion = 2;
     IVecT trackAssignment; //A vector giving the track index of each localizations
+
+    /** Packed R-tree over the space-time bounding boxes of the tracks for queryTracks() */
+    struct QueryIndexT {
+        IdxT nTracks = -1; //Number of tracks indexed, or -1 if not built
+        IVecT order; //Track of each leaf, in Hilbert order of the box centers
+        MatT lo, hi; //(nDims+1) x nNodes box corners.  Row 0 is the frame span.  Leaves are nodes 0..nTracks-1.
+        IndexVectorT levelStart; //First node of each level from the leaves up, then the number of nodes
+        IVecT offsets, locs; //The tracks as from getTrackOffsets() for the exact test of the leaves
+    };
+    static const IdxT queryIndexFanout = 16; //Children of each R-tree node
+    QueryIndexT queryIndex;
+
+    std::thread worker; //Runs generateTracks() for startGenerateTracks()
+    std::atomic<bool> workerRunning{false};
+    std::atomic<bool> cancelRequested{false};
+    std::exception_ptr workerError; //Exception thrown by generateTracks() on the worker
+    void checkCancelled() const;
+    std::function<bool()> cancelHook() const {return [this]() {return cancelRequested.load();};} //Lets the LAP solvers stop on cancelTracking()
+    void stopWorker(); //Cancel and join the worker.  Subclass destructors must call this before their members are destroyed.
+
+    void extendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_);
+    void shareLocalizations(const Tracker &source);
+    void sortFrameLocs(IdxT firstSortFrame);
+    static uint64_t curveKey(std::vector<uint32_t> &coords, IdxT nBits, bool hilbert);
+
+    //Binary serialization of the full tracking state for saveState() and loadState().  Subclasses extend these.
+    virtual void writeState(std::ostream &out) const;
+    virtual void readState(std::istream &in);
+
+    /** The Tracker members restored by readState(), loaded and validated before any member is replaced */
+    struct SavedStateT {
+        IdxT N, nDims, nFeatures, firstFrame, lastFrame, nFrames, nSpecies;
+        IVecT frameIdx, species, nFrameLocs, trackAssignment;
+        MatT position, SE_position, feature, SE_feature;
+        IVecFieldT frameLocIdx;
+        TrackVecT tracks;
+    };
+    void readSavedState(std::istream &in, SavedStateT &saved) const;
+    void commitSavedState(SavedStateT &saved);
+    static void checkSavedSize(std::istream &in, uint64_t nElem, size_t elemSize);
+    template<class T> static void writeValue(std::ostream &out, const T &val);
+    template<class T> static void readValue(std::istream &in, T &val);
+    template<class ArrT> static void writeArray(std::ostream &out, const ArrT &arr);
+    template<class ArrT> static void readArray(std::istream &in, ArrT &arr);
+    template<class T> static void writeVector(std::ostream &out, const std::vector<T> &vec);
+    template<class T> static void readVector(std::istream &in, std::vector<T> &vec);
 };
 
+template<class T>
+void Tracker::writeValue(std::ostream &out, const T &val)
+{
+    out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<class T>
+void Tracker::readValue(std::istream &in, T &val)
+{
+    if(!in.read(reinterpret_cast<char*>(&val), sizeof(T))) throw ParameterValueError("Checkpoint: unexpected end of file");
+}
+
+/* Write an armadillo dense array as its dimensions followed by the raw column-major elements */
+template<class ArrT>
+void Tracker::writeArray(std::ostream &out, const ArrT &arr)
+{
+    writeValue(out, static_cast<uint64_t>(arr.n_rows));
+    writeValue(out, static_cast<uint64_t>(arr.n_cols));
+    out.write(reinterpret_cast<const char*>(arr.memptr()), arr.n_elem*sizeof(typename ArrT::elem_type));
+}
+
+template<class ArrT>
+void Tracker::readArray(std::istream &in, ArrT &arr)
+{
+    uint64_t n_rows, n_cols;
+    readValue(in, n_rows);
+    readValue(in, n_cols);
+    if(n_cols && n_rows > std::numeric_limits<uint64_t>::max()/n_cols) throw ParameterValueError("Checkpoint: corrupt array size");
+    checkSavedSize(in, n_rows*n_cols, sizeof(typename ArrT::elem_type));
+    arr.set_size(n_rows, n_cols);
+    if(!in.read(reinterpret_cast<char*>(arr.memptr()), arr.n_elem*sizeof(typename ArrT::elem_type)))
+        throw ParameterValueError("Checkpoint: unexpected end of file");
+}
+
+template<class T>
+void Tracker::writeVector(std::ostream &out, const std::vector<T> &vec)
+{
+    writeValue(out, static_cast<uint64_t>(vec.size()));
+    out.write(reinterpret_cast<const char*>(vec.data()), vec.size()*sizeof(T));
+}
+
+template<class T>
+void Tracker::readVector(std::istream &in, std::vector<T> &vec)
+{
+    uint64_t size;
+    readValue(in, size);
+    checkSavedSize(in, size, sizeof(T));
+    vec.resize(size);
+    if(!in.read(reinterpret_cast<char*>(vec.data()), size*sizeof(T))) throw ParameterValueError("Checkpoint: unexpected end of file");
+}
+
 } /* namespace tracker */
 
 #endif /* TRACKER_TRACKER_H */
@@ -0,0 +1,47 @@
+/** @file TrackerIndex.h
+ * @author Mark J. Olah (mjo\@cs.unm.edu)
+ * @date 2015-2019
+ * @brief The index type shared by Tracker and LAP_JVSparse and checked narrowing to it
+ *
+ * The index type is int32_t by default.  Building with the OPT_INDEX64 CMake option defines TRACKER_INDEX64
+ * for the library and its users, making it int64_t for datasets with more than 2^31 localizations or
+ * cost matrix entries.
+ */
+#ifndef TRACKER_TRACKERINDEX_H
+#define TRACKER_TRACKERINDEX_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace tracker {
+
+#ifdef TRACKER_INDEX64
+using IndexT = int64_t;
+#else
+using IndexT = int32_t;
+#endif
+
+/**
+ * Narrow a size or index to the index type, detecting overflow.
+ *
+ * @param[in] val size or index to convert
+ * @param[in] what description of val for the error message
+ * @returns val as IdxT
+ * @throws std::overflow_error if val is not representable as IdxT
+ */
+template<class IdxT, class T>
+inline IdxT checkedIndex(T val, const char *what)
+{
+    static_assert(std::is_integral<T>::value && std::is_integral<IdxT>::value, "checkedIndex: integral types only");
+    IdxT idx = static_cast<IdxT>(val);
+    if(static_cast<T>(idx) != val || (std::is_unsigned<T>::value && idx < 0))
+        throw std::overflow_error(std::string(what)+": "+std::to_string(val)+
+                                  " overflows the index type.  Build with OPT_INDEX64 for larger problems.");
+    return idx;
+}
+
+} /* namespace tracker */
+
+#endif /* TRACKER_TRACKERINDEX_H */
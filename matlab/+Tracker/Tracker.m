@@ -31,12 +31,16 @@ classdef Tracker < MexIFace.MexIFaceMixin
             stats=obj.call('getStats');
         end
 
-        function initializeTracks(obj, frameIdx, position, positionSE, feature, featureSE)
+        function initializeTracks(obj, frameIdx, position, positionSE, feature, featureSE, species)
+            % species - [optional] 0-based species label of each localization.  Use empty feature and featureSE
+            %           for no features.
             frameIdx = int32(frameIdx(:));
             if nargin==4
                 obj.call('initializeTracks',frameIdx, position, positionSE);
             elseif nargin==6
                 obj.call('initializeTracks',frameIdx, position, positionSE, feature, featureSE);
+            elseif nargin==7
+                obj.call('initializeTracks',frameIdx, position, positionSE, feature, featureSE, int32(species(:)));
             end
         end
 
@@ -63,6 +67,77 @@ classdef Tracker < MexIFace.MexIFaceMixin
         function tracks = getTracks(obj)
             tracks = obj.call('getTracks');
         end
+
+        function startGenerateTracks(obj)
+            % Start generateTracks on a background thread and return immediately.
+            % Poll with getProgress, stop with cancelTracking, and collect with waitTracking.
+            obj.call('startGenerateTracks');
+        end
+
+        function progress = getProgress(obj)
+            % Struct with fields running, cancelRequested, phase (0=not started, 1=linking F2F,
+            % 2=closing gaps, 3=done), framesLinked, and nFrames.
+            progress = obj.call('getProgress');
+        end
+
+        function cancelTracking(obj)
+            % Cooperatively stop background tracking. waitTracking will then raise an error.
+            obj.call('cancelTracking');
+        end
+
+        function nTracks = waitTracking(obj)
+            % Block until background tracking finishes. Use getTracks or getTrackIds for the results.
+            nTracks = obj.call('waitTracking');
+        end
+
+        function trackIds = getTrackIds(obj)
+            % Track index of each localization in the same indexing as getTracks, or -1 if not in a track.
+            % Returns a single array, which is much faster than getTracks for many tracks.
+            trackIds = obj.call('getTrackIds');
+        end
+
+        function [offsets, locs] = getTrackOffsets(obj)
+            % Tracks as flat compressed sparse rows: track t is locs(offsets(t)+1:offsets(t+1)).
+            % Localization indexes are in the same indexing as getTracks.
+            [offsets, locs] = obj.call('getTrackOffsets');
+        end
+
+        function stats = getTrackStats(obj, maxMSDLag)
+            % Per-track statistics as a struct of column vectors with one entry per track: startFrame,
+            % endFrame, nLocs, lifetime, nBlinks, darkFrames, maxDarkFrames and D, the localization error
+            % corrected diffusion estimate.  msd and msdCount are nTracks x maxMSDLag, where column k is the
+            % mean squared displacement over pairs k frames apart.
+            if nargin<2
+                maxMSDLag = 10;
+            end
+            stats = obj.call('getTrackStats', int32(maxMSDLag));
+            nTracks = numel(stats.nLocs);
+            stats.msd = reshape(stats.msd, nTracks, maxMSDLag);
+            stats.msdCount = reshape(stats.msdCount, nTracks, maxMSDLag);
+        end
+
+        function trackIds = queryTracks(obj, frameRange, roiMin, roiMax)
+            % Tracks with at least one localization in frames frameRange(1)..frameRange(2) inside the ROI
+            % [roiMin, roiMax], as sorted track indexes in the same indexing as getTrackIds.  roiMin and roiMax
+            % have one value per position column.  Omit the ROI to query frames only.  Uses the index built
+            % when gaps are closed, so it is fast for many tracks.
+            if nargin<4
+                roiMin = [];
+                roiMax = [];
+            end
+            trackIds = obj.call('queryTracks', int32(frameRange(:)), double(roiMin(:)), double(roiMax(:)));
+        end
+
+        function saveState(obj, filename)
+            % Save localizations, tracks and intermediate tracking state to a binary checkpoint file
+            obj.call('saveState', char(filename));
+        end
+
+        function loadState(obj, filename)
+            % Restore a checkpoint from saveState.  Parameters of this object are kept.
+            obj.call('loadState', char(filename));
+            obj.initialized = true;
+        end
     end %public methods
     methods (Access=protected)
         function checkPoints(obj,points)
@@ -3,8 +3,19 @@
  *  @date 2015-2019
  *  @brief The member definitions for LAPTrack
  */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <numeric>
+#include <queue>
+
 #include "Tracker/LAPTrack.h"
 #include "Tracker/LAP_JVSparse.h"
+#include "Tracker/LAPTrackCostPolicy.h"
 
 namespace tracker {
 
@@ -13,14 +24,22 @@ LAPTrack::LAPTrack(const VecParamT &param) : Tracker(param)
 //     for(auto &stat: param)
 //         std::cout<<stat.first<<":"<<stat.second<<std::endl;
     //Read in parameters
-    if (param.find("D") != param.end())
+    if (param.find("D") != param.end()) {
         D = static_cast<FloatT>(param.at("D")(0));
-    if (param.find("kon") != param.end())
+        if(param.at("D").n_elem > 1) speciesD = param.at("D");
+    }
+    if (param.find("kon") != param.end()) {
         kon = static_cast<FloatT>(param.at("kon")(0));
-    if (param.find("koff") != param.end())
+        if(param.at("kon").n_elem > 1) speciesKon = param.at("kon");
+    }
+    if (param.find("koff") != param.end()) {
         koff = static_cast<FloatT>(param.at("koff")(0));
-    if (param.find("rho") != param.end())
+        if(param.at("koff").n_elem > 1) speciesKoff = param.at("koff");
+    }
+    if (param.find("rho") != param.end()) {
         rho = static_cast<FloatT>(param.at("rho")(0));
+        if(param.at("rho").n_elem > 1) speciesRho = param.at("rho");
+    }
     if (param.find("maxSpeed") != param.end())
         maxSpeed = static_cast<FloatT>(param.at("maxSpeed")(0));
     if (param.find("maxPositionDisplacementSigma") != param.end())
@@ -33,33 +52,134 @@ LAPTrack::LAPTrack(const VecParamT &param) : Tracker(param)
         minGapCloseTrackLength =  static_cast<IdxT>(param.at("minGapCloseTrackLength")(0));
     if (param.find("minFinalTrackLength") != param.end())
         minFinalTrackLength =  static_cast<IdxT>(param.at("minFinalTrackLength")(0));
+    if (param.find("gapCloseBlockFrames") != param.end())
+        gapCloseBlockFrames =  static_cast<IdxT>(param.at("gapCloseBlockFrames")(0));
+    if (param.find("gapCloseBlockExact") != param.end())
+        gapCloseBlockExact =  param.at("gapCloseBlockExact")(0) != 0;
+    if (param.find("gapCloseImplicit") != param.end())
+        gapCloseImplicit =  param.at("gapCloseImplicit")(0) != 0;
+    if (param.find("gapCloseRowCacheBytes") != param.end())
+        gapCloseRowCacheBytes =  static_cast<size_t>(param.at("gapCloseRowCacheBytes")(0));
+    if (param.find("gapCloseMemoryBudget") != param.end())
+        gapCloseMemoryBudget =  static_cast<size_t>(param.at("gapCloseMemoryBudget")(0));
+    if (param.find("maxCandidatesPerLoc") != param.end())
+        maxCandidatesPerLoc =  static_cast<IdxT>(param.at("maxCandidatesPerLoc")(0));
+    if (param.find("denseLinkMaxSize") != param.end()) {
+        denseLinkMaxSize =  static_cast<IdxT>(param.at("denseLinkMaxSize")(0));
+        if(denseLinkMaxSize > LAP_JVSparse<FloatT>::MaxDenseSize) {
+            std::ostringstream msg;
+            msg<<"denseLinkMaxSize: "<<denseLinkMaxSize<<" larger than the dense kernel maximum: "<<LAP_JVSparse<FloatT>::MaxDenseSize;
+            throw ParameterValueError(msg.str());
+        }
+    }
+    if (param.find("linkStrategy") != param.end()) {
+        IdxT strategy = static_cast<IdxT>(param.at("linkStrategy")(0));
+        if(strategy!=LINK_OPTIMAL && strategy!=LINK_GREEDY) {
+            std::ostringstream msg;
+            msg<<"Unknown linkStrategy: "<<strategy;
+            throw ParameterValueError(msg.str());
+        }
+        linkStrategy = static_cast<LinkStrategyT>(strategy);
+    }
+    if (param.find("greedySwapPasses") != param.end())
+        greedySwapPasses =  static_cast<IdxT>(param.at("greedySwapPasses")(0));
+    if (param.find("reportCostGap") != param.end())
+        reportCostGap =  param.at("reportCostGap")(0) != 0;
+    if (param.find("frameTimeBudget") != param.end())
+        frameTimeBudget = static_cast<FloatT>(param.at("frameTimeBudget")(0));
     if (param.find("featureVar") != param.end())
         featureVar = param.at("featureVar");
+    if (param.find("motionModel") != param.end()) {
+        IdxT model = static_cast<IdxT>(param.at("motionModel")(0));
+        if(model!=BROWNIAN && model!=CONSTANT_VELOCITY) {
+            std::ostringstream msg;
+            msg<<"Unknown motionModel: "<<model;
+            throw ParameterValueError(msg.str());
+        }
+        motionModel = static_cast<MotionModelT>(model);
+    }
+    if (param.find("velocityVar0") != param.end())
+        velocityVar0 = static_cast<FloatT>(param.at("velocityVar0")(0));
+    if (param.find("velocityD") != param.end())
+        velocityD = static_cast<FloatT>(param.at("velocityD")(0));
     //Pre-compute logarithms of commonly used values
     logkon = log(kon);
     log1mkon = log(1-kon);
     logkoff = log(koff);
     log1mkoff = log(1-koff);
     logrho = log(rho);
+    costKernels = makeCostKernels<GaussianCostPolicy<DynamicSize,DynamicSize>>();
+}
+
+LAPTrack::~LAPTrack()
+{
+    stopWorker(); //The worker may be using members of this class
 }
 
 LAPTrack::VecParamT LAPTrack::getStats() const
 {
     auto stats = Tracker::getStats();
-    stats["D"] = D;
-    stats["kon"] =kon;
-    stats["koff"] = koff;
-    stats["rho"] = rho;
+    stats["D"] = speciesD.is_empty() ? VecT{D} : speciesD;
+    stats["kon"] = speciesKon.is_empty() ? VecT{kon} : speciesKon;
+    stats["koff"] = speciesKoff.is_empty() ? VecT{koff} : speciesKoff;
+    stats["rho"] = speciesRho.is_empty() ? VecT{rho} : speciesRho;
     stats["maxSpeed"] = maxSpeed;
     stats["maxPositionDisplacementSigma"] = maxPositionDisplacementSigma;
     stats["maxFeatureDisplacementSigma"] = maxFeatureDisplacementSigma;
     stats["maxGapCloseFrames"] = maxGapCloseFrames;
     stats["minGapCloseTrackLength"] = minGapCloseTrackLength;
     stats["minFinalTrackLength"] = minFinalTrackLength;
+    stats["gapCloseBlockFrames"] = gapCloseBlockFrames;
+    stats["gapCloseBlockExact"] = static_cast<FloatT>(gapCloseBlockExact);
+    stats["nGapCloseSubproblems"] = nGapCloseSubproblems;
+    stats["gapCloseImplicit"] = static_cast<FloatT>(gapCloseImplicit);
+    stats["gapCloseRowCacheBytes"] = static_cast<FloatT>(gapCloseRowCacheBytes);
+    stats["gapCloseMemoryBudget"] = static_cast<FloatT>(gapCloseMemoryBudget);
+    stats["nGapCloseSpillRuns"] = nGapCloseSpillRuns;
+    stats["nGapCloseRowEvaluations"] = nGapCloseRowEvaluations;
+    stats["maxCandidatesPerLoc"] = maxCandidatesPerLoc;
+    stats["nF2FCandidateCapHits"] = nF2FCandidateCapHits;
+    stats["nGapCloseCandidateCapHits"] = nGapCloseCandidateCapHits;
+    stats["denseLinkMaxSize"] = denseLinkMaxSize;
+    stats["linkStrategy"] = static_cast<FloatT>(linkStrategy);
+    stats["greedySwapPasses"] = greedySwapPasses;
+    stats["reportCostGap"] = static_cast<FloatT>(reportCostGap);
+    stats["frameTimeBudget"] = frameTimeBudget;
+    stats["nF2FDegradedFrames"] = nF2FDegradedFrames;
+    if(frameTimeBudget>0) {
+        stats["f2fFrameSeconds"] = f2fFrameSeconds;
+        stats["f2fFrameDegraded"] = arma::conv_to<VecT>::from(f2fFrameDegraded);
+    }
+    if(reportCostGap) {
+        stats["f2fLinkCost"] = f2fLinkCost;
+        stats["f2fOptimalCost"] = f2fOptimalCost;
+        stats["f2fCostGap"] = f2fLinkCost - f2fOptimalCost;
+        stats["gapCloseLinkCost"] = gapCloseLinkCost;
+        stats["gapCloseOptimalCost"] = gapCloseOptimalCost;
+        stats["gapCloseCostGap"] = gapCloseLinkCost - gapCloseOptimalCost;
+    }
     stats["featureVar"] = featureVar;
+    stats["motionModel"] = static_cast<FloatT>(motionModel);
+    stats["velocityVar0"] = velocityVar0;
+    stats["velocityD"] = velocityD;
     return stats;
 }
 
+/**
+ * Progress of tracking, which may be running in the background from startGenerateTracks().
+ * 
+ * phase is 0 before tracking, 1 while linking F2F, 2 while closing gaps, and 3 when finished.
+ * framesLinked counts the frames linked out of nFrames.
+ */
+LAPTrack::VecParamT LAPTrack::getProgress() const
+{
+    auto progress = Tracker::getProgress();
+    progress["phase"] = static_cast<FloatT>(progressPhase);
+    progress["framesLinked"] = progressFrame;
+    progress["nFrames"] = nFrames;
+    return progress;
+}
+
 void LAPTrack::initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_)
 {
     MatT feature_, SE_feature_;
@@ -68,10 +188,157 @@ void LAPTrack::initializeTracks(const IVecT &frameIdx_, const MatT &position_, c
 
 void LAPTrack::initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_)
 {
-    Tracker::initializeTracks(frameIdx_, position_, SE_position_, feature_,SE_feature_);
+    IVecT species_;
+    initializeTracks(frameIdx_, position_, SE_position_, feature_, SE_feature_, species_);
+}
+
+/**
+ * Initialize with a species label for each localization.  The D, kon, koff, and rho parameters may be given
+ * with one value per species.  Each F2F LAP is solved as independent per-species blocks.
+ */
+void LAPTrack::initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_,
+                                const IVecT &species_)
+{
+    Tracker::initializeTracks(frameIdx_, position_, SE_position_, feature_,SE_feature_, species_);
+    initializeTrackingState();
+}
+
+/**
+ * Check that each per-species parameter has one value for each of nSpecies_ species.
+ */
+void LAPTrack::checkSpeciesParams(IdxT nSpecies_) const
+{
+    for(const VecT *values: {&speciesD, &speciesKon, &speciesKoff, &speciesRho}) {
+        if(!values->is_empty() && static_cast<IdxT>(values->n_elem) != nSpecies_) {
+            std::ostringstream msg;
+            msg<<"LAPTrack: per-species parameters have "<<values->n_elem<<" values for "<<nSpecies_<<" species";
+            throw ParameterValueError(msg.str());
+        }
+    }
+}
+
+/**
+ * Reset the tracking state for the current localizations.
+ */
+void LAPTrack::initializeTrackingState()
+{
+    checkSpeciesParams(nSpecies);
     frameBirthStartIdx.clear();
     birthFrameIdx.clear();
+    if(motionModel==CONSTANT_VELOCITY) {
+        //Every localization starts with the prior state. Linking updates the state as tracks are extended.
+        velocity.zeros(N,nDims);
+        velocityVar.set_size(N,nDims);
+        velocityVar.fill(velocityVar0);
+    } else {
+        velocity.reset();
+        velocityVar.reset();
+    }
+    selectCostKernels();
     state = UNTRACKED;
+    progressPhase = PHASE_IDLE;
+    progressFrame = 0;
+}
+
+/**
+ * Choose the cost kernels for the current nDims and nFeatures.
+ * 
+ * The common 2D and 3D cases with up to 2 features use kernels with compile-time loop bounds.
+ * All other cases use the run-time sized kernels.  The choice is made once per initializeTracks()
+ * so linkF2F() and closeGaps() pay no per-pair dispatch cost.
+ */
+void LAPTrack::selectCostKernels()
+{
+    if(customCostPolicy) return; //Kept from setCostPolicy()
+    if(nDims==2) {
+        switch(nFeatures) {
+            case 0: costKernels = makeCostKernels<GaussianCostPolicy<2,0>>(); return;
+            case 1: costKernels = makeCostKernels<GaussianCostPolicy<2,1>>(); return;
+            case 2: costKernels = makeCostKernels<GaussianCostPolicy<2,2>>(); return;
+        }
+    } else if(nDims==3) {
+        switch(nFeatures) {
+            case 0: costKernels = makeCostKernels<GaussianCostPolicy<3,0>>(); return;
+            case 1: costKernels = makeCostKernels<GaussianCostPolicy<3,1>>(); return;
+            case 2: costKernels = makeCostKernels<GaussianCostPolicy<3,2>>(); return;
+        }
+    }
+    costKernels = makeCostKernels<GaussianCostPolicy<DynamicSize,DynamicSize>>();
+}
+
+/**
+ * The costs of a track birth and a track death for each species from the current cost policy.
+ */
+void LAPTrack::unlinkedCosts(VecT &birthC, VecT &deathC) const
+{
+    birthC.set_size(nSpecies);
+    deathC.set_size(nSpecies);
+    for(IdxT s=0; s<nSpecies; s++) (this->*costKernels.unlinkedCosts)(s, birthC(s), deathC(s));
+}
+
+void LAPTrack::writeState(std::ostream &out) const
+{
+    Tracker::writeState(out);
+    writeValue(out, static_cast<int32_t>(state));
+    writeVector(out, birthFrameIdx);
+    writeArray(out, frameBirthStartIdx);
+    writeArray(out, velocity);
+    writeArray(out, velocityVar);
+}
+
+/**
+ * Restore the tracking state.  The parameters of this object are kept, so a state saved after linkF2F()
+ * can be gap-closed with different gap-closing parameters.  The whole state is read and checked before
+ * any member is replaced, so a corrupt checkpoint leaves this object as it was.
+ */
+void LAPTrack::readState(std::istream &in)
+{
+    SavedStateT saved;
+    readSavedState(in, saved);
+    checkSpeciesParams(saved.nSpecies); //The saved species must match the per-species parameters of this object
+    int32_t saved_state;
+    readValue(in, saved_state);
+    if(saved_state!=UNTRACKED && saved_state!=F2F_LINKED && saved_state!=GAPS_CLOSED) 
+        throw ParameterValueError("loadState: invalid LAPTrack state");
+    IndexVectorT birthFrames;
+    IVecT birthStarts;
+    MatT savedVelocity, savedVelocityVar;
+    readVector(in, birthFrames);
+    readArray(in, birthStarts);
+    readArray(in, savedVelocity);
+    readArray(in, savedVelocityVar);
+
+    //linkF2F() records a birth frame for every track and a first birth for every frame.  closeGaps() clears both.
+    auto nTracks = static_cast<IdxT>(saved.tracks.size());
+    bool linked = saved_state==F2F_LINKED;
+    if((linked || !birthFrames.empty()) && static_cast<IdxT>(birthFrames.size()) != nTracks)
+        throw ParameterValueError("loadState: inconsistent track birth frames");
+    if(std::any_of(birthFrames.begin(), birthFrames.end(), [&](IdxT f) {return f<saved.firstFrame || f>saved.lastFrame;}))
+        throw ParameterValueError("loadState: track birth frame out of range");
+    if(((linked || !birthStarts.is_empty()) && static_cast<IdxT>(birthStarts.n_elem) != saved.nFrames)
+            || (!birthStarts.is_empty() && (birthStarts.min()<0 || birthStarts.max()>nTracks)))
+        throw ParameterValueError("loadState: inconsistent frame birth index");
+    if(linked && static_cast<IdxT>(saved.trackAssignment.n_elem) != saved.N)
+        throw ParameterValueError("loadState: inconsistent track assignment");
+    bool hasVelocity = !savedVelocity.is_empty();
+    if((hasVelocity && (savedVelocity.n_rows != static_cast<arma::uword>(saved.N) || savedVelocity.n_cols != static_cast<arma::uword>(saved.nDims)))
+            || savedVelocityVar.n_rows != savedVelocity.n_rows || savedVelocityVar.n_cols != savedVelocity.n_cols)
+        throw ParameterValueError("loadState: inconsistent velocity state");
+
+    commitSavedState(saved);
+    state = static_cast<StateT>(saved_state);
+    birthFrameIdx.swap(birthFrames);
+    frameBirthStartIdx.swap(birthStarts);
+    velocity.swap(savedVelocity);
+    velocityVar.swap(savedVelocityVar);
+    if(motionModel==CONSTANT_VELOCITY && velocity.n_rows != static_cast<arma::uword>(N)) {
+        //Saved without a motion model.  Start all tracks from the prior.
+        velocity.zeros(N,nDims);
+        velocityVar.set_size(N,nDims);
+        velocityVar.fill(velocityVar0);
+    }
+    selectCostKernels();
+    if(state==GAPS_CLOSED) buildQueryIndex();
 }
 
 void LAPTrack::generateTracks()
@@ -135,6 +402,12 @@ void LAPTrack::linkF2F()
     IdxT curFrame = firstFrame;
     //Initialize first frame of tracks
     IVecT &initLocs = frameLocIdx(0);
+    nF2FCandidateCapHits = 0;
+    f2fLinkCost = 0;
+    f2fOptimalCost = 0;
+    f2fFrameSeconds.zeros(nFrames);
+    f2fFrameDegraded.zeros(nFrames);
+    nF2FDegradedFrames = 0;
     frameBirthStartIdx.set_size(nFrames);
     for(IdxT i=0; i< nFrameLocs(0); i++){
         IdxT locIdx = initLocs(i);
@@ -145,7 +418,48 @@ void LAPTrack::linkF2F()
         birthFrameIdx.push_back(curFrame); // record birth frame time
     }
 
+    progressPhase = PHASE_LINKING;
+    try {
+        linkFrames(curFrame);
+    } catch(CancelledError &) {
+        //Return to the UNTRACKED state so tracking can be restarted
+        tracks.clear();
+        trackAssignment.fill(-1);
+        birthFrameIdx.clear();
+        frameBirthStartIdx.clear();
+        if(motionModel==CONSTANT_VELOCITY) {
+            velocity.zeros();
+            velocityVar.fill(velocityVar0);
+        }
+        progressPhase = PHASE_IDLE;
+        progressFrame = 0;
+        throw;
+    }
+//     for(unsigned i=0; i<deathLocIdx.size();i++){
+//         if(deathLocIdx[i]==-1) {
+//             IdxT lastIdx = tracks[i].back();
+//             std::cout<<"Finalize Tracks: TrackID: "<<i<<" lastIdx:"<<lastIdx<<" frameIdx:"<<frameIdx(lastIdx)<<" deathLocIdx:"<<deathLocIdx[i]<<"\n";
+//             assert(frameIdx(lastIdx)==lastFrame);
+//         }
+//     }
+//     std::cout<<"NTracks: "<<tracks.size()<<"\n";
+//     std::cout<<"TrackAssignment: "<<trackAssignment.t()<<"\n";
+//     std::cout<<"frameBirthStartIdx: "<<IVecT(frameBirthStartIdx).t()<<"\n";
+//     std::cout<<"BirthFrameIdx: "<<IVecT(birthFrameIdx).t()<<"\n";
+    state = F2F_LINKED;
+}
+
+/**
+ * Link each non-empty frame after curFrame to the preceding non-empty frame by solving the F2F LAPs.
+ * Connections extend the existing tracks and births create new tracks.
+ */
+void LAPTrack::linkFrames(IdxT curFrame)
+{
+    VecT birthCosts, deathCosts;
+    unlinkedCosts(birthCosts, deathCosts);
     while(curFrame < lastFrame){  //When curFrame==lastFrame we have linked all frames
+        checkCancelled();
+        auto frameStart = std::chrono::steady_clock::now();
         IdxT nextFrame = curFrame+1;
 //         std::cout<<"------------F2F------------"<<"\n";
         while(frameLocIdx(nextFrame-firstFrame).is_empty()){
@@ -161,10 +475,44 @@ void LAPTrack::linkF2F()
         IdxT nNext=nFrameLocs(nextFrame-firstFrame);
 //         std::cout<<"Ncur:"<<nCur<<" Nnext:"<<nNext<<"\n";
         
-        SpMatT cost = computeF2FCostMat(curFrame, nextFrame); //Make the cost sparse matrix
-        arma::mat dC(cost);
-//         std::cout<<"Cost: ("<<cost.n_rows<<","<<cost.n_cols<<"):\n"<<dC<<"\n";
-        IVecT frame_assignment = LAP_JVSparse<FloatT>::solve(cost); //Solve for the assignments.
+        const IVecT &curLocs = frameLocIdx(curFrame-firstFrame);
+        const IVecT &nextLocs = frameLocIdx(nextFrame-firstFrame);
+        VecT deathC(nCur);
+        for(IdxT i=0; i<nCur; i++) deathC(i) = deathCosts(locSpecies(curLocs(i)));
+        VecT birthC(nNext);
+        for(IdxT j=0; j<nNext; j++) birthC(j) = birthCosts(locSpecies(nextLocs(j)));
+        //Solve for the assignments. Identical to solving the padded computeF2FCostMat() matrix.
+        IVecT frame_assignment;
+        if(nCur+nNext <= denseLinkMaxSize && linkStrategy==LINK_OPTIMAL && !reportCostGap) {
+            //Small problems skip the sparse matrix for the dense kernel
+            IndexVectorT rows, cols;
+            std::vector<FloatT> costs;
+            enumerateF2FEdges(curFrame, nextFrame, rows, cols, costs);
+            frame_assignment = LAP_JVSparse<FloatT>::solvePaddedDense(nCur, nNext, rows, cols, costs, deathC, birthC, cost_epsilon);
+        } else if(frameTimeBudget>0 && linkStrategy==LINK_OPTIMAL && !reportCostGap) {
+            //The budget covers the whole frame, including building the cost matrix
+            SpMatT cost = computeF2FEdgeMat(curFrame, nextFrame);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - frameStart;
+            bool completed;
+            frame_assignment = LAP_JVSparse<FloatT>::solvePaddedBudgeted(cost, deathC, birthC, cost_epsilon,
+                                                                         frameTimeBudget-elapsed.count(), completed);
+            if(!completed) {
+                f2fFrameDegraded(curFrame-firstFrame) = 1;
+                nF2FDegradedFrames++;
+            }
+        } else if(nSpecies>1) {
+            FloatT linkCost, optimalCost;
+            frame_assignment = solveSpeciesBlocks(curFrame, nextFrame, deathC, birthC, linkCost, optimalCost);
+            f2fLinkCost += linkCost;
+            f2fOptimalCost += optimalCost;
+        } else {
+            SpMatT cost = computeF2FEdgeMat(curFrame, nextFrame); //Make the sparse matrix of connection costs
+            FloatT linkCost, optimalCost;
+            frame_assignment = solveLink(cost, deathC, birthC, linkCost, optimalCost);
+            f2fLinkCost += linkCost;
+            f2fOptimalCost += optimalCost;
+        }
+        checkCancelled(); //A cancelled solve leaves every localization unconnected
 //         std::cout<<"frameAssignment: "<<frame_assignment.t()<<"\n";
         IVecT &curFrameIdxs = frameLocIdx(curFrame-firstFrame);
         IVecT &nextFrameIdxs = frameLocIdx(nextFrame-firstFrame);
@@ -186,6 +534,7 @@ void LAPTrack::linkF2F()
 
                 trackAssignment(next_loc_idx) = track_id;
                 tracks[track_id].push_back(next_loc_idx);
+                if(motionModel==CONSTANT_VELOCITY) updateMotionState(cur_id, next_loc_idx, nextFrame-curFrame);
 //                 std::cout<<"Connect: Track:"<<track_id<<" "<<cur_id<<"->"<<next_loc_idx<<"\n";
             }
         }
@@ -211,20 +560,150 @@ void LAPTrack::linkF2F()
 //                 std::cout<<"recorded birthFrameIdx: "<<birthFrameIdx.back()<<"\n";
             }
         }
+        std::chrono::duration<double> frameSeconds = std::chrono::steady_clock::now() - frameStart;
+        f2fFrameSeconds(curFrame-firstFrame) = frameSeconds.count();
         curFrame=nextFrame;
+        progressFrame = curFrame-firstFrame+1;
     }
-//     for(unsigned i=0; i<deathLocIdx.size();i++){
-//         if(deathLocIdx[i]==-1) {
-//             IdxT lastIdx = tracks[i].back();
-//             std::cout<<"Finalize Tracks: TrackID: "<<i<<" lastIdx:"<<lastIdx<<" frameIdx:"<<frameIdx(lastIdx)<<" deathLocIdx:"<<deathLocIdx[i]<<"\n";
-//             assert(frameIdx(lastIdx)==lastFrame);
-//         }
-//     }
-//     std::cout<<"NTracks: "<<tracks.size()<<"\n";
-//     std::cout<<"TrackAssignment: "<<trackAssignment.t()<<"\n";
-//     std::cout<<"frameBirthStartIdx: "<<IVecT(frameBirthStartIdx).t()<<"\n";
-//     std::cout<<"BirthFrameIdx: "<<IVecT(birthFrameIdx).t()<<"\n";
-    state = F2F_LINKED;
+}
+
+/**
+ * Solve the padded F2F LAP from curFrame to nextFrame as independent per-species blocks in parallel.
+ * 
+ * Connections are only made within a species, and frameLocIdx groups each frame by species, so the F2F
+ * LAP is block diagonal with a block for each species.  The result is in the form of solveLink() for the
+ * whole frame pair.
+ * 
+ * @param[in] deathC (nCur) cost of leaving each current frame localization unconnected
+ * @param[in] birthC (nNext) cost of leaving each next frame localization unconnected
+ * @param[out] linkCost total cost of the returned assignment, or 0 without reportCostGap
+ * @param[out] optimalCost total cost of the optimal assignment, or 0 without reportCostGap
+ */
+LAPTrack::IVecT
+LAPTrack::solveSpeciesBlocks(IdxT curFrame, IdxT nextFrame, const VecT &deathC, const VecT &birthC, FloatT &linkCost, FloatT &optimalCost) const
+{
+    const IVecT &curLocs = frameLocIdx(curFrame-firstFrame);
+    const IVecT &nextLocs = frameLocIdx(nextFrame-firstFrame);
+    IdxT nCur = static_cast<IdxT>(curLocs.n_elem);
+    IdxT nNext = static_cast<IdxT>(nextLocs.n_elem);
+    IndexVectorT rows, cols;
+    std::vector<FloatT> costs;
+    enumerateF2FEdges(curFrame, nextFrame, rows, cols, costs);
+    //The first row and column of each species block
+    IVecT rowStart(nSpecies+1, arma::fill::zeros), colStart(nSpecies+1, arma::fill::zeros);
+    for(IdxT i=0; i<nCur; i++) rowStart(locSpecies(curLocs(i))+1)++;
+    for(IdxT j=0; j<nNext; j++) colStart(locSpecies(nextLocs(j))+1)++;
+    rowStart = arma::cumsum(rowStart);
+    colStart = arma::cumsum(colStart);
+    std::vector<IndexVectorT> blockEdges(nSpecies);
+    for(IdxT e=0; e<static_cast<IdxT>(costs.size()); e++) blockEdges[locSpecies(curLocs(rows[e]))].push_back(e);
+
+    IVecT frame_assignment(nCur+nNext);
+    for(IdxT i=0; i<nCur; i++) frame_assignment(i) = nNext+i; //Default is a death
+    for(IdxT j=0; j<nNext; j++) frame_assignment(nCur+j) = j; //Default is a birth
+    FloatT totalLinkCost = 0, totalOptimalCost = 0;
+    std::vector<std::exception_ptr> errors(nSpecies); //Exceptions cannot leave the parallel region
+    std::atomic<bool> failed(false);
+    #pragma omp parallel for schedule(dynamic) reduction(+:totalLinkCost,totalOptimalCost)
+    for(IdxT s=0; s<nSpecies; s++){
+        if(failed.load()) continue;
+        try {
+            IdxT r0 = rowStart(s), c0 = colStart(s);
+            IdxT nR = rowStart(s+1)-r0, nC = colStart(s+1)-c0;
+            if(nR==0 || nC==0) { //All deaths or births
+                if(reportCostGap) {
+                    FloatT unlinked = 0;
+                    for(IdxT i=r0; i<r0+nR; i++) unlinked += deathC(i);
+                    for(IdxT j=c0; j<c0+nC; j++) unlinked += birthC(j);
+                    totalLinkCost += unlinked;
+                    totalOptimalCost += unlinked;
+                }
+                continue;
+            }
+            IndexVectorT local_rows, local_cols;
+            std::vector<FloatT> local_costs;
+            for(IdxT e : blockEdges[s]) {
+                local_rows.push_back(rows[e]-r0);
+                local_cols.push_back(cols[e]-c0);
+                local_costs.push_back(costs[e]);
+            }
+            SpMatT cost = makeEdgeMatrix(nR, nC, local_rows, local_cols, local_costs);
+            VecT blockDeathC = deathC.subvec(r0, r0+nR-1);
+            VecT blockBirthC = birthC.subvec(c0, c0+nC-1);
+            FloatT blockLinkCost, blockOptimalCost;
+            IVecT local_assignment = solveLink(cost, blockDeathC, blockBirthC, blockLinkCost, blockOptimalCost);
+            totalLinkCost += blockLinkCost;
+            totalOptimalCost += blockOptimalCost;
+            for(IdxT i=0; i<nR; i++) if(local_assignment(i) < nC) frame_assignment(r0+i) = c0+local_assignment(i);
+            for(IdxT j=0; j<nC; j++) //Connected columns pair their padding row with the dummy entry of their row
+                if(local_assignment(nR+j) != j) frame_assignment(nCur+c0+j) = nNext+r0+local_assignment(nR+j)-nC;
+        } catch(...) {
+            errors[s] = std::current_exception();
+            failed = true;
+        }
+    }
+    for(auto &error: errors) if(error) std::rethrow_exception(error);
+    linkCost = totalLinkCost;
+    optimalCost = totalOptimalCost;
+    return frame_assignment;
+}
+
+/**
+ * Kalman update of the velocity state for a track extended from prevLoc to loc.
+ * 
+ * Each dimension is an independent scalar filter on the velocity.  The prediction step adds the
+ * velocityD process noise, and the observation is the displacement velocity, whose variance comes from
+ * the diffusion and the localization errors.
+ */
+void LAPTrack::updateMotionState(IdxT prevLoc, IdxT loc, IdxT deltaT)
+{
+    for(IdxT d=0; d<nDims; d++){
+        FloatT v_pred = velocity(prevLoc,d);
+        FloatT v_pred_var = velocityVar(prevLoc,d) + velocityD*deltaT;
+        FloatT v_obs = (position(loc,d) - position(prevLoc,d))/deltaT;
+        FloatT v_obs_var = (2*D*deltaT + SE_position(prevLoc,d) + SE_position(loc,d))/(deltaT*deltaT);
+        FloatT gain = (v_pred_var+v_obs_var>0) ? v_pred_var/(v_pred_var+v_obs_var) : 0;
+        velocity(loc,d) = v_pred + gain*(v_obs-v_pred);
+        velocityVar(loc,d) = (1-gain)*v_pred_var;
+    }
+}
+
+void LAPTrack::enumerateF2FEdges(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const
+{
+    if(sweepCandidates) reweightSweepCandidates(curFrame, nextFrame, rows, cols, costs);
+    else (this->*costKernels.enumerateF2FEdges)(curFrame, nextFrame, rows, cols, costs);
+}
+
+/**
+ * Make a sparse matrix from a list of (row, col, cost) entries with no duplicates.
+ */
+LAPTrack::SpMatT
+LAPTrack::makeEdgeMatrix(IdxT nRows, IdxT nCols, const IndexVectorT &rows, const IndexVectorT &cols, const std::vector<FloatT> &costs)
+{
+    IdxT nnz = checkedIndex<IdxT>(costs.size(), "makeEdgeMatrix: edges");
+    UMatT locations(2,nnz);
+    for(IdxT n=0; n<nnz; n++){
+        locations(0,n) = rows[n];
+        locations(1,n) = cols[n];
+    }
+    VecT values(costs);
+    bool sort_them = true; //Make sure armadillo sorts the locations
+    bool check_for_zeros = false; //Don't bother checking for zeros
+    return {locations, values, static_cast<arma::uword>(nRows), static_cast<arma::uword>(nCols), sort_them, check_for_zeros};
+}
+
+/**
+ * The (nCur x nNext) sparse matrix of only the feasible connection costs from curFrame to nextFrame.
+ * 
+ * This is the upper left block of computeF2FCostMat(), for use with LAP_JVSparse::solvePadded().
+ */
+LAPTrack::SpMatT
+LAPTrack::computeF2FEdgeMat(IdxT curFrame, IdxT nextFrame) const
+{
+    IndexVectorT rows, cols;
+    std::vector<FloatT> costs;
+    enumerateF2FEdges(curFrame, nextFrame, rows, cols, costs);
+    return makeEdgeMatrix(nFrameLocs(curFrame-firstFrame), nFrameLocs(nextFrame-firstFrame), rows, cols, costs);
 }
 
 LAPTrack::SpMatT
@@ -242,82 +721,35 @@ LAPTrack::computeF2FCostMat(IdxT curFrame, IdxT nextFrame) const
     col_index.reserve(reserve_size);
     values.reserve(reserve_size);
 
-    IdxT deltaT = nextFrame - curFrame; //The number of frames spanned in the link
-    FloatT DdT = 2*D*deltaT;
-    FloatT position_gaussian_exponent_cuttoff = (maxPositionDisplacementSigma*maxPositionDisplacementSigma)/2.; //Only allow connections within 5 sigma
-    VecT feature_gaussian_exponent_cuttoff = (maxFeatureDisplacementSigma%maxFeatureDisplacementSigma)/2.; //Only allow connections within 5 sigma
-    FloatT norm_const = (nDims+nFeatures)*log2pi; //Pre-compute this
-
     //Fill in connection costs
-    const IVecT &curFrameLocs = frameLocIdx(curFrame-firstFrame);
-    const IVecT &nextFrameLocs = frameLocIdx(nextFrame-firstFrame);
-//     std::cout<<"nCur:"<<nCur<<" nNext:"<<nNext<<"\n";
-//     std::cout<<"nFrameLocs:"<<nFrameLocs.t()<<"\n";
-    //connecting locI in current frame to locJ in next frame
-    for(IdxT j=0; j<nNext; j++) {
-        IdxT next_idx = nextFrameLocs(j);
-        for(IdxT i=0; i<nCur; i++){
-            IdxT cur_idx = curFrameLocs(i);
-//             std::cout<<"i:"<<i<<" j:"<<j<<" curIdx:"<<cur_idx<<" nextIdx:"<<next_idx<<" DdT:"<<DdT<<"\n";
-            FloatT C=0;
-            bool feasible = true;
-            FloatT total_dist_sq=0;
-            for(IdxT d=0; d<nDims; d++){
-                FloatT dist_var = DdT + SE_position(cur_idx,d) + SE_position(next_idx,d);
-                FloatT dist = position(cur_idx,d) - position(next_idx,d);
-                FloatT dist_sq = dist*dist;
-                total_dist_sq += dist_sq;
-                FloatT cost_exponent = dist_sq/dist_var;
-//                 std::cout<<"Dim:"<<d<<" dist:"<<dist<<" dist_var:"<<dist_var<<" costExp:"<<cost_exponent<<" ExpCuttoff:"<<position_gaussian_exponent_cuttoff<<"\n";
-//                 std::cout<<"SE_position(cur_idx,d):"<<SE_position(cur_idx,d)<<"SE_position(next_idx,d):"<<SE_position(next_idx,d)<<"\n";
-                if(cost_exponent > position_gaussian_exponent_cuttoff) { //Too far away to be connected
-                    feasible=false;
-                    break;
-                }
-                C+= cost_exponent + log(dist_var);
-//                 std::cout<<"cost: "<<C<<"\n";
-            }
-            if(!feasible) continue; //gaussian sigma constraint violated: move to next pair.
-            if(maxSpeed>0 && sqrt(total_dist_sq)/deltaT > maxSpeed) continue; //maxSpeed constraint violated
-            for(IdxT f=0; f<nFeatures; f++){
-                FloatT feat_var = featureVar(f) + SE_feature(cur_idx,f)+ SE_feature(next_idx,f);
-                FloatT feat_dist = feature(cur_idx,f) - feature(next_idx,f);
-                FloatT cost_exponent = feat_dist*feat_dist/feat_var;
-                if(cost_exponent > feature_gaussian_exponent_cuttoff(f)) { //Too far away to be connected
-                    feasible=false;
-                    break;
-                }
-                C+= cost_exponent + log(feat_var);
-            }
-            if(!feasible) continue; //move to next pair.
-            //Otherwise we have a valid cost so normalize and record it
-            C+= norm_const;
-            C*= 0.5;
-            C-= log1mkoff;
-//             std::cout<<"C:"<<C<<" log1mkoff:"<<log1mkoff<<"\n";
-            //Record cost
-            row_index.push_back(i);
-            col_index.push_back(j);
-            values.push_back(C);
-            //Record lower right block dummy cost
-            row_index.push_back(nCur+j);
-            col_index.push_back(nNext+i);
-            values.push_back(cost_epsilon);
-        }
+    IndexVectorT rows, cols;
+    std::vector<FloatT> costs;
+    enumerateF2FEdges(curFrame, nextFrame, rows, cols, costs);
+    for(size_t e=0; e<costs.size(); e++) {
+        //Record cost
+        row_index.push_back(rows[e]);
+        col_index.push_back(cols[e]);
+        values.push_back(costs[e]);
+        //Record lower right block dummy cost
+        row_index.push_back(nCur+cols[e]);
+        col_index.push_back(nNext+rows[e]);
+        values.push_back(cost_epsilon);
     }
     //Fill in death costs
-    FloatT deathC= -logkoff;
+    VecT birthC, deathC;
+    unlinkedCosts(birthC, deathC);
+    const IVecT &curLocs = frameLocIdx(curFrame-firstFrame);
+    const IVecT &nextLocs = frameLocIdx(nextFrame-firstFrame);
     for(IdxT i=0; i<nCur; i++){
         row_index.push_back(i);
         col_index.push_back(nNext+i);
-        values.push_back(deathC);
+        values.push_back(deathC(locSpecies(curLocs(i))));
     }
     //Fill in birth costs
-    FloatT birthC = -logrho-logkon;
     for(IdxT j=0; j<nNext; j++){
         row_index.push_back(nCur+j);
         col_index.push_back(j);
-        values.push_back(birthC);
+        values.push_back(birthC(locSpecies(nextLocs(j))));
     }
     //Assemble sparse matrix
     IdxT nnz = values.size();
@@ -332,6 +764,63 @@ LAPTrack::computeF2FCostMat(IdxT curFrame, IdxT nextFrame) const
     return {locations, values_vec, static_cast<arma::uword>(nTot), static_cast<arma::uword>(nTot), sort_them, check_for_zeros};
 }
 
+LAPTrack::CandidateHeapT::CandidateHeapT(IdxT nLocs, IdxT k_)
+    : k(k_), heap(static_cast<size_t>(nLocs)*k_), count(nLocs,0), capped_loc(nLocs,false)
+{
+}
+
+/**
+ * Offer a candidate for location loc.  Once loc has k candidates, a new candidate replaces the
+ * highest cost candidate only if it has lower cost.  Equal costs are ordered by candidate index, so the
+ * k candidates kept do not depend on the order they are offered in.
+ */
+void LAPTrack::CandidateHeapT::push(IdxT loc, FloatT cost, IdxT candidate)
+{
+    auto first = heap.begin() + static_cast<size_t>(loc)*k;
+    IdxT &n = count[loc];
+    if(n<k) {
+        first[n++] = EntryT(cost,candidate);
+        std::push_heap(first, first+n);
+        return;
+    }
+    if(!capped_loc[loc]) { //Record the first time this location overflows
+        capped_loc[loc] = true;
+        n_capped++;
+    }
+    if(EntryT(cost,candidate) < *first) {
+        std::pop_heap(first, first+k);
+        first[k-1] = EntryT(cost,candidate);
+        std::push_heap(first, first+k);
+    }
+}
+
+/**
+ * Merge the row and column candidate heaps into a single edge list.
+ * 
+ * An edge is kept if it is among the lowest cost candidates of its row or of its column.
+ * The output edges are sorted by row then column and contain no duplicates.
+ */
+void LAPTrack::mergeCandidates(const CandidateHeapT &rowCands, const CandidateHeapT &colCands,
+                               IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs)
+{
+    struct EdgeT {IdxT row; IdxT col; FloatT cost;};
+    std::vector<EdgeT> edges;
+    for(IdxT r=0; r<rowCands.nLocs(); r++) for(IdxT n=0; n<rowCands.size(r); n++)
+        edges.push_back({r, rowCands.entry(r,n).second, rowCands.entry(r,n).first});
+    for(IdxT c=0; c<colCands.nLocs(); c++) for(IdxT n=0; n<colCands.size(c); n++)
+        edges.push_back({colCands.entry(c,n).second, c, colCands.entry(c,n).first});
+    std::sort(edges.begin(), edges.end(), [](const EdgeT &a, const EdgeT &b) {return a.row<b.row || (a.row==b.row && a.col<b.col);});
+    edges.erase(std::unique(edges.begin(), edges.end(), [](const EdgeT &a, const EdgeT &b) {return a.row==b.row && a.col==b.col;}), edges.end());
+    rows.resize(edges.size());
+    cols.resize(edges.size());
+    costs.resize(edges.size());
+    for(size_t e=0; e<edges.size(); e++) {
+        rows[e] = edges[e].row;
+        cols[e] = edges[e].col;
+        costs[e] = edges[e].cost;
+    }
+}
+
 void LAPTrack::checkFrameIdxs()
 {
     if(state!=F2F_LINKED) throw std::runtime_error("state != F2F_LINKED");
@@ -377,10 +866,44 @@ void LAPTrack::closeGaps()
 {
     //Invariant: tracks are in birth order.  So when connecting trackM->trackN we have M<N;
     if(state!=F2F_LINKED) throw std::runtime_error("state != F2F_LINKED");
-    auto cost = computeGapCloseMatrix();
-//     arma::mat dC(cost);
-//     std::cout<<"Cost: ("<<cost.n_rows<<","<<cost.n_cols<<"):\n"<<dC<<"\n";
-    IVecT track_assignment = LAP_JVSparse<FloatT>::solve(cost);
+    checkCancelled();
+    progressPhase = PHASE_GAP_CLOSING;
+    gapCloseLinkCost = 0;
+    gapCloseOptimalCost = 0;
+    IVecT track_assignment;
+    if(gapCloseImplicit && linkStrategy==LINK_OPTIMAL) { //Greedy matching needs the stored edges
+        track_assignment = solveGapCloseImplicit(nGapCloseRowEvaluations);
+        nGapCloseSubproblems = 1;
+    } else if(gapCloseBlockFrames>0 || gapCloseBlockExact) {
+        track_assignment = solveGapCloseBlocks(nGapCloseSubproblems);
+    } else {
+        auto cost = computeGapCloseEdgeMatrix();
+        IdxT nTracks = static_cast<IdxT>(tracks.size());
+        VecT birthCosts, deathCosts;
+        unlinkedCosts(birthCosts, deathCosts);
+        VecT deathC(nTracks), birthC(nTracks);
+        for(IdxT i=0; i<nTracks; i++) {
+            deathC(i) = deathCosts(trackSpecies(i));
+            birthC(i) = birthCosts(trackSpecies(i));
+        }
+        //Identical to solving the padded computeGapCloseMatrix() matrix
+        track_assignment = solveLink(cost, deathC, birthC, gapCloseLinkCost, gapCloseOptimalCost);
+        nGapCloseSubproblems = 1;
+    }
+    if(cancelRequested) {
+        progressPhase = PHASE_LINKING; //Tracks are unchanged until joined so the F2F_LINKED state is kept
+        checkCancelled();
+    }
+    joinGapClosedTracks(track_assignment);
+    progressPhase = PHASE_DONE;
+}
+
+/**
+ * Join the tracks connected by a gap-close track_assignment and remove the empty tracks and those shorter
+ * than minFinalTrackLength.  The remaining tracks stay in birth order.
+ */
+void LAPTrack::joinGapClosedTracks(const IVecT &track_assignment)
+{
     IdxT nTracks = tracks.size();
     IdxT nNewTracks = nTracks;
     for(IdxT m=nTracks-1; m>=0; m--){ //start at the end.  Last track cannot connect so skip it.
@@ -409,112 +932,864 @@ void LAPTrack::closeGaps()
     birthFrameIdx.clear();
     frameBirthStartIdx.clear();
     state = GAPS_CLOSED;
+    buildQueryIndex();
 }
 
 LAPTrack::SpMatT 
 LAPTrack::computeGapCloseMatrix() const
 {
+    if(gapCloseMemoryBudget>0) return computeGapCloseMatrixBudgeted();
     IdxT nTracks = static_cast<IdxT>(tracks.size());
-    
-    //These will be our sparse matrix format vectors
-    std::vector<arma::uword> row_index;
-    std::vector<arma::uword> col_index;
-    std::vector<FloatT> values;
-    IdxT reserve_size = nTracks*10; //Guesstimate amount of entries used
-    row_index.reserve(reserve_size);
-    col_index.reserve(reserve_size);
-    values.reserve(reserve_size);
+    IndexVectorT ends, starts;
+    std::vector<FloatT> costs;
+    enumerateGapCloseEdges(ends, starts, costs);
+    IdxT nEdges = checkedIndex<IdxT>(costs.size(), "computeGapCloseMatrix: edges");
+    checkedIndex<IdxT>(2*costs.size() + 2*tracks.size(), "computeGapCloseMatrix: padded nonzeros");
 
-    FloatT position_gaussian_exponent_cuttoff = (maxPositionDisplacementSigma*maxPositionDisplacementSigma)/2.; //Only allow connections within 5 sigma
-    VecT feature_gaussian_exponent_cuttoff = (maxFeatureDisplacementSigma%maxFeatureDisplacementSigma)/2.; //Only allow connections within 5 sigma
-    
-    FloatT norm_const = (nDims+nFeatures)*log2pi; //Pre-compute this
-    FloatT birthC = -logrho-logkon;
-    FloatT deathC= -logkoff;
-//     std::cout<<"frameBirthStartIdx: "<<frameBirthStartIdx.t()<<"\n";
-    
-    //connect trackI to trackJ so trackJ must start after trackI ends.
-    for(IdxT i=0; i<nTracks; i++){
-        if(static_cast<IdxT>(tracks[i].size()) < minGapCloseTrackLength) continue; //Don't connect tracks shorter than minGapCloseTrackLength
-        IdxT locI = tracks[i].back(); //last localization for track I.
-        IdxT trackIend = frameIdx(locI); //frame death
-        if (trackIend >= lastFrame-1) continue; //Tracks ending on last 2 frames can be a "start" point since this would be connected by F2F
-        for(IdxT j=frameBirthStartIdx(trackIend+2-firstFrame); j<nTracks; j++){
-            if(static_cast<IdxT>(tracks[j].size()) < minGapCloseTrackLength) continue; //Don't connect tracks shorter than minGapCloseTrackLength
-            IdxT trackJstart = birthFrameIdx[j];
-//             std::cout<<"Track:"<<j<<" Birth Loc:"<<tracks[j].front()<<std::endl;
-//             std::cout<<" Birth Frame Idx:"<<frameIdx(tracks[j].front())<<std::endl;
-//             std::cout<<" Recorded: "<<birthFrameIdx[j]<<std::endl;
-            IdxT deltaT = trackJstart - trackIend;
-//             std::cout<<"i("<<i<<") -> j("<<j<<"): endI:"<<trackIend<<" startJ:"<<trackJstart<<" deltaT:"<<deltaT<<"\n";
-            if(deltaT<1) throw LogicalError("DeltaT should be positive.");
-            if(deltaT>=maxGapCloseFrames) continue; //Gap must be at most maxGapCloseFrames
-            IdxT locJ = tracks[j].front();
-            FloatT DdT = 2*D*deltaT;
-            FloatT total_dist_sq=0;
-            FloatT C=0;
-            bool feasible = true;
-            for(IdxT d=0; d<nDims; d++){
-                FloatT dist_var = DdT + SE_position(locI,d) + SE_position(locJ,d);
-                FloatT dist = position(locI,d) - position(locJ,d);
-                FloatT dist_sq = dist*dist;
-                total_dist_sq += dist_sq;
-                FloatT cost_exponent = dist_sq/dist_var;
-//                 std::cout<<"Dim:"<<d<<" dist:"<<dist<<" dist_var:"<<dist_var<<" costExp:"<<cost_exponent<<" ExpCuttoff:"<<gaussian_exponent_cuttoff<<"\n";
-//                 std::cout<<"SE_position(cur_idx,d):"<<SE_position(cur_idx,d)<<"SE_position(next_idx,d):"<<SE_position(next_idx,d)<<"\n";
-                if(cost_exponent > position_gaussian_exponent_cuttoff) { //Too far away to be connected
-                    feasible=false;
-                    break;
-                }
-                C+= cost_exponent + log(dist_var);
-            }
-            if(!feasible) continue; //gaussian sigma constraint violated: move to next pair.
-            if(maxSpeed>0 && sqrt(total_dist_sq)/deltaT > maxSpeed) continue; //maxSpeed constraint violated
-            for(IdxT f=0; f<nFeatures; f++){
-                FloatT feat_var = featureVar(f) + SE_feature(locI,f)+ SE_feature(locJ,f);
-                FloatT feat_dist = feature(locI,f) - feature(locJ,f);
-                FloatT cost_exponent = feat_dist*feat_dist/feat_var;
-                if(cost_exponent > feature_gaussian_exponent_cuttoff(f)) { //Too far away to be connected
-                    feasible=false;
-                    break;
-                }
-                C+= cost_exponent + log(feat_var);
-            }
-            if(!feasible) continue; //move to next pair.
-            //Otherwise we have a valid cost so normalize and record it
-            C+= norm_const;
-            C*= 0.5;
-            C-= logkon +logkoff*deltaT;
-            //Record cost
-            row_index.push_back(i);
-            col_index.push_back(j);
-            values.push_back(C);
-            //Record lower right block dummy cost
-            row_index.push_back(nTracks+j);
-            col_index.push_back(nTracks+i);
-            values.push_back(cost_epsilon);
-        }
-    }
-    
+    VecT birthC, deathC;
+    unlinkedCosts(birthC, deathC);
+    IdxT nnz = 2*nEdges + 2*nTracks;
+    UMatT locations(2,nnz);
+    VecT values(nnz);
+    IdxT n=0;
+    for(IdxT e=0; e<nEdges; e++){
+        //Record cost
+        locations(0,n) = ends[e];
+        locations(1,n) = starts[e];
+        values(n++) = costs[e];
+        //Record lower right block dummy cost
+        locations(0,n) = nTracks+starts[e];
+        locations(1,n) = nTracks+ends[e];
+        values(n++) = cost_epsilon;
+    }
     for(IdxT i=0; i<nTracks; i++){
         //Fill in death costs
-        row_index.push_back(i);
-        col_index.push_back(nTracks+i);
-        values.push_back(deathC);
+        locations(0,n) = i;
+        locations(1,n) = nTracks+i;
+        values(n++) = deathC(trackSpecies(i));
         //Fill in birth costs
-        row_index.push_back(nTracks+i);
-        col_index.push_back(i);
-        values.push_back(birthC);
-    }
-    IdxT nnz = values.size();
-    UMatT locations(2,nnz);
-    for(IdxT n=0; n<nnz;n++){
-        locations(0,n) = row_index[n];
-        locations(1,n) = col_index[n];
+        locations(0,n) = nTracks+i;
+        locations(1,n) = i;
+        values(n++) = birthC(trackSpecies(i));
     }
     bool sort_them = true; //Make sure armadillo sorts the locations
     bool check_for_zeros = false; //Don't bother checking for zeros
-    return {locations, VecT(values), 2*static_cast<arma::uword>(nTracks), 2*static_cast<arma::uword>(nTracks), sort_them, check_for_zeros};
+    return {locations, values, 2*static_cast<arma::uword>(nTracks), 2*static_cast<arma::uword>(nTracks), sort_them, check_for_zeros};
+}
+
+/** 64-bit file positions.  std::ftell/std::fseek use long, which is 32 bits on LLP64 platforms. */
+static int64_t tellFile64(std::FILE *file)
+{
+#if defined(_WIN32)
+    return _ftelli64(file);
+#else
+    return static_cast<int64_t>(ftello(file));
+#endif
+}
+
+static int seekFile64(std::FILE *file, int64_t offset, int origin)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, offset, origin);
+#else
+    return fseeko(file, static_cast<off_t>(offset), origin);
+#endif
+}
+
+/**
+ * Sorts a stream of gap-close edges by (start, end) within a memory budget.
+ * 
+ * Edges are buffered up to budgetBytes.  Each full buffer is sorted and spilled as a run to a temporary
+ * file, and the runs are k-way merged as they are read back.  If nothing was spilled the buffer is read
+ * directly.
+ */
+template<class FloatT, class IdxT>
+class EdgeSpillSorter {
+public:
+    struct EdgeT {
+        IdxT start;
+        IdxT end;
+        FloatT cost;
+        bool operator<(const EdgeT &o) const {return start<o.start || (start==o.start && end<o.end);}
+    };
+
+    EdgeSpillSorter(size_t budgetBytes) : capacity(std::max(budgetBytes/sizeof(EdgeT), size_t(1))) {buffer.reserve(capacity);}
+    ~EdgeSpillSorter() {if(file) std::fclose(file);}
+    IdxT nRuns() const {return static_cast<IdxT>(runs.size());}
+    size_t size() const {return n_edges;} //Number of edges pushed
+
+    void push(IdxT start, IdxT end, FloatT cost)
+    {
+        if(buffer.size()==capacity) spill();
+        buffer.push_back({start,end,cost});
+        n_edges++;
+    }
+
+    /** Prepare to read the edges in sorted order with next() */
+    void finish()
+    {
+        if(runs.empty()) {
+            std::sort(buffer.begin(), buffer.end());
+            return;
+        }
+        if(!buffer.empty()) spill();
+        std::vector<EdgeT>().swap(buffer);
+        size_t runCapacity = std::max(capacity/runs.size(), size_t(1)); //Split the budget over the run read buffers
+        for(IdxT r=0; r<nRuns(); r++) {
+            runs[r].buffer.reserve(runCapacity);
+            if(refill(r)) heads.push(HeadT{runs[r].buffer[0], r});
+        }
+    }
+
+    /** The next edge in sorted order.  @returns false when there are no more edges. */
+    bool next(EdgeT &edge)
+    {
+        if(runs.empty()) {
+            if(pos==buffer.size()) return false;
+            edge = buffer[pos++];
+            return true;
+        }
+        if(heads.empty()) return false;
+        HeadT head = heads.top();
+        heads.pop();
+        edge = head.edge;
+        RunT &run = runs[head.run];
+        if(++run.pos < run.buffer.size() || refill(head.run)) heads.push(HeadT{run.buffer[run.pos], head.run});
+        return true;
+    }
+
+private:
+    struct RunT {
+        int64_t offset; //File position of the next unread edge
+        size_t remaining; //Edges not yet read from the file
+        std::vector<EdgeT> buffer;
+        size_t pos = 0;
+    };
+    struct HeadT {
+        EdgeT edge;
+        IdxT run;
+        bool operator<(const HeadT &o) const {return o.edge < edge;} //Min-heap on the edge order
+    };
+    size_t capacity;
+    size_t n_edges = 0;
+    std::vector<EdgeT> buffer;
+    size_t pos = 0;
+    std::FILE *file = nullptr;
+    std::vector<RunT> runs;
+    std::priority_queue<HeadT> heads;
+
+    void spill()
+    {
+        if(!file) file = std::tmpfile();
+        if(!file) throw TrackerError("IOError","Unable to open a temporary file for gap-close assembly");
+        std::sort(buffer.begin(), buffer.end());
+        if(seekFile64(file, 0, SEEK_END)) throw TrackerError("IOError","Unable to seek in the temporary file for gap-close assembly");
+        RunT run;
+        run.offset = tellFile64(file);
+        if(run.offset<0) throw TrackerError("IOError","Unable to seek in the temporary file for gap-close assembly");
+        run.remaining = buffer.size();
+        if(std::fwrite(buffer.data(), sizeof(EdgeT), buffer.size(), file) != buffer.size())
+            throw TrackerError("IOError","Unable to write to the temporary file for gap-close assembly");
+        runs.push_back(std::move(run));
+        buffer.clear();
+    }
+
+    bool refill(IdxT r)
+    {
+        RunT &run = runs[r];
+        size_t n = std::min(run.remaining, run.buffer.capacity());
+        run.buffer.resize(n);
+        run.pos = 0;
+        if(n==0) return false;
+        if(seekFile64(file, run.offset, SEEK_SET)) throw TrackerError("IOError","Unable to seek in the temporary file for gap-close assembly");
+        if(std::fread(run.buffer.data(), sizeof(EdgeT), n, file) != n)
+            throw TrackerError("IOError","Unable to read the temporary file for gap-close assembly");
+        run.offset += static_cast<int64_t>(n*sizeof(EdgeT));
+        run.remaining -= n;
+        return true;
+    }
+};
+
+/**
+ * Assemble the gap-close matrix directly in compressed sparse column form within gapCloseMemoryBudget.
+ * 
+ * Edges are enumerated in chunks of track ends and sorted into track start order by EdgeSpillSorter within
+ * the memory budget, counting the edges of each track end as they pass.  The output arrays are allocated
+ * once the enumeration is done.  Each sorted edge fills its left half column (track start connections and
+ * births) and its dummy entry in the right half column of its track end (deaths and dummies), whose offset
+ * comes from the counts.  The result is identical to computeGapCloseMatrix() without a budget, but the peak
+ * memory is the output arrays plus the budget and a count per track, instead of several copies of the matrix.
+ */
+LAPTrack::SpMatT 
+LAPTrack::computeGapCloseMatrixBudgeted() const
+{
+    using EdgeT = EdgeSpillSorter<FloatT,IdxT>::EdgeT;
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    VecT birthC, deathC;
+    unlinkedCosts(birthC, deathC);
+    EdgeSpillSorter<FloatT,IdxT> sorter(gapCloseMemoryBudget);
+    arma::uvec right_col_ptrs(nTracks+1, arma::fill::zeros); //Right half column offsets, from the edges of each track end
+    //The maxCandidatesPerLoc cap needs the full enumeration, which holds only the candidate heaps of
+    //2*maxCandidatesPerLoc entries per track and the edges of the blocks in progress
+    IdxT chunk = maxCandidatesPerLoc>0 ? std::max(nTracks,IdxT(1)) : 1024;
+    IndexVectorT ends, starts;
+    std::vector<FloatT> costs;
+    for(IdxT endBegin=0; endBegin<nTracks; endBegin+=chunk){
+        IdxT endEnd = std::min(nTracks, endBegin+chunk);
+        enumerateGapCloseEdges(endBegin, endEnd, ends, starts, costs);
+        for(size_t e=0; e<costs.size(); e++){
+            right_col_ptrs(ends[e]+1)++;
+            sorter.push(starts[e], ends[e], costs[e]);
+        }
+    }
+    IndexVectorT().swap(ends);
+    IndexVectorT().swap(starts);
+    std::vector<FloatT>().swap(costs);
+    for(IdxT i=0; i<nTracks; i++) right_col_ptrs(i+1) += right_col_ptrs(i) + 1; //The death and the dummies of each end
+    arma::uword nEdges = sorter.size();
+    sorter.finish();
+    nGapCloseSpillRuns = sorter.nRuns();
+
+    arma::uword nnz = 2*nEdges + 2*nTracks;
+    arma::uword right_begin = nEdges + nTracks; //The left half holds the edges and the births
+    arma::uvec row_indices(nnz);
+    arma::uvec col_ptrs(2*nTracks+1);
+    VecT values(nnz);
+    for(IdxT i=0; i<nTracks; i++){
+        arma::uword pos = right_begin + right_col_ptrs(i);
+        col_ptrs(nTracks+i) = pos;
+        row_indices(pos) = i; //death
+        values(pos) = deathC(trackSpecies(i));
+        right_col_ptrs(i)++; //Now the next free entry of the column
+    }
+    col_ptrs(2*nTracks) = nnz;
+    arma::uword n = 0;
+    EdgeT edge;
+    bool have_edge = sorter.next(edge);
+    for(IdxT j=0; j<nTracks; j++){
+        col_ptrs(j) = n;
+        for(; have_edge && edge.start==j; have_edge = sorter.next(edge)){
+            row_indices(n) = edge.end;
+            values(n++) = edge.cost;
+            //lower right block dummy cost.  The starts arrive in increasing order, so the rows stay sorted.
+            arma::uword pos = right_begin + right_col_ptrs(edge.end)++;
+            row_indices(pos) = nTracks+j;
+            values(pos) = cost_epsilon;
+        }
+        row_indices(n) = nTracks+j; //birth
+        values(n++) = birthC(trackSpecies(j));
+    }
+    return {row_indices, col_ptrs, values, 2*static_cast<arma::uword>(nTracks), 2*static_cast<arma::uword>(nTracks)};
+}
+
+/**
+ * The (nTracks x nTracks) sparse matrix of only the feasible gap-closing connection costs.
+ * 
+ * This is the upper left block of computeGapCloseMatrix(), for use with LAP_JVSparse::solvePadded().  With
+ * gapCloseMemoryBudget the compressed columns are assembled directly from edges sorted within the budget.
+ */
+LAPTrack::SpMatT 
+LAPTrack::computeGapCloseEdgeMatrix() const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    IndexVectorT ends, starts;
+    std::vector<FloatT> costs;
+    if(gapCloseMemoryBudget==0) {
+        enumerateGapCloseEdges(ends, starts, costs);
+        return makeEdgeMatrix(nTracks, nTracks, ends, starts, costs);
+    }
+    using EdgeT = EdgeSpillSorter<FloatT,IdxT>::EdgeT;
+    EdgeSpillSorter<FloatT,IdxT> sorter(gapCloseMemoryBudget);
+    //The cap needs the full enumeration, which holds only the candidate heaps and the blocks in progress
+    IdxT chunk = maxCandidatesPerLoc>0 ? std::max(nTracks,IdxT(1)) : 1024;
+    for(IdxT endBegin=0; endBegin<nTracks; endBegin+=chunk){
+        enumerateGapCloseEdges(endBegin, std::min(nTracks, endBegin+chunk), ends, starts, costs);
+        for(size_t e=0; e<costs.size(); e++) sorter.push(starts[e], ends[e], costs[e]);
+    }
+    IndexVectorT().swap(ends);
+    IndexVectorT().swap(starts);
+    std::vector<FloatT>().swap(costs);
+    arma::uword nnz = sorter.size();
+    sorter.finish();
+    nGapCloseSpillRuns = sorter.nRuns();
+    arma::uvec row_indices(nnz);
+    arma::uvec col_ptrs(nTracks+1);
+    VecT values(nnz);
+    arma::uword n = 0;
+    EdgeT edge;
+    bool have_edge = sorter.next(edge);
+    for(IdxT j=0; j<nTracks; j++){
+        col_ptrs(j) = n;
+        for(; have_edge && edge.start==j; have_edge = sorter.next(edge)){
+            row_indices(n) = edge.end;
+            values(n++) = edge.cost;
+        }
+    }
+    col_ptrs(nTracks) = n;
+    return {row_indices, col_ptrs, values, static_cast<arma::uword>(nTracks), static_cast<arma::uword>(nTracks)};
+}
+
+/**
+ * Enumerate the feasible gap-closing connections between track ends and track starts.
+ *
+ * Only the real connections are returned, the birth/death and dummy entries of the padded LAP are
+ * added by the callers.  Edges are generated in order of increasing track end index.
+ *
+ * @param[out] ends track index of the track end for each edge
+ * @param[out] starts track index of the track start for each edge
+ * @param[out] costs cost of each edge
+ */
+void LAPTrack::enumerateGapCloseEdges(IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const
+{
+    (this->*costKernels.enumerateGapCloseEdges)(0, static_cast<IdxT>(tracks.size()), ends, starts, costs);
+}
+
+/**
+ * Enumerate the gap-closing connections from the track ends in [endBegin, endEnd) only.
+ * 
+ * The maxCandidatesPerLoc cap is applied within the range, so it matches the full enumeration only
+ * when the range covers all tracks.
+ */
+void LAPTrack::enumerateGapCloseEdges(IdxT endBegin, IdxT endEnd, IndexVectorT &ends, IndexVectorT &starts, std::vector<FloatT> &costs) const
+{
+    (this->*costKernels.enumerateGapCloseEdges)(endBegin, endEnd, ends, starts, costs);
+}
+
+/**
+ * Can the end of track i be the start point of a gap-closing connection.
+ */
+bool LAPTrack::isGapCloseEnd(IdxT i) const
+{
+    if(static_cast<IdxT>(tracks[i].size()) < minGapCloseTrackLength) return false; //Don't connect tracks shorter than minGapCloseTrackLength
+    //Tracks ending on last 2 frames can't be a "start" point since this would be connected by F2F
+    return frameIdx(tracks[i].back()) < lastFrame-1;
+}
+
+/**
+ * Solve the gap-closing LAP without storing the cost matrix.
+ * 
+ * The rows of the 2*nTracks padded gap-close matrix are generated on demand from the gap-close cost
+ * function, and up to gapCloseRowCacheBytes of rows are cached by the solver.  The rows of the lower
+ * dummy block are the columns of the real connections, so track ends are indexed by their end frame to
+ * allow enumerating the connections into a track start.  The maxCandidatesPerLoc cap is not applied
+ * in this mode, as it would require the full enumeration the oracle avoids.
+ * 
+ * @param[out] nEvaluations number of rows generated
+ * @returns track assignment for each row of the padded matrix
+ */
+LAPTrack::IVecT
+LAPTrack::solveGapCloseImplicit(IdxT &nEvaluations) const
+{
+    return (this->*costKernels.solveGapCloseImplicit)(nEvaluations);
+}
+
+/**
+ * Solve the gap-closing problem as a set of independent smaller LAPs which are solved in parallel.
+ *
+ * With gapCloseBlockExact the candidate edges are split into the connected components of the bipartite
+ * graph of track ends and track starts.  The padded gap-close LAP is separable over these components, so
+ * the optimum is identical to the global solve.
+ *
+ * Otherwise time is split into blocks of gapCloseBlockFrames frames, and each edge whose track end and
+ * track start fall in the same block is solved with its block.  Edges crossing block boundaries are then
+ * reconciled with a final LAP over the track ends and starts left unconnected by their blocks.  This
+ * approximates the global optimum, and is exact when no feasible edge crosses a block boundary.
+ *
+ * @param[out] nSubproblems number of LAPs solved
+ * @returns track assignment for each track end.  Values >= nTracks represent track deaths.
+ */
+LAPTrack::IVecT
+LAPTrack::solveGapCloseBlocks(IdxT &nSubproblems) const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    IVecT track_assignment(nTracks);
+    for(IdxT i=0; i<nTracks; i++) track_assignment(i) = nTracks+i; //Default is a death
+    IndexVectorT ends, starts;
+    std::vector<FloatT> costs;
+    enumerateGapCloseEdges(ends, starts, costs);
+    IdxT nEdges = checkedIndex<IdxT>(costs.size(), "solveGapCloseBlocks: edges");
+
+    std::vector<IndexVectorT> blockEdges; //Edge indexes for each independent subproblem
+    IndexVectorT crossEdges; //Edge indexes crossing block boundaries
+    if(gapCloseBlockExact) {
+        //Union-find on nodes [0,nTracks) for track ends and [nTracks,2*nTracks) for track starts
+        IndexVectorT parent(2*nTracks);
+        std::iota(parent.begin(), parent.end(), 0);
+        auto root = [&parent](IdxT k) {
+            while(parent[k]!=k) k = parent[k] = parent[parent[k]];
+            return k;
+        };
+        for(IdxT e=0; e<nEdges; e++){
+            IdxT a = root(ends[e]);
+            IdxT b = root(nTracks+starts[e]);
+            if(a!=b) parent[std::max(a,b)] = std::min(a,b);
+        }
+        IndexVectorT component(2*nTracks,-1); //Map from component root to subproblem index
+        for(IdxT e=0; e<nEdges; e++){
+            IdxT r = root(ends[e]);
+            if(component[r]<0) {
+                component[r] = static_cast<IdxT>(blockEdges.size());
+                blockEdges.emplace_back();
+            }
+            blockEdges[component[r]].push_back(e);
+        }
+    } else {
+        auto block = [this](IdxT frame) {return (frame-firstFrame)/gapCloseBlockFrames;};
+        blockEdges.resize(block(lastFrame)+1);
+        for(IdxT e=0; e<nEdges; e++){
+            IdxT endBlock = block(frameIdx(tracks[ends[e]].back()));
+            if(endBlock == block(birthFrameIdx[starts[e]])) blockEdges[endBlock].push_back(e);
+            else crossEdges.push_back(e);
+        }
+    }
+
+    IdxT nBlocks = static_cast<IdxT>(blockEdges.size());
+    std::vector<std::exception_ptr> errors(nBlocks); //Exceptions cannot leave the parallel region
+    std::atomic<bool> failed(false);
+    #pragma omp parallel for schedule(dynamic)
+    for(IdxT b=0; b<nBlocks; b++){
+        if(blockEdges[b].empty() || failed.load()) continue;
+        try {
+            solveGapCloseSubproblem(ends, starts, costs, blockEdges[b], track_assignment);
+        } catch(...) {
+            errors[b] = std::current_exception();
+            failed = true;
+        }
+    }
+    for(auto &error: errors) if(error) std::rethrow_exception(error);
+    nSubproblems = static_cast<IdxT>(std::count_if(blockEdges.cbegin(), blockEdges.cend(), [](const IndexVectorT &b) {return !b.empty();}));
+
+    if(!crossEdges.empty()) {
+        //Reconcile using only the crossing edges between track ends and track starts left free by their blocks
+        std::vector<bool> connected_start(nTracks,false);
+        for(IdxT i=0; i<nTracks; i++) if(track_assignment(i) < nTracks) connected_start[track_assignment(i)] = true;
+        IndexVectorT freeEdges;
+        for(IdxT e : crossEdges) if(track_assignment(ends[e]) >= nTracks && !connected_start[starts[e]]) freeEdges.push_back(e);
+        if(!freeEdges.empty()) {
+            solveGapCloseSubproblem(ends, starts, costs, freeEdges, track_assignment);
+            nSubproblems++;
+        }
+    }
+    return track_assignment;
+}
+
+/**
+ * Solve the padded gap-close LAP restricted to a subset of the candidate edges.
+ *
+ * Only the track ends and track starts touched by edgeIdxs take part.  The subproblem matrix has the same
+ * block structure as computeGapCloseMatrix() in a local indexing.  Only the entries of track_assignment for
+ * the participating track ends are written, so concurrent calls on disjoint sets of track ends are safe.
+ *
+ * @param[in] ends track end for each edge from enumerateGapCloseEdges()
+ * @param[in] starts track start for each edge from enumerateGapCloseEdges()
+ * @param[in] costs cost for each edge from enumerateGapCloseEdges()
+ * @param[in] edgeIdxs indexes of the edges making up this subproblem
+ * @param[in,out] track_assignment global track assignment to update with any connections made
+ */
+void LAPTrack::solveGapCloseSubproblem(const IndexVectorT &ends, const IndexVectorT &starts, const std::vector<FloatT> &costs,
+                                       const IndexVectorT &edgeIdxs, IVecT &track_assignment) const
+{
+    //Local indexing of the participating track ends and starts
+    IndexVectorT localEnds, localStarts;
+    localEnds.reserve(edgeIdxs.size());
+    localStarts.reserve(edgeIdxs.size());
+    for(IdxT e : edgeIdxs) {
+        localEnds.push_back(ends[e]);
+        localStarts.push_back(starts[e]);
+    }
+    std::sort(localEnds.begin(), localEnds.end());
+    localEnds.erase(std::unique(localEnds.begin(), localEnds.end()), localEnds.end());
+    std::sort(localStarts.begin(), localStarts.end());
+    localStarts.erase(std::unique(localStarts.begin(), localStarts.end()), localStarts.end());
+    IdxT nEnds = static_cast<IdxT>(localEnds.size());
+    IdxT nStarts = static_cast<IdxT>(localStarts.size());
+    IdxT nEdges = static_cast<IdxT>(edgeIdxs.size());
+
+    IndexVectorT rows, cols;
+    std::vector<FloatT> local_costs;
+    rows.reserve(nEdges);
+    cols.reserve(nEdges);
+    local_costs.reserve(nEdges);
+    for(IdxT e : edgeIdxs){
+        rows.push_back(static_cast<IdxT>(std::lower_bound(localEnds.cbegin(), localEnds.cend(), ends[e]) - localEnds.cbegin()));
+        cols.push_back(static_cast<IdxT>(std::lower_bound(localStarts.cbegin(), localStarts.cend(), starts[e]) - localStarts.cbegin()));
+        local_costs.push_back(costs[e]);
+    }
+    SpMatT cost = makeEdgeMatrix(nEnds, nStarts, rows, cols, local_costs);
+    VecT birthCosts, deathCosts;
+    unlinkedCosts(birthCosts, deathCosts);
+    VecT deathC(nEnds);
+    for(IdxT i=0; i<nEnds; i++) deathC(i) = deathCosts(trackSpecies(localEnds[i]));
+    VecT birthC(nStarts);
+    for(IdxT j=0; j<nStarts; j++) birthC(j) = birthCosts(trackSpecies(localStarts[j]));
+    FloatT linkCost, optimalCost;
+    IVecT local_assignment = solveLink(cost, deathC, birthC, linkCost, optimalCost);
+    #pragma omp atomic
+    gapCloseLinkCost += linkCost;
+    #pragma omp atomic
+    gapCloseOptimalCost += optimalCost;
+    for(IdxT i=0; i<nEnds; i++)
+        if(local_assignment(i) < nStarts) track_assignment(localEnds[i]) = localStarts[local_assignment(i)];
+}
+
+/**
+ * Solve a padded F2F or gap-close LAP with the linkStrategy.
+ * 
+ * LINK_OPTIMAL solves the LAP exactly.  LINK_GREEDY uses LAP_JVSparse::solveGreedy() with greedySwapPasses,
+ * which uses the same gated costs and birth and death thresholds.  The costs are only computed with
+ * reportCostGap, where LINK_GREEDY also solves the LAP exactly for the optimal cost.  The exact solve stops
+ * on cancelTracking() and leaves every row and column unconnected, so callers must check for cancellation.
+ * 
+ * @param[in] cost sparse costs of the real connections
+ * @param[in] deathC cost of leaving each row unconnected
+ * @param[in] birthC cost of leaving each column unconnected
+ * @param[out] linkCost total cost of the returned assignment, or 0 without reportCostGap
+ * @param[out] optimalCost total cost of the optimal assignment, or 0 without reportCostGap
+ * @returns row solution of the padded problem as from LAP_JVSparse::solvePadded()
+ */
+LAPTrack::IVecT LAPTrack::solveLink(const SpMatT &cost, const VecT &deathC, const VecT &birthC, FloatT &linkCost, FloatT &optimalCost) const
+{
+    linkCost = 0;
+    optimalCost = 0;
+    if(linkStrategy==LINK_OPTIMAL) {
+        IVecT assignment = LAP_JVSparse<FloatT>::solvePadded(cost, deathC, birthC, cost_epsilon, cancelHook());
+        if(reportCostGap) {
+            linkCost = LAP_JVSparse<FloatT>::computePaddedCost(cost, deathC, birthC, cost_epsilon, assignment);
+            optimalCost = linkCost;
+        }
+        return assignment;
+    }
+    IVecT assignment = LAP_JVSparse<FloatT>::solveGreedy(cost, deathC, birthC, cost_epsilon, greedySwapPasses);
+    if(reportCostGap) {
+        linkCost = LAP_JVSparse<FloatT>::computePaddedCost(cost, deathC, birthC, cost_epsilon, assignment);
+        IVecT optimal = LAP_JVSparse<FloatT>::solvePadded(cost, deathC, birthC, cost_epsilon, cancelHook());
+        optimalCost = LAP_JVSparse<FloatT>::computePaddedCost(cost, deathC, birthC, cost_epsilon, optimal);
+    }
+    return assignment;
+}
+
+/**
+ * Track the current localizations under several parameter configurations.
+ * 
+ * Each configuration overrides a subset of the parameters of this object.  The F2F candidate
+ * connections are enumerated once using the loosest gates of all the configurations, keeping the
+ * squared displacements and summed SE terms, which do not depend on the parameters.  Each configuration
+ * then only re-weights and re-gates the stored candidates to solve its F2F LAPs, followed by its own
+ * closeGaps(), as the gap-closing candidates depend on the tracks of each configuration.  Configurations
+ * are solved in parallel.
+ * 
+ * The configurations read the localizations of this object in place with shareLocalizations(), so they are
+ * not copied.  Each running configuration still holds its own frame index (N indexes), tracks, F2F LAPs,
+ * and gap-close matrix, so the peak memory beyond the shared localizations and candidates is about the
+ * number of threads times the memory of a single closeGaps().  The gap-close enumeration is repeated for
+ * each configuration.
+ * 
+ * Only the BROWNIAN motion model is supported, as the CONSTANT_VELOCITY costs depend on the links
+ * made by each configuration.  The stored candidates are rows and columns in the frame order of this
+ * object, so a configuration may not change spatialOrder.
+ * 
+ * @param[in] configs Parameter overrides for each configuration
+ * @param[out] configTracks The final tracks for each configuration
+ * @param[out] configStats The getStats() of each configuration
+ */
+void LAPTrack::sweep(const std::vector<VecParamT> &configs, std::vector<TrackVecT> &configTracks, std::vector<VecParamT> &configStats) const
+{
+    if(N==0) throw LogicalError("sweep: initializeTracks() has not been called");
+    if(!costKernels.isGaussian) throw LogicalError("sweep: only the default GaussianCostPolicy is supported");
+    if(nSpecies>1) throw LogicalError("sweep: species labels are not supported");
+    VecParamT base = getStats(); //Current parameters, without the unset ones
+    for(auto it=base.begin(); it!=base.end(); ) it = it->second.is_empty() ? base.erase(it) : std::next(it);
+    std::vector<std::unique_ptr<LAPTrack>> trackers;
+    std::vector<const LAPTrack*> trackerPtrs;
+    for(auto &config: configs) {
+        VecParamT params = base;
+        for(auto &p: config) params[p.first] = p.second;
+        trackers.emplace_back(new LAPTrack(params));
+        if(trackers.back()->motionModel!=BROWNIAN) throw ParameterValueError("sweep: only the BROWNIAN motionModel is supported");
+        if(trackers.back()->spatialOrder!=spatialOrder) //The candidates are positions in this object's frameLocIdx
+            throw ParameterValueError("sweep: spatialOrder cannot be changed by a configuration");
+        trackerPtrs.push_back(trackers.back().get());
+    }
+    SweepCandidatesT candidates;
+    enumerateSweepCandidates(trackerPtrs, candidates);
+
+    IdxT nConfigs = static_cast<IdxT>(configs.size());
+    configTracks.assign(nConfigs, TrackVecT());
+    configStats.assign(nConfigs, VecParamT());
+    std::vector<std::exception_ptr> errors(nConfigs); //Exceptions cannot leave the parallel region
+    #pragma omp parallel for schedule(dynamic)
+    for(IdxT k=0; k<nConfigs; k++) {
+        try {
+            LAPTrack &tracker = *trackers[k];
+            tracker.shareLocalizations(*this);
+            tracker.initializeTrackingState();
+            tracker.sweepCandidates = &candidates;
+            tracker.linkF2F();
+            tracker.sweepCandidates = nullptr;
+            tracker.closeGaps();
+            configStats[k] = tracker.getStats();
+            configStats[k]["nSweepCandidates"] = candidates.rows.size();
+            configTracks[k] = std::move(tracker.tracks);
+            trackers[k].reset(); //Release the tracking state
+        } catch(...) {
+            errors[k] = std::current_exception();
+        }
+    }
+    for(auto &error: errors) if(error) std::rethrow_exception(error);
+}
+
+/**
+ * Enumerate the F2F candidates feasible under any of the configurations.
+ * 
+ * Each gate is monotone in D, the sigma cutoffs, maxSpeed and featureVar, so gating with the largest
+ * values of each keeps every candidate that any configuration would keep.
+ */
+void LAPTrack::enumerateSweepCandidates(const std::vector<const LAPTrack*> &configs, SweepCandidatesT &candidates) const
+{
+    FloatT loose_D = 0, loose_sigma = 0, loose_speed = 0;
+    bool speed_gate = true;
+    VecT loose_feature_var(nFeatures, arma::fill::zeros);
+    VecT loose_feature_sigma(nFeatures, arma::fill::zeros);
+    for(auto config: configs) {
+        loose_D = std::max(loose_D, config->D);
+        loose_sigma = std::max(loose_sigma, config->maxPositionDisplacementSigma);
+        if(config->maxSpeed>0) loose_speed = std::max(loose_speed, config->maxSpeed);
+        else speed_gate = false;
+        for(IdxT f=0; f<nFeatures; f++){
+            loose_feature_var(f) = std::max(loose_feature_var(f), config->featureVar(f));
+            loose_feature_sigma(f) = std::max(loose_feature_sigma(f), config->maxFeatureDisplacementSigma(f));
+        }
+    }
+    FloatT position_exponent_cutoff = (loose_sigma*loose_sigma)/2.;
+    VecT feature_exponent_cutoff = (loose_feature_sigma%loose_feature_sigma)/2.;
+    IdxT nTerms = nDims+nFeatures;
+
+    //Each frame pair is enumerated into its own buffers, then concatenated in frame order
+    IndexVectorT pairFrames; //curFrame offset of each frame pair
+    IndexVectorT pairNext; //nextFrame offset of each frame pair
+    for(IdxT cur=0, next=1; next<nFrames; next++) {
+        if(frameLocIdx(next).is_empty()) continue;
+        pairFrames.push_back(cur);
+        pairNext.push_back(next);
+        cur = next;
+    }
+    IdxT nPairs = static_cast<IdxT>(pairFrames.size());
+    std::vector<IndexVectorT> pairRows(nPairs), pairCols(nPairs);
+    std::vector<std::vector<FloatT>> pairDistSq(nPairs), pairSESum(nPairs);
+    #pragma omp parallel for schedule(dynamic)
+    for(IdxT p=0; p<nPairs; p++) {
+        const IVecT &curFrameLocs = frameLocIdx(pairFrames[p]);
+        const IVecT &nextFrameLocs = frameLocIdx(pairNext[p]);
+        IdxT deltaT = pairNext[p]-pairFrames[p];
+        FloatT DdT = 2*loose_D*deltaT;
+        std::vector<FloatT> dist_sq(nTerms), se_sum(nTerms);
+        for(IdxT j=0; j<static_cast<IdxT>(nextFrameLocs.n_elem); j++) {
+            IdxT locJ = nextFrameLocs(j);
+            for(IdxT i=0; i<static_cast<IdxT>(curFrameLocs.n_elem); i++) {
+                IdxT locI = curFrameLocs(i);
+                bool feasible = true;
+                FloatT total_dist_sq = 0;
+                for(IdxT d=0; d<nDims && feasible; d++){
+                    FloatT dist = position(locI,d) - position(locJ,d);
+                    dist_sq[d] = dist*dist;
+                    se_sum[d] = SE_position(locI,d) + SE_position(locJ,d);
+                    total_dist_sq += dist_sq[d];
+                    feasible = dist_sq[d]/(DdT + se_sum[d]) <= position_exponent_cutoff;
+                }
+                if(feasible && speed_gate) feasible = sqrt(total_dist_sq)/deltaT <= loose_speed;
+                for(IdxT f=0; f<nFeatures && feasible; f++){
+                    FloatT feat_dist = feature(locI,f) - feature(locJ,f);
+                    dist_sq[nDims+f] = feat_dist*feat_dist;
+                    se_sum[nDims+f] = SE_feature(locI,f) + SE_feature(locJ,f);
+                    feasible = dist_sq[nDims+f]/(loose_feature_var(f) + se_sum[nDims+f]) <= feature_exponent_cutoff(f);
+                }
+                if(!feasible) continue;
+                pairRows[p].push_back(i);
+                pairCols[p].push_back(j);
+                pairDistSq[p].insert(pairDistSq[p].end(), dist_sq.begin(), dist_sq.end());
+                pairSESum[p].insert(pairSESum[p].end(), se_sum.begin(), se_sum.end());
+            }
+        }
+    }
+    candidates.nTerms = nTerms;
+    candidates.pairStart.assign(nFrames+1, 0);
+    size_t nCandidates = 0;
+    for(IdxT p=0; p<nPairs; p++) nCandidates += pairRows[p].size();
+    candidates.rows.clear();
+    candidates.cols.clear();
+    candidates.distSq.clear();
+    candidates.seSum.clear();
+    candidates.rows.reserve(nCandidates);
+    candidates.cols.reserve(nCandidates);
+    candidates.distSq.reserve(nCandidates*nTerms);
+    candidates.seSum.reserve(nCandidates*nTerms);
+    IdxT p = 0;
+    for(IdxT n=0; n<nFrames; n++) {
+        candidates.pairStart[n] = checkedIndex<IdxT>(candidates.rows.size(), "enumerateSweepCandidates: candidates");
+        if(p<nPairs && pairFrames[p]==n) {
+            candidates.rows.insert(candidates.rows.end(), pairRows[p].begin(), pairRows[p].end());
+            candidates.cols.insert(candidates.cols.end(), pairCols[p].begin(), pairCols[p].end());
+            candidates.distSq.insert(candidates.distSq.end(), pairDistSq[p].begin(), pairDistSq[p].end());
+            candidates.seSum.insert(candidates.seSum.end(), pairSESum[p].begin(), pairSESum[p].end());
+            p++;
+        }
+    }
+    candidates.pairStart[nFrames] = checkedIndex<IdxT>(candidates.rows.size(), "enumerateSweepCandidates: candidates");
+}
+
+/**
+ * Compute the F2F connection costs from the stored sweep candidates with the parameters of this object.
+ * 
+ * This applies the same gates and costs as GaussianCostPolicy::pairCost() to the stored terms, giving the same edges
+ * as enumerateF2FEdgesKernel().
+ */
+void LAPTrack::reweightSweepCandidates(IdxT curFrame, IdxT nextFrame, IndexVectorT &rows, IndexVectorT &cols, std::vector<FloatT> &costs) const
+{
+    const SweepCandidatesT &cands = *sweepCandidates;
+    IdxT first = cands.pairStart[curFrame-firstFrame];
+    IdxT last = cands.pairStart[curFrame-firstFrame+1];
+    IdxT deltaT = nextFrame - curFrame;
+    FloatT DdT = 2*D*deltaT;
+    GaussianCostPolicy<DynamicSize,DynamicSize> gate(*this);
+    bool capped = maxCandidatesPerLoc>0;
+    CandidateHeapT curCands(capped ? nFrameLocs(curFrame-firstFrame) : 0, maxCandidatesPerLoc);
+    CandidateHeapT nextCands(capped ? nFrameLocs(nextFrame-firstFrame) : 0, maxCandidatesPerLoc);
+    rows.reserve(last-first);
+    cols.reserve(last-first);
+    costs.reserve(last-first);
+    for(IdxT e=first; e<last; e++) {
+        const FloatT *dist_sq = cands.distSq.data() + static_cast<size_t>(e)*cands.nTerms;
+        const FloatT *se_sum = cands.seSum.data() + static_cast<size_t>(e)*cands.nTerms;
+        bool feasible = true;
+        FloatT total_dist_sq = 0;
+        FloatT C = 0;
+        for(IdxT d=0; d<nDims && feasible; d++){
+            FloatT dist_var = DdT + se_sum[d];
+            FloatT cost_exponent = dist_sq[d]/dist_var;
+            total_dist_sq += dist_sq[d];
+            feasible = cost_exponent <= gate.position_exponent_cutoff;
+            C+= cost_exponent + log(dist_var);
+        }
+        if(feasible && maxSpeed>0) feasible = sqrt(total_dist_sq)/deltaT <= maxSpeed;
+        for(IdxT f=0; f<nFeatures && feasible; f++){
+            FloatT feat_var = featureVar(f) + se_sum[nDims+f];
+            FloatT cost_exponent = dist_sq[nDims+f]/feat_var;
+            feasible = cost_exponent <= gate.feature_exponent_cutoff(f);
+            C+= cost_exponent + log(feat_var);
+        }
+        if(!feasible) continue;
+        C+= gate.norm_const;
+        C*= 0.5;
+        C+= gate.f2fLinkCost();
+        if(capped) {
+            curCands.push(cands.rows[e], C, cands.cols[e]);
+            nextCands.push(cands.cols[e], C, cands.rows[e]);
+        } else {
+            rows.push_back(cands.rows[e]);
+            cols.push_back(cands.cols[e]);
+            costs.push_back(C);
+        }
+    }
+    if(capped) {
+        mergeCandidates(curCands, nextCands, rows, cols, costs);
+        nF2FCandidateCapHits += curCands.nCapped() + nextCands.nCapped();
+    }
+}
+
+void LAPTrack::appendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_)
+{
+    MatT feature_, SE_feature_;
+    appendLocalizations(frameIdx_, position_, SE_position_, feature_, SE_feature_);
+}
+
+/**
+ * Add localizations for new frames after lastFrame to a tracked dataset.
+ * 
+ * Only the new frames are linked F2F, extending the tracks alive at the old lastFrame.  If gaps were already
+ * closed, gap closing is re-opened only for the track ends within maxGapCloseFrames of the old lastFrame, which
+ * may connect to the tracks born in the new frames.  All earlier links are kept, so the cost scales with
+ * the new data.  Localizations in the old lastFrame discarded by minFinalTrackLength restart as new tracks.
+ * 
+ * If the gaps were not yet closed, the state stays F2F_LINKED and closeGaps() will close gaps globally.
+ */
+void LAPTrack::appendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_)
+{
+    if(state==UNTRACKED) throw LogicalError("appendLocalizations: tracks must be linked with linkF2F() first");
+    IdxT oldN = N;
+    IdxT oldLastFrame = lastFrame;
+    extendLocalizations(frameIdx_, position_, SE_position_, feature_, SE_feature_);
+    if(N==oldN) return;
+    if(motionModel==CONSTANT_VELOCITY) {
+        velocity.resize(N,nDims);
+        velocityVar.resize(N,nDims);
+        velocity.tail_rows(N-oldN).zeros();
+        velocityVar.tail_rows(N-oldN).fill(velocityVar0);
+    }
+    f2fFrameSeconds.resize(nFrames); //Also sizes the vectors after readState()
+    f2fFrameDegraded.resize(nFrames);
+    bool gapsClosed = state==GAPS_CLOSED;
+    if(!gapsClosed) {
+        frameBirthStartIdx.resize(nFrames); //New frames are filled in by linkFrames()
+    } else {
+        rebuildTrackIndex();
+        //Restart the tracks for localizations at the boundary removed by minFinalTrackLength
+        const IVecT &boundaryLocs = frameLocIdx(oldLastFrame-firstFrame);
+        for(IdxT i=0; i<static_cast<IdxT>(boundaryLocs.n_elem); i++){
+            IdxT locIdx = boundaryLocs(i);
+            if(trackAssignment(locIdx)>=0) continue;
+            trackAssignment(locIdx) = static_cast<IdxT>(tracks.size());
+            tracks.push_back(TrackT(1,locIdx));
+            birthFrameIdx.push_back(oldLastFrame);
+        }
+    }
+    linkFrames(oldLastFrame);
+    if(gapsClosed) closeAppendedGaps(oldLastFrame);
+    else state = F2F_LINKED;
+}
+
+/**
+ * Recompute trackAssignment, birthFrameIdx and frameBirthStartIdx from the tracks, which are invalidated by closeGaps().
+ */
+void LAPTrack::rebuildTrackIndex()
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    trackAssignment.set_size(N);
+    trackAssignment.fill(-1);
+    birthFrameIdx.clear();
+    birthFrameIdx.reserve(nTracks);
+    frameBirthStartIdx.set_size(nFrames);
+    IdxT f = 0;
+    for(IdxT t=0; t<nTracks; t++){
+        for(IdxT loc: tracks[t]) trackAssignment(loc) = t;
+        IdxT birth = frameIdx(tracks[t].front());
+        birthFrameIdx.push_back(birth);
+        while(f<=birth-firstFrame) frameBirthStartIdx(f++) = t; //Tracks are in birth order
+    }
+    while(f<nFrames) frameBirthStartIdx(f++) = nTracks;
+}
+
+/**
+ * Gap closing restricted to connections from track ends near boundaryFrame to tracks born after boundaryFrame.
+ * 
+ * The track ends are found from the localizations of the last maxGapCloseFrames frames before the boundary, so
+ * the cost does not depend on the number of earlier tracks.
+ */
+void LAPTrack::closeAppendedGaps(IdxT boundaryFrame)
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    IndexVectorT ends, starts;
+    std::vector<FloatT> costs;
+    (this->*costKernels.enumerateAppendedGapCloseEdges)(boundaryFrame, ends, starts, costs);
+    IVecT track_assignment(nTracks);
+    for(IdxT i=0; i<nTracks; i++) track_assignment(i) = nTracks+i; //Default is a death
+    nGapCloseSubproblems = 0;
+    if(!costs.empty()) {
+        IndexVectorT edgeIdxs(costs.size());
+        std::iota(edgeIdxs.begin(), edgeIdxs.end(), 0);
+        solveGapCloseSubproblem(ends, starts, costs, edgeIdxs, track_assignment);
+        nGapCloseSubproblems = 1;
+    }
+    joinGapClosedTracks(track_assignment);
 }
 
 } /* namespace tracker */
@@ -9,9 +9,15 @@
  * Adapted from text of Jonker and Volgenant. Computing 38, 324-340 (1986)
  * 
  */
+#include <algorithm>
 #include <cmath>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <list>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "Tracker/LAP_JVSparse.h"
 namespace tracker {
@@ -29,6 +35,154 @@ LAP_JVSparse<FloatT>::solve(const SpMatT &C)
     return x;
 }
 
+/**
+ * Row access for lap_orig to a compressed sparse row matrix with 1-based indexing.
+ */
+template<class FloatT, class IdxT>
+class CompressedRows {
+public:
+    CompressedRows(const FloatT cc_[], const IdxT kk_[], const IdxT first_[]) : cc(cc_), kk(kk_), first(first_) {}
+    void row(IdxT i, const IdxT *&cols, const FloatT *&vals, IdxT &len)
+    {
+        cols = kk + first[i];
+        vals = cc + first[i];
+        len = first[i+1] - first[i];
+    }
+private:
+    const FloatT *cc;
+    const IdxT *kk;
+    const IdxT *first;
+};
+
+/**
+ * Row access for lap_orig to rows generated on demand by a RowOracleT.
+ * 
+ * Generated rows are kept in a least-recently-used cache limited to cacheBytes.  Rows larger than the
+ * whole cache are regenerated every time they are accessed.  The pointers returned by row() are valid
+ * until the next call to row(), which is all lap_orig needs as it only works on a single row at a time.
+ */
+template<class FloatT, class IdxT>
+class CachedOracleRows {
+public:
+    using RowOracleT = std::function<void(IdxT row, std::vector<IdxT> &cols, std::vector<FloatT> &vals)>;
+    CachedOracleRows(const RowOracleT &oracle_, size_t cacheBytes_) : oracle(oracle_), cacheBytes(cacheBytes_) {}
+    IdxT nEvaluations() const {return n_evaluations;}
+    void row(IdxT i, const IdxT *&cols, const FloatT *&vals, IdxT &len)
+    {
+        auto it = cache.find(i);
+        if(it != cache.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru_pos); //Mark as most recently used
+        } else {
+            generate(i-1, scratch_cols, scratch_vals); //oracle uses 0-based rows
+            size_t bytes = rowBytes(scratch_cols.size());
+            if(bytes > cacheBytes) { //Too big to ever cache
+                cols = scratch_cols.data();
+                vals = scratch_vals.data();
+                len = static_cast<IdxT>(scratch_cols.size());
+                return;
+            }
+            while(usedBytes + bytes > cacheBytes) evict();
+            EntryT &entry = cache[i];
+            entry.cols.swap(scratch_cols);
+            entry.vals.swap(scratch_vals);
+            lru.push_front(i);
+            entry.lru_pos = lru.begin();
+            usedBytes += bytes;
+            it = cache.find(i);
+        }
+        cols = it->second.cols.data();
+        vals = it->second.vals.data();
+        len = static_cast<IdxT>(it->second.cols.size());
+    }
+private:
+    struct EntryT {
+        std::vector<IdxT> cols;
+        std::vector<FloatT> vals;
+        typename std::list<IdxT>::iterator lru_pos;
+    };
+    const RowOracleT &oracle;
+    size_t cacheBytes;
+    size_t usedBytes = 0;
+    IdxT n_evaluations = 0;
+    std::unordered_map<IdxT,EntryT> cache;
+    std::list<IdxT> lru; //Most recently used first
+    std::vector<IdxT> scratch_cols;
+    std::vector<FloatT> scratch_vals;
+
+    static size_t rowBytes(size_t len) { return len*(sizeof(IdxT)+sizeof(FloatT)); }
+
+    void generate(IdxT i, std::vector<IdxT> &cols, std::vector<FloatT> &vals)
+    {
+        cols.clear();
+        vals.clear();
+        oracle(i, cols, vals);
+        for(auto &j: cols) j++; //convert to 1-based indexing
+        n_evaluations++;
+    }
+
+    void evict()
+    {
+        IdxT i = lru.back();
+        lru.pop_back();
+        auto it = cache.find(i);
+        usedBytes -= rowBytes(it->second.cols.size());
+        cache.erase(it);
+    }
+};
+
+/**
+ * Row access for lap_orig to the padded square form of a rectangular LAP without storing the padding.
+ * 
+ * For the nR x nC matrix C the padded matrix is [C, diag(rowUnassigned); diag(colUnassigned), D] where D has
+ * dummyCost at the transposed position of each entry of C.  As with solveLAP_orig, lap_orig rows are the
+ * columns of the padded matrix, so column j < nC is column j of C followed by the colUnassigned(j) entry, and
+ * column nC+i is the rowUnassigned(i) entry followed by a dummy entry for each entry in row i of C.  Entries are
+ * produced in increasing row order, exactly as stored by the padded SpMat.  The pointers returned by row() are
+ * valid until the next call to row().  The rows of C are read from a transposed copy held for the lifetime of
+ * the object.
+ */
+template<class FloatT, class IdxT>
+class PaddedColumns {
+public:
+    using SpMatT = arma::SpMat<FloatT>;
+    using VecT = arma::Col<FloatT>;
+    PaddedColumns(const SpMatT &C_, const VecT &rowUnassigned_, const VecT &colUnassigned_, FloatT dummyCost_)
+        : C(C_), Ct(C_.t()), rowUnassigned(rowUnassigned_), colUnassigned(colUnassigned_), dummyCost(dummyCost_),
+          nR(static_cast<IdxT>(C_.n_rows)), nC(static_cast<IdxT>(C_.n_cols)) {}
+    void row(IdxT i, const IdxT *&cols, const FloatT *&vals, IdxT &len)
+    {
+        scratch_cols.clear();
+        scratch_vals.clear();
+        IdxT c = i-1; //0-based padded column
+        if(c < nC) {
+            for(arma::uword t=C.col_ptrs[c]; t<C.col_ptrs[c+1]; t++) add(static_cast<IdxT>(C.row_indices[t]), C.values[t]);
+            add(nR+c, colUnassigned(c));
+        } else {
+            IdxT r = c-nC;
+            add(r, rowUnassigned(r));
+            for(arma::uword t=Ct.col_ptrs[r]; t<Ct.col_ptrs[r+1]; t++) add(nR+static_cast<IdxT>(Ct.row_indices[t]), dummyCost);
+        }
+        cols = scratch_cols.data();
+        vals = scratch_vals.data();
+        len = static_cast<IdxT>(scratch_cols.size());
+    }
+private:
+    const SpMatT &C;
+    SpMatT Ct; //Rows of C as columns
+    const VecT &rowUnassigned;
+    const VecT &colUnassigned;
+    FloatT dummyCost;
+    IdxT nR, nC;
+    std::vector<IdxT> scratch_cols;
+    std::vector<FloatT> scratch_vals;
+
+    void add(IdxT row, FloatT val)
+    {
+        scratch_cols.push_back(row+1); //1-based indexing
+        scratch_vals.push_back(val);
+    }
+};
+
 /**
  * This wraps the original sparse lap implementation that for some reason uses 1-based indexing,
  * which we correct with some pointer arrithmetic and adjusting of appropriate indicies in the
@@ -45,12 +199,14 @@ LAP_JVSparse<FloatT>::solve(const SpMatT &C)
  * @param[out] y - col assignments
  * @param[out] u - reduced row costs
  * @param[out] v - reduced column costs
+ * @param[in] sparseAugmentMinSize - smallest dimension solved with the heap augmentation instead of the plain
+ *                                   scans.  Both give the same solution, so this only affects speed.
  */
 template<class FloatT>
-void LAP_JVSparse<FloatT>::solveLAP_orig(const SpMatT &C, IVecT &x, IVecT &y, VecT &u, VecT &v)
+void LAP_JVSparse<FloatT>::solveLAP_orig(const SpMatT &C, IVecT &x, IVecT &y, VecT &u, VecT &v, IdxT sparseAugmentMinSize)
 {
-    IdxT Ndim = static_cast<IdxT>(C.n_rows);
-    IdxT Nvals = static_cast<IdxT>(C.n_nonzero);
+    IdxT Ndim = checkedIndex<IdxT>(C.n_rows, "solveLAP_orig: rows");
+    IdxT Nvals = checkedIndex<IdxT>(C.n_nonzero+1, "solveLAP_orig: nonzeros")-1; //1-based column starts go to Nvals+1
     
     IVecT C_row_ind(Nvals);
     for(IdxT n=0; n<Nvals; n++) C_row_ind(n) = static_cast<IdxT>(C.row_indices[n])+1; //convert to 1-based indexing
@@ -69,12 +225,398 @@ void LAP_JVSparse<FloatT>::solveLAP_orig(const SpMatT &C, IVecT &x, IVecT &y, Ve
     IdxT *y_ptr = x.memptr()-1; //Swap x&y
     FloatT *u_ptr = v.memptr()-1; //Swap u&v
     FloatT *v_ptr = u.memptr()-1; //Swap u&v
-    lap_orig(Ndim, C_values_ptr, C_row_ind_ptr, C_col_starts_ptr, x_ptr, y_ptr, u_ptr, v_ptr);
+    CompressedRows<FloatT,IdxT> rows(C_values_ptr, C_row_ind_ptr, C_col_starts_ptr);
+    lap_orig(Ndim, rows, x_ptr, y_ptr, u_ptr, v_ptr, StopT(), sparseAugmentMinSize);
     x-=1; //Convert to 0-based indexing
     y-=1; //Convert to 0-based indexing
     VecT cost=computeCost(C,x);
 }
 
+/**
+ * Solve a LAP whose rows are generated on demand instead of stored.
+ * 
+ * The oracle is called with a 0-based row index and must fill cols with the 0-based column indexes and
+ * vals with the costs of all entries in that row.  The same row must always produce the same entries.
+ * Up to cacheBytes of generated rows are cached, with the least recently used rows evicted first.
+ * This allows problems too large to store to be solved at the cost of regenerating rows.
+ * 
+ * @param[in] n dimension of the LAP
+ * @param[in] oracle row generation callback
+ * @param[in] cacheBytes memory budget for the row cache
+ * @param[out] nEvaluations number of calls made to the oracle
+ * @param[in] stop Optional hook polled during the solve.  If it returns true the solve stops, and the returned
+ *                 solution is incomplete and must be discarded.
+ * @returns row solution
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::solveOracle(IdxT n, const RowOracleT &oracle, size_t cacheBytes, IdxT &nEvaluations, const StopT &stop)
+{
+    IVecT x(n), y(n);
+    VecT u(n), v(n);
+    CachedOracleRows<FloatT,IdxT> rows(oracle, cacheBytes);
+    lap_orig(n, rows, x.memptr()-1, y.memptr()-1, u.memptr()-1, v.memptr()-1, stop);
+    x-=1; //Convert to 0-based indexing
+    nEvaluations = rows.nEvaluations();
+    return x;
+}
+
+/**
+ * Solve a rectangular LAP where rows and columns may be left unassigned at a cost.
+ * 
+ * The result is identical to solving the padded square LAP of dimension nR+nC
+ *     [C, diag(rowUnassigned); diag(colUnassigned), D]
+ * where D has dummyCost at the transposed position of each entry of C, as built explicitly for the F2F and
+ * gap-closing problems.  The padding is generated from C on demand, so the padded matrix is never stored.
+ * This saves storage only: lap_orig still solves the full padded problem of dimension nR+nC with the same
+ * work as the explicit form, and a transposed copy of C (the same size as C) is kept to generate the D block.
+ * 
+ * @param[in] C (nR x nC) sparse costs of the real assignments
+ * @param[in] rowUnassigned (nR) cost of leaving each row unassigned
+ * @param[in] colUnassigned (nC) cost of leaving each column unassigned
+ * @param[in] dummyCost cost of the lower right block entries
+ * @param[in] stop Optional hook polled during the solve.  If it returns true the solve stops and every row and
+ *                 column is returned unassigned.
+ * @returns row solution of the padded problem.  Row i<nR is unassigned if x(i)>=nC, and column j is unassigned
+ *          if x(nR+j)==j.
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::solvePadded(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                                  const StopT &stop)
+{
+    IdxT n = checkedIndex<IdxT>(C.n_rows + C.n_cols, "solvePadded: padded size");
+    checkedIndex<IdxT>(2*C.n_nonzero + n, "solvePadded: padded nonzeros");
+    IVecT x(n), y(n);
+    VecT u(n), v(n);
+    PaddedColumns<FloatT,IdxT> rows(C, rowUnassigned, colUnassigned, dummyCost);
+    if(!lap_orig(n, rows, y.memptr()-1, x.memptr()-1, v.memptr()-1, u.memptr()-1, stop)) //Swap x&y and u&v as in solveLAP_orig
+        return paddedSolution(std::vector<IdxT>(C.n_rows,-1), std::vector<IdxT>(C.n_cols,-1));
+    x-=1; //Convert to 0-based indexing
+    return x;
+}
+
+/**
+ * Solve the solvePadded() problem for a small number of rows and columns with a dense kernel.
+ * 
+ * The padded (nR+nC) square cost block is laid out on the stack and solved by shortest augmenting paths with
+ * dual potentials (Hungarian method), so small problems avoid the sparse matrix construction and the
+ * indirect loops of the sparse solver.  Missing entries are infinite.
+ * 
+ * @param[in] nR number of rows
+ * @param[in] nC number of columns
+ * @param[in] rows row index of each real entry
+ * @param[in] cols column index of each real entry
+ * @param[in] costs cost of each real entry.  There must be no duplicate (row,col) entries.
+ * @param[in] rowUnassigned (nR) cost of leaving each row unassigned
+ * @param[in] colUnassigned (nC) cost of leaving each column unassigned
+ * @param[in] dummyCost cost of the lower right block entries
+ * @returns row solution of the padded problem in the same form as solvePadded().
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::solvePaddedDense(IdxT nR, IdxT nC, const std::vector<IdxT> &rows, const std::vector<IdxT> &cols,
+                                       const std::vector<FloatT> &costs, const VecT &rowUnassigned,
+                                       const VecT &colUnassigned, FloatT dummyCost)
+{
+    const IdxT n = nR+nC;
+    if(n > MaxDenseSize) throw std::invalid_argument("solvePaddedDense: problem larger than MaxDenseSize");
+    const FloatT inf = std::numeric_limits<FloatT>::infinity();
+    FloatT a[MaxDenseSize*MaxDenseSize]; //Row-major padded costs
+    std::fill(a, a+n*n, inf);
+    for(size_t e=0; e<costs.size(); e++) {
+        a[rows[e]*n + cols[e]] = costs[e];
+        a[(nR+cols[e])*n + nC+rows[e]] = dummyCost;
+    }
+    for(IdxT i=0; i<nR; i++) a[i*n + nC+i] = rowUnassigned(i);
+    for(IdxT j=0; j<nC; j++) a[(nR+j)*n + j] = colUnassigned(j);
+
+    //Shortest augmenting path with 1-based column slots.  Slot 0 holds the row being inserted.
+    FloatT u[MaxDenseSize+1], v[MaxDenseSize+1], minv[MaxDenseSize+1];
+    IdxT p[MaxDenseSize+1], way[MaxDenseSize+1];
+    bool used[MaxDenseSize+1];
+    std::fill(u, u+n+1, FloatT(0));
+    std::fill(v, v+n+1, FloatT(0));
+    std::fill(p, p+n+1, IdxT(0));
+    for(IdxT i=1; i<=n; i++) {
+        p[0] = i;
+        IdxT j0 = 0;
+        std::fill(minv, minv+n+1, inf);
+        std::fill(used, used+n+1, false);
+        do {
+            used[j0] = true;
+            IdxT i0 = p[j0], j1 = 0;
+            FloatT delta = inf;
+            const FloatT *arow = a + (i0-1)*n;
+            for(IdxT j=1; j<=n; j++) if(!used[j]) {
+                FloatT c = arow[j-1];
+                if(c < inf) {
+                    FloatT cur = c - u[i0] - v[j];
+                    if(cur < minv[j]) {
+                        minv[j] = cur;
+                        way[j] = j0;
+                    }
+                }
+                if(minv[j] < delta) {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+            if(j1 == 0) throw std::logic_error("solvePaddedDense: no augmenting path");
+            for(IdxT j=0; j<=n; j++) {
+                if(used[j]) {
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while(p[j0] != 0);
+        do { //Augment along the path
+            IdxT j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while(j0 != 0);
+    }
+    IVecT x(n);
+    for(IdxT j=1; j<=n; j++) x(p[j]-1) = j-1;
+    return x;
+}
+
+/**
+ * Approximate the solvePadded() assignment with a greedy matching and optional local swap search.
+ * 
+ * Real entries are taken in order of decreasing saving over leaving their row and column unassigned, whenever
+ * both are still free.  Each swap pass then visits every row and applies the best improving move of the row
+ * onto another of its columns, where the row previously holding that column either takes the freed column (a
+ * pairwise swap) or becomes unassigned.  Passes stop early once no move improves the total cost.  This is a
+ * local search over single moves and pairwise swaps, not augmenting paths, so it can stop at a local optimum
+ * that solvePadded() would improve on.
+ * 
+ * @param[in] C (nR x nC) sparse costs of the real assignments
+ * @param[in] rowUnassigned (nR) cost of leaving each row unassigned
+ * @param[in] colUnassigned (nC) cost of leaving each column unassigned
+ * @param[in] dummyCost cost of the lower right block entries
+ * @param[in] nSwapPasses maximum number of local swap passes.  0 gives the plain greedy matching.
+ * @returns row solution of the padded problem in the same form as solvePadded().
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::solveGreedy(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned,
+                                  FloatT dummyCost, IdxT nSwapPasses)
+{
+    IdxT nR = static_cast<IdxT>(C.n_rows);
+    IdxT nC = static_cast<IdxT>(C.n_cols);
+    std::vector<IdxT> row_match(nR,-1), col_match(nC,-1);
+    std::vector<FloatT> match_cost(nR); //Cost of row's current assignment, including the dummy entry
+    greedyMatch(C, rowUnassigned, colUnassigned, dummyCost, row_match, col_match, match_cost);
+    const FloatT *const vals = C.values;
+    const arma::uword *const row_ind = C.row_indices;
+    const arma::uword *const col_ptr = C.col_ptrs;
+
+    if(nSwapPasses > 0) {
+        SpMatT Ct = C.t(); //Column i of Ct holds row i of C
+        Ct.sync();
+        const FloatT *const t_vals = Ct.values;
+        const arma::uword *const t_row_ind = Ct.row_indices;
+        const arma::uword *const t_col_ptr = Ct.col_ptrs;
+        auto entry = [&](IdxT i, IdxT j, FloatT &val) { //Lookup C(i,j) by binary search in the sorted column j
+            const arma::uword *b = row_ind + col_ptr[j], *e = row_ind + col_ptr[j+1];
+            const arma::uword *p = std::lower_bound(b, e, static_cast<arma::uword>(i));
+            if(p == e || *p != static_cast<arma::uword>(i)) return false;
+            val = vals[p - row_ind];
+            return true;
+        };
+        for(IdxT pass=0; pass<nSwapPasses; pass++) {
+            bool improved = false;
+            for(IdxT i=0; i<nR; i++) {
+                IdxT j = row_match[i];
+                FloatT cur_i = j<0 ? rowUnassigned(i) : match_cost[i];
+                FloatT freed_j = j<0 ? 0 : colUnassigned(j);
+                FloatT best_delta = 0;
+                IdxT best_j = -1;
+                bool best_swap = false;
+                for(arma::uword t=t_col_ptr[i]; t<t_col_ptr[i+1]; t++) {
+                    IdxT j2 = static_cast<IdxT>(t_row_ind[t]);
+                    if(j2 == j) continue;
+                    FloatT new_i = t_vals[t] + dummyCost;
+                    IdxT i2 = col_match[j2];
+                    FloatT delta;
+                    bool swap = false;
+                    if(i2 < 0) {
+                        delta = new_i - cur_i - colUnassigned(j2) + freed_j;
+                    } else {
+                        //Row i2 is displaced to unassigned, or takes j if it can
+                        delta = new_i - cur_i + rowUnassigned(i2) - match_cost[i2] + freed_j;
+                        FloatT c;
+                        if(j >= 0 && entry(i2, j, c)) {
+                            FloatT swap_delta = new_i - cur_i + (c + dummyCost) - match_cost[i2];
+                            if(swap_delta < delta) {
+                                delta = swap_delta;
+                                swap = true;
+                            }
+                        }
+                    }
+                    if(delta < best_delta) {
+                        best_delta = delta;
+                        best_j = j2;
+                        best_swap = swap;
+                    }
+                }
+                if(best_j < 0 || best_delta > -std::numeric_limits<FloatT>::epsilon()*std::abs(cur_i)) continue;
+                IdxT i2 = col_match[best_j];
+                if(i2 >= 0) {
+                    if(best_swap) {
+                        FloatT c=0;
+                        entry(i2, j, c);
+                        row_match[i2] = j;
+                        col_match[j] = i2;
+                        match_cost[i2] = c + dummyCost;
+                    } else {
+                        row_match[i2] = -1;
+                    }
+                }
+                if(j >= 0 && !best_swap) col_match[j] = -1;
+                for(arma::uword t=t_col_ptr[i]; t<t_col_ptr[i+1]; t++) if(static_cast<IdxT>(t_row_ind[t]) == best_j) {
+                    match_cost[i] = t_vals[t] + dummyCost;
+                    break;
+                }
+                row_match[i] = best_j;
+                col_match[best_j] = i;
+                improved = true;
+            }
+            if(!improved) break;
+        }
+    }
+
+    return paddedSolution(row_match, col_match);
+}
+
+/**
+ * Extend a partial matching greedily, as the first stage of solveGreedy().
+ * 
+ * Real entries are taken in order of decreasing saving over leaving their row and column unassigned, whenever
+ * both are still free.  Rows and columns already matched on entry are kept.
+ * 
+ * @param[in,out] row_match (nR) column matched to each row or -1
+ * @param[in,out] col_match (nC) row matched to each column or -1
+ * @param[in,out] match_cost (nR) cost of each matched row including its dummy entry
+ */
+template<class FloatT>
+void LAP_JVSparse<FloatT>::greedyMatch(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned, FloatT dummyCost,
+                                       std::vector<IdxT> &row_match, std::vector<IdxT> &col_match, std::vector<FloatT> &match_cost)
+{
+    IdxT nC = static_cast<IdxT>(C.n_cols);
+    checkedIndex<IdxT>(C.n_rows + C.n_cols, "greedyMatch: padded size");
+    IdxT nnz = checkedIndex<IdxT>(C.n_nonzero, "greedyMatch: nonzeros");
+    C.sync();
+    const FloatT *const vals = C.values;
+    const arma::uword *const row_ind = C.row_indices;
+    const arma::uword *const col_ptr = C.col_ptrs;
+
+    std::vector<IdxT> col_ind(nnz);
+    std::vector<FloatT> saving(nnz);
+    for(IdxT j=0; j<nC; j++) for(arma::uword t=col_ptr[j]; t<col_ptr[j+1]; t++) {
+        col_ind[t] = j;
+        saving[t] = rowUnassigned(row_ind[t]) + colUnassigned(j) - (vals[t] + dummyCost);
+    }
+    std::vector<IdxT> order(nnz);
+    for(IdxT t=0; t<nnz; t++) order[t] = t;
+    std::stable_sort(order.begin(), order.end(), [&](IdxT a, IdxT b) {return saving[a] > saving[b];});
+
+    for(IdxT t: order) {
+        if(saving[t] <= 0) break;
+        IdxT i = static_cast<IdxT>(row_ind[t]), j = col_ind[t];
+        if(row_match[i] >= 0 || col_match[j] >= 0) continue;
+        row_match[i] = j;
+        col_match[j] = i;
+        match_cost[i] = vals[t] + dummyCost;
+    }
+}
+
+/**
+ * The padded row solution, in the form returned by solvePadded(), of a matching of the real rows and columns.
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::paddedSolution(const std::vector<IdxT> &row_match, const std::vector<IdxT> &col_match)
+{
+    IdxT nR = static_cast<IdxT>(row_match.size());
+    IdxT nC = static_cast<IdxT>(col_match.size());
+    IVecT x(nR+nC);
+    for(IdxT i=0; i<nR; i++) x(i) = row_match[i]>=0 ? row_match[i] : nC+i;
+    //Assigned columns pair their padding row with the dummy entry transposed from their own real entry
+    for(IdxT j=0; j<nC; j++) x(nR+j) = col_match[j]>=0 ? nC+col_match[j] : j;
+    return x;
+}
+
+/**
+ * Solve the solvePadded() problem within a time budget, completing the solution greedily on overrun.
+ * 
+ * The JV solver checks the deadline as it augments.  If it is reached, the real assignments of the partial
+ * JV solution are kept and the remaining rows and columns are matched by greedyMatch().  The result is always
+ * a valid padded solution, and is optimal when completed is true.  The greedy completion does not check
+ * the deadline, and costs a sort of the real entries.
+ * 
+ * @param[in] C (nR x nC) sparse costs of the real assignments
+ * @param[in] rowUnassigned (nR) cost of leaving each row unassigned
+ * @param[in] colUnassigned (nC) cost of leaving each column unassigned
+ * @param[in] dummyCost cost of the lower right block entries
+ * @param[in] timeBudget seconds allowed for the JV solver
+ * @param[out] completed true if the JV solver finished within the budget
+ * @returns row solution of the padded problem in the same form as solvePadded().
+ */
+template<class FloatT>
+typename LAP_JVSparse<FloatT>::IVecT
+LAP_JVSparse<FloatT>::solvePaddedBudgeted(const SpMatT &C, const VecT &rowUnassigned, const VecT &colUnassigned,
+                                          FloatT dummyCost, double timeBudget, bool &completed)
+{
+    IdxT nR = static_cast<IdxT>(C.n_rows);
+    IdxT nC = static_cast<IdxT>(C.n_cols);
+    IdxT n = checkedIndex<IdxT>(C.n_rows + C.n_cols, "solvePaddedBudgeted: padded size");
+    checkedIndex<IdxT>(2*C.n_nonzero + n, "solvePaddedBudgeted: padded nonzeros");
+    auto deadline = ClockT::now() + std::chrono::duration_cast<ClockT::duration>(std::chrono::duration<double>(timeBudget));
+    StopT expired = [deadline]() {return ClockT::now() >= deadline;};
+    IVecT x(n), y(n);
+    VecT u(n), v(n);
+    PaddedColumns<FloatT,IdxT> rows(C, rowUnassigned, colUnassigned, dummyCost);
+    completed = lap_orig(n, rows, y.memptr()-1, x.memptr()-1, v.memptr()-1, u.memptr()-1, expired); //Swap x&y and u&v as in solvePadded
+    if(completed) {
+        x-=1; //Convert to 0-based indexing
+        return x;
+    }
+    //Keep the consistent real assignments of the partial solution.  Indexes are still 1-based.
+    std::vector<IdxT> row_match(nR,-1), col_match(nC,-1);
+    std::vector<FloatT> match_cost(nR);
+    for(IdxT i=0; i<nR; i++) {
+        IdxT j = x(i)-1;
+        if(j<0 || j>=nC || y(j)-1 != i) continue;
+        row_match[i] = j;
+        col_match[j] = i;
+    }
+    greedyMatch(C, rowUnassigned, colUnassigned, dummyCost, row_match, col_match, match_cost);
+    return paddedSolution(row_match, col_match);
+}
+
+/**
+ * Compute the total cost of a padded solution from solvePadded(), solveGreedy(), or solvePaddedBudgeted().
+ * 
+ * Each real assignment is charged with one dummy entry, as every perfect padded matching uses exactly one
+ * dummy entry per real assignment.
+ */
+template<class FloatT>
+FloatT LAP_JVSparse<FloatT>::computePaddedCost(const SpMatT &C, const VecT &rowUnassigned,
+                                               const VecT &colUnassigned, FloatT dummyCost, const IVecT &x)
+{
+    IdxT nR = static_cast<IdxT>(C.n_rows);
+    IdxT nC = static_cast<IdxT>(C.n_cols);
+    FloatT cost = 0;
+    for(IdxT i=0; i<nR; i++) cost += x(i)<nC ? C(i,x(i)) + dummyCost : rowUnassigned(i);
+    for(IdxT j=0; j<nC; j++) if(x(nR+j) == j) cost += colUnassigned(j);
+    return cost;
+}
+
 /**
  * Compute the total cost of a solution
  * 
@@ -136,7 +678,7 @@ bool LAP_JVSparse<FloatT>::checkSolution(const SpMatT &C, const IVecT &x, const
         std::cout<<"InvalidRowSol: X:"<<x.t()<<"\n";
         ok = false;
     }
-    if(static_cast<int>(arma::unique(x).eval().n_elem) != N){
+    if(static_cast<IdxT>(arma::unique(x).eval().n_elem) != N){
         std::cout<<"NonUniqueRowSolPermutation: X:"<<x.t()<<"\n";
         ok = false;
     }
@@ -154,7 +696,7 @@ bool LAP_JVSparse<FloatT>::checkSolution(const SpMatT &C, const IVecT &x, const
         std::cout<<"InvalidColSol: Y:"<<y.t()<<"\n";
         ok = false;
     }
-    if(static_cast<int>(arma::unique(y).eval().n_elem) != N){
+    if(static_cast<IdxT>(arma::unique(y).eval().n_elem) != N){
         std::cout<<"NonUniqueColSolPermutation: Y:"<<y.t()<<"\n";
         ok = false;
     }
@@ -184,17 +726,34 @@ bool LAP_JVSparse<FloatT>::checkSolution(const SpMatT &C, const IVecT &x, const
 }
 
 //The raw lap file with the original matlab-style indexing
+//Rows are accessed through RowsT::row(i, cols, vals, len), giving the 1-based column indexes and costs of row i.
 template<class FloatT>
-void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[], const IdxT first[],
-                                    IdxT x[], IdxT y[], FloatT u[], FloatT v[])
+template<class RowsT>
+bool LAP_JVSparse<FloatT>::lap_orig(IdxT n, RowsT &rows, IdxT x[], IdxT y[], FloatT u[], FloatT v[], const StopT &stop,
+                                    IdxT sparseAugmentMinSize)
 {
-   IdxT h, i,j,k,l,t,last,tel,td1=0,td2,i0,j0=0,j1=0,l0;
+   IdxT h, i,j,k,l,t,last,tel,td1=0,td2,i0,j0=0,j1=0,l0,len;
+   const IdxT *kk;
+   const FloatT *cc;
 
    IdxT *lab, *freeRow, *todo;
    bool *ok;
    FloatT min, v0, vj, dj, tmp;
    FloatT *d;
    FloatT FLT_EPSILON = std::numeric_limits<FloatT>::epsilon();
+   /* On large problems augmentation only visits the neighbourhood of each free row, so d and ok are reset
+    * from the list of touched columns, and the next minimum is taken from a lazy-deletion heap of the touched
+    * columns instead of scanning all n.  Small problems are faster with the plain scans, so the heap is
+    * used from sparseAugmentMinSize up. */
+   const bool sparseAugment = n >= sparseAugmentMinSize;
+   std::vector<IdxT> touched;
+   std::vector<std::pair<FloatT,IdxT>> heap;
+   std::greater<std::pair<FloatT,IdxT>> heapCmp; /* min-heap */
+   /* A stop hook is polled between augmentations and every 1024 inner steps.  Stopping leaves x and y
+    * holding the consistent pairs x[y[j]]==j of the partial solution. */
+   bool completed = true;
+   IdxT nSteps = 0;
+   auto expired = [&]() { return stop && stop(); };
 
 
    ok = new bool[n + 1];
@@ -208,7 +767,8 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
 
    for (i = 1; i <= n; i++) {
       x[i] = 0; u[i] = 0;
-      for (t = first[i]; t < first[i+1]; t++) {
+      rows.row(i, kk, cc, len);
+      for (t = 0; t < len; t++) {
          j = kk[t];
          if (cc[t] < v[j]) {
             v[j] = cc[t];
@@ -234,14 +794,15 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
       } else if (x[i] > 0) {
          min = INFINITY;
          j1 = x[i];
-         for (t = first[i]; t < first[i+1]; t++) {
+         rows.row(i, kk, cc, len);
+         for (t = 0; t < len; t++) {
             j = kk[t];
             if (j != j1 && cc[t] - v[j] < min) {
                min = cc[t] - v[j];
             } /* if */
          } /* for */
          u[i] = min;
-         t = first[i];
+         t = 0;
          while (kk[t] != j1) {
             t++;
          } /* while */
@@ -257,10 +818,15 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
       l0 = l;
       l = 0;
       while (h <= l0) {
+         if (stop && (++nSteps & 1023) == 0 && expired()) {
+            completed = false;
+            goto cleanup;
+         } /* if */
          i = freeRow[h++];
          v0 = vj = INFINITY;
 
-         for (t = first[i]; t < first[i+1]; t++) {
+         rows.row(i, kk, cc, len);
+         for (t = 0; t < len; t++) {
 
             j = kk[t];
             dj = cc[t] - v[j];
@@ -305,21 +871,43 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
    } /* for */
 
    /* Augmentation part */
+   for (j = 1; j <= n; j++) {
+      d[j] = INFINITY;
+      ok[j] = false;
+   } /* for */
    l0 = l;
    for (l = 1; l <= l0; l++) {
+      if (expired()) {
+         completed = false;
+         goto cleanup;
+      } /* if */
 
-      for (j = 1; j <= n; j++) {
-         d[j] = INFINITY;
-         ok[j] = false;
-      } /* for */
+      if (sparseAugment) {
+         for (IdxT jt : touched) {
+            d[jt] = INFINITY;
+            ok[jt] = false;
+         } /* for */
+         touched.clear();
+         heap.clear();
+      } else if (l > 1) {
+         for (j = 1; j <= n; j++) {
+            d[j] = INFINITY;
+            ok[j] = false;
+         } /* for */
+      } /* if */
 
       min = INFINITY; i0 = freeRow[l];
 
-      for (t = first[i0]; t < first[i0+1]; t++) {
+      rows.row(i0, kk, cc, len);
+      for (t = 0; t < len; t++) {
          j = kk[t];
          dj = cc[t] - v[j];
          d[j] = dj;
          lab[j] = i0;
+         if (sparseAugment) {
+            touched.push_back(j);
+            heap.emplace_back(dj, j);
+         } /* if */
 
          if (dj <= min) {
             if (dj < min) {
@@ -330,6 +918,8 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
          } /* if */
       } /* for */
 
+      if (sparseAugment) std::make_heap(heap.begin(), heap.end(), heapCmp);
+
       for (h = 1; h <= td1; h++) {
          j = todo[h];
          if (y[j] == 0) {
@@ -343,22 +933,27 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
 
       /* Repeat until a freeRow row found */
       while (true) {
+         if (stop && (++nSteps & 1023) == 0 && expired()) {
+            completed = false;
+            goto cleanup;
+         } /* if */
          j0 = todo[td1--];
          i = y[j0];
          todo[td2--] = j0;
-         t = first[i];
+         rows.row(i, kk, cc, len);
 
-         for (t = first[i]; kk[t] != j0; t++) {
+         for (t = 0; kk[t] != j0; t++) {
             /* nothing */
          } /* for */
 
          tmp = cc[t] - v[j0] - min;
 
-         for (t = first[i]; t < first[i+1]; t++) {
+         for (t = 0; t < len; t++) {
             j = kk[t];
             if (!ok[j]) {
                vj = cc[t] - v[j] - tmp;
                if (vj < d[j]) {
+                  if (sparseAugment && d[j] == INFINITY) touched.push_back(j);
                   d[j] = vj;
                   lab[j] = i;
                   if (vj == min) {
@@ -368,6 +963,9 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
                      td1++;
                      todo[td1] = j;
                      ok[j] = true;
+                  } else if (sparseAugment) {
+                     heap.emplace_back(vj, j);
+                     std::push_heap(heap.begin(), heap.end(), heapCmp);
                   } /* if */
                } /* if */
             } /* if */
@@ -375,17 +973,34 @@ void LAP_JVSparse<FloatT>::lap_orig(IdxT n, const FloatT cc[], const IdxT kk[],
          if (td1 == 0) {
             min = INFINITY - 1;
             last = td2 + 1;
-            for (j = 1; j <= n; j++) {
-               if (d[j] <= min) {
-                  if (!ok[j]) {
-                     if (d[j] < min) {
-                        td1 = 0;
-                        min = d[j];
+            /* Drop scanned columns and superseded distances */
+            while (sparseAugment && !heap.empty() && (ok[heap.front().second] || heap.front().first != d[heap.front().second])) {
+               std::pop_heap(heap.begin(), heap.end(), heapCmp);
+               heap.pop_back();
+            } /* while */
+            if (sparseAugment && !heap.empty()) {
+               /* All the unscanned columns at the minimum distance, in increasing column order as by a full scan */
+               min = heap.front().first;
+               while (!heap.empty() && heap.front().first == min) {
+                  j = heap.front().second;
+                  std::pop_heap(heap.begin(), heap.end(), heapCmp);
+                  heap.pop_back();
+                  if (!ok[j] && d[j] == min) todo[++td1] = j;
+               } /* while */
+               std::sort(todo + 1, todo + td1 + 1);
+            } else {
+               for (j = 1; j <= n; j++) {
+                  if (d[j] <= min) {
+                     if (!ok[j]) {
+                        if (d[j] < min) {
+                           td1 = 0;
+                           min = d[j];
+                        } /* if */
+                        todo[++td1] = j;
                      } /* if */
-                     todo[++td1] = j;
                   } /* if */
-               } /* if */
-            } /* for */
+               } /* for */
+            } /* if */
             for (h = 1; h <= td1; h++) {
                j = todo[h];
                if (y[j] == 0) {
@@ -413,7 +1028,8 @@ label2:
 
    for (i = 1; i <= n; i++) {
       j  = x[i];
-      t = first[i];
+      rows.row(i, kk, cc, len);
+      t = 0;
       while (kk[t] != j) {
          t++;
       } /* while */
@@ -421,13 +1037,13 @@ label2:
       u[i] = cc[t] - v[j];
    } /* for */
 
-
+cleanup:
    delete [] ok;
    delete [] lab;
    delete [] freeRow;
    delete [] todo;
    delete [] d;
-
+   return completed;
 }
 
 
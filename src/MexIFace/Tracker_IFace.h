@@ -28,12 +28,24 @@ protected:
     //Non-static method calls
     void objInitializeTracks();
     void objGetTracks();
+    void objGetTrackIds();
+    void objGetTrackOffsets();
+    void objGetTrackStats();
+    void objQueryTracks();
     void objDebugF2F();
     void objLinkF2F();
     void objCloseGaps();
     void objDebugCloseGaps();
     void objGenerateTracks();
     void objGetStats();
+    void objSaveState();
+    void objLoadState();
+    void objStartGenerateTracks();
+    void objGetProgress();
+    void objCancelTracking();
+    void objWaitTracking();
+
+    void checkNotRunning();
 };
 
 template<class TrackerT>
@@ -54,8 +66,25 @@ Tracker_IFace<TrackerT>::Tracker_IFace()
     methodmap["linkF2F"] = std::bind(&Tracker_IFace::objLinkF2F, this);
     methodmap["closeGaps"] = std::bind(&Tracker_IFace::objCloseGaps, this);
     methodmap["getTracks"] = std::bind(&Tracker_IFace::objGetTracks, this);
+    methodmap["getTrackIds"] = std::bind(&Tracker_IFace::objGetTrackIds, this);
+    methodmap["getTrackOffsets"] = std::bind(&Tracker_IFace::objGetTrackOffsets, this);
+    methodmap["getTrackStats"] = std::bind(&Tracker_IFace::objGetTrackStats, this);
+    methodmap["queryTracks"] = std::bind(&Tracker_IFace::objQueryTracks, this);
     methodmap["getStats"] = std::bind(&Tracker_IFace::objGetStats, this);
     methodmap["generateTracks"] = std::bind(&Tracker_IFace::objGenerateTracks, this);
+    methodmap["saveState"] = std::bind(&Tracker_IFace::objSaveState, this);
+    methodmap["loadState"] = std::bind(&Tracker_IFace::objLoadState, this);
+    methodmap["startGenerateTracks"] = std::bind(&Tracker_IFace::objStartGenerateTracks, this);
+    methodmap["getProgress"] = std::bind(&Tracker_IFace::objGetProgress, this);
+    methodmap["cancelTracking"] = std::bind(&Tracker_IFace::objCancelTracking, this);
+    methodmap["waitTracking"] = std::bind(&Tracker_IFace::objWaitTracking, this);
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::checkNotRunning()
+{
+    //The object cannot be used while it is tracking in the background
+    if(obj->isTrackingRunning()) error("Running","Tracking is running in the background. Use waitTracking or cancelTracking first.");
 }
 
 
@@ -68,7 +97,9 @@ void Tracker_IFace<TrackerT>::objInitializeTracks()
     //  SE_positions - matrix standard errors of positions as columns: [SE_x SE_y].
     //  features -  [optional] matrix of features as columns: [f1 f2 ... fn].
     //  SE_features - [optional] matrix standard errors of features as columns: [SE_f1 SE_f2 ... SE_fn].
-    auto frameIdx = getVec<IdxT>();
+    //  species - [optional] vector of species labels 0..nSpecies-1 for each localization.  Features may be empty.
+    checkNotRunning();
+    auto frameIdx = arma::conv_to<typename TrackerT::IVecT>::from(getVec<int32_t>()); //Matlab frame indexes stay int32 with OPT_INDEX64
     auto position = getMat<FloatT>();
     auto SE_position = getMat<FloatT>();
     if(nrhs==3) {
@@ -77,6 +108,11 @@ void Tracker_IFace<TrackerT>::objInitializeTracks()
         auto feature = getMat<FloatT>();;
         auto SE_feature = getMat<FloatT>();;
         obj->initializeTracks(frameIdx,position, SE_position, feature, SE_feature);
+    } else if(nrhs==6){
+        auto feature = getMat<FloatT>();
+        auto SE_feature = getMat<FloatT>();
+        auto species = arma::conv_to<typename TrackerT::IVecT>::from(getVec<int32_t>());
+        obj->initializeTracks(frameIdx,position, SE_position, feature, SE_feature, species);
     } else {
         error("NArgs","Invalid number of arguments!");
     }
@@ -87,6 +123,7 @@ void Tracker_IFace<TrackerT>::objLinkF2F()
 {
     // [out]
     //  nTracks - number of tracks after frame2frame (-1 for error)
+    checkNotRunning();
     checkNumArgs(1,0);
     obj->linkF2F();
     output(obj->tracks.size());
@@ -97,6 +134,7 @@ void Tracker_IFace<TrackerT>::objCloseGaps()
 {
     // [out]
     //  nTracks - number of tracks after gapClose (-1 for error)
+    checkNotRunning();
     checkNumArgs(1,0);
     obj->closeGaps();
     output(obj->tracks.size());
@@ -107,6 +145,7 @@ void Tracker_IFace<TrackerT>::objGenerateTracks()
 {
     // [out]
     //  tracks - cell array of vectors.  Each vector is one track and lists the indexs of the localizations.
+    checkNotRunning();
     checkNumArgs(1,0);
     obj->generateTracks();
     output(obj->tracks);
@@ -118,10 +157,71 @@ void Tracker_IFace<TrackerT>::objGetTracks()
     //Get the current state of the tracks, which can be called between calls to linkF2F() and closeGaps()
     //[out]
     //  tracks - cell array of vectors.  Each vector is one track and lists the indexs of the localizations.
+    checkNotRunning();
     checkNumArgs(1,0);
     output(obj->tracks);
 }
 
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objGetTrackIds()
+{
+    //Flat form of getTracks that avoids allocating an array for every track
+    //[out]
+    //  trackIds - vector giving the track index of each localization. -1 for localizations not in any track.
+    checkNotRunning();
+    checkNumArgs(1,0);
+    output(obj->getTrackIds());
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objGetTrackOffsets()
+{
+    //Flat compressed sparse row form of getTracks
+    //[out]
+    //  offsets - vector of length nTracks+1.  Track t is locs(offsets(t)+1:offsets(t+1)) in matlab indexing.
+    //  locs - localization indexes of all tracks in track order.
+    checkNotRunning();
+    checkNumArgs(2,0);
+    typename TrackerT::IVecT offsets, locs;
+    obj->getTrackOffsets(offsets, locs);
+    output(offsets);
+    output(locs);
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objGetTrackStats()
+{
+    //Per-track analytics computed in parallel over the current tracks
+    //[in]
+    //  maxMSDLag - largest lag in frames for the mean squared displacement
+    //[out]
+    //  stats - struct of vectors of length nTracks: startFrame, endFrame, nLocs, lifetime, nBlinks,
+    //          darkFrames, maxDarkFrames, D, and msd and msdCount as flattened nTracks x maxMSDLag matrices.
+    checkNotRunning();
+    checkNumArgs(1,1);
+    auto maxMSDLag = static_cast<typename TrackerT::IdxT>(getScalar<int32_t>());
+    output(obj->getTrackStats(maxMSDLag));
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objQueryTracks()
+{
+    //Tracks with a localization inside an ROI during a range of frames, from the index built by closeGaps()
+    //[in]
+    //  frameRange - [startFrame, endFrame] inclusive
+    //  roiMin - lower ROI corner with one value per position column, or empty for all positions
+    //  roiMax - upper ROI corner with one value per position column, or empty for all positions
+    //[out]
+    //  trackIds - sorted track indexes in the same indexing as getTrackIds
+    checkNotRunning();
+    checkNumArgs(1,3);
+    auto frameRange = getVec<int32_t>();
+    auto roiMin = getVec<FloatT>();
+    auto roiMax = getVec<FloatT>();
+    if(frameRange.n_elem != 2) throw tracker::ParameterValueError("queryTracks: frameRange must be [startFrame, endFrame]");
+    output(obj->queryTracks(frameRange(0), frameRange(1), roiMin, roiMax));
+}
+
 template<class TrackerT>
 void Tracker_IFace<TrackerT>::objDebugF2F()
 {
@@ -133,8 +233,9 @@ void Tracker_IFace<TrackerT>::objDebugF2F()
     //  costs - cost matrix
     //  connections - 2xn matrix of connections.  -1 represents birth or death
     //  conn_costs - Costs for selected connections
+    checkNotRunning();
     checkNumArgs(5,1);
-    auto frameIdx = getScalar<typename TrackerT::IdxT>();
+    auto frameIdx = static_cast<typename TrackerT::IdxT>(getScalar<int32_t>());
     typename TrackerT::IVecT cur_locs;
     typename TrackerT::IVecT next_locs;
     typename TrackerT::SpMatT costs;
@@ -157,6 +258,7 @@ void Tracker_IFace<TrackerT>::objDebugCloseGaps()
     //  costs - cost matrix
     //  connections - 2xn matrix of connections.  0 represents birth or death
     //  conn_costs - Costs for selected connections
+    checkNotRunning();
     checkNumArgs(3,0);
     typename TrackerT::SpMatT costs;
     typename TrackerT::IMatT connections;
@@ -172,8 +274,65 @@ void Tracker_IFace<TrackerT>::objGetStats()
 {
     // [out]
     //  stats - struct of named doubles with params and various statistics on the tracks
+    checkNotRunning();
     checkNumArgs(1,0);
     output(obj->getStats());
 }
 
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objSaveState()
+{
+    // [in]
+    //  filename - checkpoint file to write the current tracking state to
+    checkNotRunning();
+    checkNumArgs(0,1);
+    obj->saveState(getString());
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objLoadState()
+{
+    // [in]
+    //  filename - checkpoint file written by saveState.  Replaces the localizations and tracks.
+    checkNotRunning();
+    checkNumArgs(0,1);
+    obj->loadState(getString());
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objStartGenerateTracks()
+{
+    //Run generateTracks on a background thread.  Poll with getProgress and collect with waitTracking.
+    checkNumArgs(0,0);
+    checkNotRunning();
+    obj->startGenerateTracks();
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objGetProgress()
+{
+    // [out]
+    //  progress - struct of named doubles: running, cancelRequested, phase, framesLinked, nFrames
+    checkNumArgs(1,0);
+    output(obj->getProgress());
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objCancelTracking()
+{
+    //Request the background tracking to stop.  waitTracking will then raise a CancelledError.
+    checkNumArgs(0,0);
+    obj->cancelTracking();
+}
+
+template<class TrackerT>
+void Tracker_IFace<TrackerT>::objWaitTracking()
+{
+    // [out]
+    //  nTracks - number of tracks once the background tracking has finished
+    checkNumArgs(1,0);
+    obj->waitTracking();
+    output(obj->tracks.size());
+}
+
 #endif /* TRACKER_TRACKER_IFACE_H */
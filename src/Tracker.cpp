@@ -5,15 +5,34 @@
  */
 
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <limits>
 
 #include "Tracker/Tracker.h"
 
 namespace tracker {
 
 const Tracker::FloatT Tracker::log2pi = log(2*arma::Datum<Tracker::FloatT>::pi);
+const char Tracker::checkpointMagic[8] = {'T','R','K','C','K','P','T','\0'};
 
-Tracker::Tracker(const VecParamT &)
+Tracker::Tracker(const VecParamT &param)
 {
+    if (param.find("spatialOrder") != param.end()) {
+        IdxT order = static_cast<IdxT>(param.at("spatialOrder")(0));
+        if(order!=ORDER_INPUT && order!=ORDER_MORTON && order!=ORDER_HILBERT) {
+            std::ostringstream msg;
+            msg<<"Unknown spatialOrder: "<<order;
+            throw ParameterValueError(msg.str());
+        }
+        spatialOrder = static_cast<SpatialOrderT>(order);
+    }
+}
+
+Tracker::~Tracker()
+{
+    stopWorker();
 }
 
 Tracker::VecParamT Tracker::getStats() const
@@ -25,6 +44,8 @@ Tracker::VecParamT Tracker::getStats() const
     stats["firstFrame"] =firstFrame;
     stats["lastFrame"] = lastFrame;
     stats["nFrames"] = nFrames;
+    stats["nSpecies"] = nSpecies;
+    stats["spatialOrder"] = static_cast<FloatT>(spatialOrder);
     stats["nTracks"] = tracks.size();
     stats["nLocalizationsAssigned"] = arma::sum(trackAssignment>=0);
     return stats;
@@ -38,6 +59,30 @@ void Tracker::initializeTracks(const IVecT &frameIdx_, const MatT &position_, co
 
 void Tracker::initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_)
 {
+    IVecT species_;
+    initializeTracks(frameIdx_, position_, SE_position_,feature_, SE_feature_, species_); //Call with a single species
+}
+
+/**
+ * Initialize with a species label for each localization.
+ * 
+ * Localizations of different species are never linked, so all the species of a movie are tracked in one
+ * pass.  Within each frame the localizations are grouped by species, making the F2F LAPs block diagonal.
+ * 
+ * Each column of position is one spatial dimension, so nDims is position.n_cols, and likewise nFeatures is
+ * feature.n_cols.
+ * 
+ * @param[in] species_ (N) species label of each localization, from 0 to nSpecies-1.  Empty for a single species.
+ */
+void Tracker::initializeTracks(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_,
+                               const IVecT &species_)
+{
+    if(!species_.is_empty() && frameIdx_.n_elem != species_.n_elem){
+        std::ostringstream msg;
+        msg<<"Bad tracks sizing. Expected frameIdx.n_elem="<<frameIdx_.n_elem<<" == species.n_elem="<<species_.n_elem;
+        throw ParameterValueError(msg.str());
+    }
+    if(!species_.is_empty() && species_.min() < 0) throw ParameterValueError("Species labels must be non-negative");
     if(frameIdx_.n_elem != position_.n_rows){
         std::ostringstream msg;
         msg<<"Bad tracks sizing. Expected frameIdx.n_elem="<<frameIdx_.n_elem<<" == position.n_rows="<<position_.n_rows;
@@ -69,20 +114,24 @@ void Tracker::initializeTracks(const IVecT &frameIdx_, const MatT &position_, co
         throw ParameterValueError(msg.str());
     }
 
-    N = static_cast<IdxT>(frameIdx_.n_elem);
-    nDims = static_cast<IdxT>(position_.n_cols)/2;
-    nFeatures = static_cast<IdxT>(feature_.n_cols)/2;
+    N = checkedIndex<IdxT>(frameIdx_.n_elem, "initializeTracks: localizations");
+    checkedIndex<IdxT>(2*frameIdx_.n_elem, "initializeTracks: padded gap-close size");
+    nDims = static_cast<IdxT>(position_.n_cols);
+    nFeatures = static_cast<IdxT>(feature_.n_cols);
     frameIdx = frameIdx_;
     position = position_;
     SE_position = SE_position_;
     feature = feature_;
     SE_feature = SE_feature_;
+    species = species_;
+    nSpecies = species.is_empty() ? 1 : species.max()+1;
 
     //Clear track data structures
     tracks.clear();
     tracks.reserve(static_cast<IdxT>(ceil(sqrt(N))));
     trackAssignment.set_size(N);
     trackAssignment.fill(-1);
+    queryIndex = QueryIndexT();
 
     //Initialize number of frames and range
     arma::uvec sFrameIdx = arma::stable_sort_index(frameIdx);//Ensure sort is stable.
@@ -112,6 +161,7 @@ void Tracker::initializeTracks(const IVecT &frameIdx_, const MatT &position_, co
         throw LogicalError(msg.str());
     }
     for(IdxT n=0; n<nFrames; n++) nFrameLocs(n)= frameLocIdx(n).n_elem;
+    sortFrameLocs(0);
     
 //     IdxT sum=0;
 //     for(IdxT n=0; n<nFrames; n++) sum+=frameLocIdx(n).n_elem;
@@ -138,4 +188,748 @@ void Tracker::printTracks() const
     }
 }
 
+/**
+ * The track index of each localization as a single flat vector.  Localizations not in any track are -1.
+ */
+Tracker::IVecT Tracker::getTrackIds() const
+{
+    IVecT ids(N);
+    ids.fill(-1);
+    for(IdxT t=0; t<static_cast<IdxT>(tracks.size()); t++) for(IdxT loc: tracks[t]) ids(loc) = t;
+    return ids;
+}
+
+/**
+ * The tracks in compressed sparse row form as two flat vectors.
+ * 
+ * @param[out] offsets (nTracks+1) Track t is the localizations locs(offsets(t)) to locs(offsets(t+1)-1).
+ * @param[out] locs The localization indexes of all tracks in track order.
+ */
+void Tracker::getTrackOffsets(IVecT &offsets, IVecT &locs) const
+{
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    offsets.set_size(nTracks+1);
+    offsets(0) = 0;
+    for(IdxT t=0; t<nTracks; t++) offsets(t+1) = offsets(t) + static_cast<IdxT>(tracks[t].size());
+    locs.set_size(offsets(nTracks));
+    IdxT n = 0;
+    for(auto &track: tracks) for(IdxT loc: track) locs(n++) = loc;
+}
+
+/**
+ * Per-track lifetime, blinking, mean squared displacement, and diffusion statistics as flat arrays.
+ * 
+ * Each entry is a vector of length nTracks, in the same track order as tracks, except msd and msdCount
+ * which are nTracks x maxMSDLag matrices flattened in column-major order.  Positions use the first
+ * nDims columns and SE_position is a variance, as in the tracking costs.  Tracks are independent and
+ * are processed in parallel.
+ * 
+ *  - startFrame, endFrame: frames of the first and last localization
+ *  - nLocs: number of localizations
+ *  - lifetime: endFrame-startFrame+1
+ *  - nBlinks: number of gaps between consecutive localizations
+ *  - darkFrames: total frames missing inside the track
+ *  - maxDarkFrames: longest single gap in frames
+ *  - D: diffusion estimate from consecutive displacements, corrected for localization error.  This is
+ *       sum(dx^2 - SE_i - SE_j)/(2*nDims*sum(dt)), and is NaN for tracks with one localization.  It can
+ *       be negative for short tracks dominated by localization error.
+ *  - msd: mean squared displacement over all localization pairs of each lag 1..maxMSDLag frames, or
+ *       NaN if the track has no pair at that lag.  Not corrected for localization error.
+ *  - msdCount: number of pairs averaged for each msd entry
+ * 
+ * @param[in] maxMSDLag Largest lag in frames for msd.  0 skips the MSD computation.
+ */
+Tracker::VecParamT Tracker::getTrackStats(IdxT maxMSDLag) const
+{
+    if(maxMSDLag<0) throw ParameterValueError("getTrackStats: maxMSDLag must be non-negative");
+    IVecT offsets, locs;
+    getTrackOffsets(offsets, locs);
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    const FloatT nan = arma::Datum<FloatT>::nan;
+    VecT startFrame(nTracks), endFrame(nTracks), nLocs(nTracks), lifetime(nTracks);
+    VecT nBlinks(nTracks), darkFrames(nTracks), maxDarkFrames(nTracks), Dest(nTracks);
+    VecT msd(nTracks*maxMSDLag), msdCount(nTracks*maxMSDLag);
+
+    #pragma omp parallel for schedule(dynamic,64)
+    for(IdxT t=0; t<nTracks; t++){
+        IdxT begin = offsets(t), end = offsets(t+1);
+        for(IdxT k=0; k<maxMSDLag; k++){
+            msd(t+k*nTracks) = 0;
+            msdCount(t+k*nTracks) = 0;
+        }
+        nLocs(t) = end-begin;
+        if(begin==end) {
+            startFrame(t) = endFrame(t) = Dest(t) = nan;
+            lifetime(t) = nBlinks(t) = darkFrames(t) = maxDarkFrames(t) = 0;
+            for(IdxT k=0; k<maxMSDLag; k++) msd(t+k*nTracks) = nan;
+            continue;
+        }
+        startFrame(t) = frameIdx(locs(begin));
+        endFrame(t) = frameIdx(locs(end-1));
+        lifetime(t) = endFrame(t)-startFrame(t)+1;
+        IdxT blinks = 0, dark = 0, maxDark = 0, sumDt = 0;
+        FloatT sumDisp = 0;
+        for(IdxT n=begin+1; n<end; n++){
+            IdxT prev = locs(n-1), cur = locs(n);
+            IdxT dt = frameIdx(cur)-frameIdx(prev);
+            if(dt>1) {
+                blinks++;
+                dark += dt-1;
+                maxDark = std::max(maxDark, dt-1);
+            }
+            sumDt += dt;
+            for(IdxT d=0; d<nDims; d++){
+                FloatT dx = position(cur,d)-position(prev,d);
+                sumDisp += dx*dx - SE_position(prev,d) - SE_position(cur,d);
+            }
+        }
+        nBlinks(t) = blinks;
+        darkFrames(t) = dark;
+        maxDarkFrames(t) = maxDark;
+        Dest(t) = (sumDt>0) ? sumDisp/(2*nDims*sumDt) : nan;
+
+        //Frames increase along a track, so the pairs for each start stop at the first lag past maxMSDLag
+        for(IdxT a=begin; a<end; a++){
+            IdxT locA = locs(a);
+            for(IdxT b=a+1; b<end; b++){
+                IdxT locB = locs(b);
+                IdxT lag = frameIdx(locB)-frameIdx(locA);
+                if(lag>maxMSDLag) break;
+                FloatT r2 = 0;
+                for(IdxT d=0; d<nDims; d++){
+                    FloatT dx = position(locB,d)-position(locA,d);
+                    r2 += dx*dx;
+                }
+                msd(t+(lag-1)*nTracks) += r2;
+                msdCount(t+(lag-1)*nTracks) += 1;
+            }
+        }
+        for(IdxT k=0; k<maxMSDLag; k++){
+            IdxT i = t+k*nTracks;
+            msd(i) = (msdCount(i)>0) ? msd(i)/msdCount(i) : nan;
+        }
+    }
+
+    VecParamT stats;
+    stats["startFrame"] = startFrame;
+    stats["endFrame"] = endFrame;
+    stats["nLocs"] = nLocs;
+    stats["lifetime"] = lifetime;
+    stats["nBlinks"] = nBlinks;
+    stats["darkFrames"] = darkFrames;
+    stats["maxDarkFrames"] = maxDarkFrames;
+    stats["D"] = Dest;
+    stats["msd"] = msd;
+    stats["msdCount"] = msdCount;
+    return stats;
+}
+
+/**
+ * Build the index over the current tracks used by queryTracks().
+ * 
+ * Each track is boxed by its frame span and the bounding box of its nDims position columns.  The
+ * boxes are sorted along a Hilbert curve through their centers and packed bottom up into an R-tree of
+ * queryIndexFanout children per node, so time and space are pruned together in one descent.  The tracks
+ * are also kept in getTrackOffsets() form for the exact test.  LAPTrack builds the index when closeGaps()
+ * finishes.  Rebuild it after changing tracks in any other way.
+ */
+void Tracker::buildQueryIndex()
+{
+    QueryIndexT index;
+    getTrackOffsets(index.offsets, index.locs);
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    IdxT nBoxDims = nDims+1;
+    const FloatT inf = std::numeric_limits<FloatT>::infinity();
+    //Space-time box of each track.  NaN positions are left out of the box.
+    MatT lo(nBoxDims, nTracks), hi(nBoxDims, nTracks);
+    #pragma omp parallel for schedule(dynamic,256)
+    for(IdxT t=0; t<nTracks; t++) {
+        for(IdxT d=0; d<nBoxDims; d++) {
+            lo(d,t) = inf;
+            hi(d,t) = -inf;
+        }
+        for(IdxT e=index.offsets(t); e<index.offsets(t+1); e++) {
+            IdxT loc = index.locs(e);
+            FloatT frame = static_cast<FloatT>(frameIdx(loc));
+            lo(0,t) = std::min(lo(0,t), frame);
+            hi(0,t) = std::max(hi(0,t), frame);
+            for(IdxT d=0; d<nDims; d++) {
+                lo(d+1,t) = std::min(lo(d+1,t), position(loc,d));
+                hi(d+1,t) = std::max(hi(d+1,t), position(loc,d));
+            }
+        }
+    }
+
+    //Order the leaves along a Hilbert curve through the box centers quantized on their bounding box
+    IdxT nBits = std::min<IdxT>(16, 64/nBoxDims);
+    FloatT maxCoord = static_cast<FloatT>((uint64_t(1)<<nBits)-1);
+    VecT low(nBoxDims), scale(nBoxDims);
+    for(IdxT d=0; d<nBoxDims; d++) {
+        FloatT cmin = inf, cmax = -inf;
+        for(IdxT t=0; t<nTracks; t++) {
+            FloatT c = (lo(d,t)+hi(d,t))/2;
+            if(std::isfinite(c)) {
+                cmin = std::min(cmin, c);
+                cmax = std::max(cmax, c);
+            }
+        }
+        low(d) = cmax>cmin ? cmin : 0;
+        scale(d) = cmax>cmin ? maxCoord/(cmax-cmin) : 0;
+    }
+    std::vector<std::pair<uint64_t,IdxT>> keys(nTracks); //(curve key, track)
+    #pragma omp parallel for schedule(static)
+    for(IdxT t=0; t<nTracks; t++) {
+        std::vector<uint32_t> coords(nBoxDims);
+        for(IdxT d=0; d<nBoxDims; d++) {
+            FloatT q = ((lo(d,t)+hi(d,t))/2-low(d))*scale(d);
+            coords[d] = q>0 ? static_cast<uint32_t>(std::min(q, maxCoord)) : 0; //NaN goes to 0
+        }
+        keys[t] = {curveKey(coords, nBits, true), t};
+    }
+    std::stable_sort(keys.begin(), keys.end(), [](const std::pair<uint64_t,IdxT> &a, const std::pair<uint64_t,IdxT> &b) {
+        return a.first < b.first;
+    });
+
+    //Levels from the leaves up to a single root
+    index.levelStart.push_back(0);
+    for(IdxT size=nTracks; size>0; size = size>1 ? (size+queryIndexFanout-1)/queryIndexFanout : 0)
+        index.levelStart.push_back(index.levelStart.back()+size);
+    IdxT nNodes = index.levelStart.back();
+    index.lo.set_size(nBoxDims, nNodes);
+    index.hi.set_size(nBoxDims, nNodes);
+    index.order.set_size(nTracks);
+    for(IdxT n=0; n<nTracks; n++) {
+        IdxT t = keys[n].second;
+        index.order(n) = t;
+        index.lo.col(n) = lo.col(t);
+        index.hi.col(n) = hi.col(t);
+    }
+    for(IdxT L=1; L+1<static_cast<IdxT>(index.levelStart.size()); L++) {
+        IdxT childStart = index.levelStart[L-1], childEnd = index.levelStart[L];
+        #pragma omp parallel for schedule(static)
+        for(IdxT node=index.levelStart[L]; node<index.levelStart[L+1]; node++) {
+            IdxT first = childStart + (node-index.levelStart[L])*queryIndexFanout;
+            IdxT last = std::min(first+queryIndexFanout, childEnd);
+            for(IdxT d=0; d<nBoxDims; d++) {
+                FloatT nodeLo = inf, nodeHi = -inf;
+                for(IdxT c=first; c<last; c++) {
+                    nodeLo = std::min(nodeLo, index.lo(d,c));
+                    nodeHi = std::max(nodeHi, index.hi(d,c));
+                }
+                index.lo(d,node) = nodeLo;
+                index.hi(d,node) = nodeHi;
+            }
+        }
+    }
+    index.nTracks = nTracks;
+    queryIndex = std::move(index);
+}
+
+/**
+ * The tracks passing through a region of interest during a range of frames.
+ * 
+ * A track matches if at least one of its localizations has a frame in startFrame..endFrame and a position
+ * inside the ROI, both inclusive.  The index from buildQueryIndex() prunes the tracks whose boxes
+ * miss the query, and only the remaining tracks are scanned.
+ * 
+ * @param[in] startFrame First frame of the query
+ * @param[in] endFrame Last frame of the query
+ * @param[in] roiMin (nDims) lower ROI corner, one value per position column.  Empty with roiMax for all positions.
+ * @param[in] roiMax (nDims) upper ROI corner, one value per position column.
+ * @returns Sorted indexes of the matching tracks
+ */
+Tracker::IVecT Tracker::queryTracks(IdxT startFrame, IdxT endFrame, const VecT &roiMin, const VecT &roiMax) const
+{
+    if(queryIndex.nTracks<0 || queryIndex.nTracks != static_cast<IdxT>(tracks.size()))
+        throw LogicalError("queryTracks: the query index is not built for the current tracks.  Call buildQueryIndex().");
+    bool useROI = !roiMin.is_empty() || !roiMax.is_empty();
+    if(useROI && (roiMin.n_elem != static_cast<arma::uword>(nDims) || roiMax.n_elem != static_cast<arma::uword>(nDims))) {
+        std::ostringstream msg;
+        msg<<"queryTracks: Expected roiMin.n_elem="<<roiMin.n_elem<<" == roiMax.n_elem="<<roiMax.n_elem<<" == position columns="<<nDims;
+        throw ParameterValueError(msg.str());
+    }
+    IdxT nBoxDims = nDims+1;
+    const FloatT inf = std::numeric_limits<FloatT>::infinity();
+    VecT qlo(nBoxDims), qhi(nBoxDims);
+    qlo(0) = startFrame;
+    qhi(0) = endFrame;
+    for(IdxT d=0; d<nDims; d++) {
+        qlo(d+1) = useROI ? roiMin(d) : -inf;
+        qhi(d+1) = useROI ? roiMax(d) : inf;
+    }
+    auto overlaps = [&](IdxT node) {
+        for(IdxT d=0; d<nBoxDims; d++) if(queryIndex.lo(d,node) > qhi(d) || queryIndex.hi(d,node) < qlo(d)) return false;
+        return true;
+    };
+
+    IndexVectorT matches;
+    IdxT nLevels = static_cast<IdxT>(queryIndex.levelStart.size())-1;
+    std::vector<std::pair<IdxT,IdxT>> stack; //(node, level)
+    if(nLevels>0) stack.emplace_back(queryIndex.levelStart[nLevels-1], nLevels-1);
+    while(!stack.empty()) {
+        IdxT node = stack.back().first, L = stack.back().second;
+        stack.pop_back();
+        if(!overlaps(node)) continue;
+        if(L>0) {
+            IdxT first = queryIndex.levelStart[L-1] + (node-queryIndex.levelStart[L])*queryIndexFanout;
+            IdxT last = std::min(first+queryIndexFanout, queryIndex.levelStart[L]);
+            for(IdxT c=first; c<last; c++) stack.emplace_back(c, L-1);
+            continue;
+        }
+        //Exact test of the track localizations
+        IdxT t = queryIndex.order(node);
+        for(IdxT e=queryIndex.offsets(t); e<queryIndex.offsets(t+1); e++) {
+            IdxT loc = queryIndex.locs(e);
+            bool inside = frameIdx(loc)>=startFrame && frameIdx(loc)<=endFrame;
+            for(IdxT d=0; d<nDims && inside && useROI; d++) inside = position(loc,d)>=roiMin(d) && position(loc,d)<=roiMax(d);
+            if(inside) {
+                matches.push_back(t);
+                break;
+            }
+        }
+    }
+    std::sort(matches.begin(), matches.end());
+    return IVecT(matches);
+}
+
+/**
+ * Initialize with the localizations of source without copying them, for trackers that only read them.
+ * 
+ * frameIdx, position, SE_position, feature, SE_feature, and species use the memory of source directly, so
+ * source must outlive this object and its localizations must not change while this object uses them.  Only
+ * the per-frame index frameLocIdx, nFrameLocs, and the scalar sizes are copied, so this object costs about
+ * N indexes rather than a copy of the localizations.  The tracks start empty.
+ */
+void Tracker::shareLocalizations(const Tracker &source)
+{
+    auto alias = [](const MatT &m) {
+        return m.is_empty() ? MatT() : MatT(const_cast<FloatT*>(m.memptr()), m.n_rows, m.n_cols, false, false);
+    };
+    auto aliasIdx = [](const IVecT &v) {
+        return v.is_empty() ? IVecT() : IVecT(const_cast<IdxT*>(v.memptr()), v.n_elem, false, false);
+    };
+    N = source.N;
+    nDims = source.nDims;
+    nFeatures = source.nFeatures;
+    frameIdx = aliasIdx(source.frameIdx);
+    position = alias(source.position);
+    SE_position = alias(source.SE_position);
+    feature = alias(source.feature);
+    SE_feature = alias(source.SE_feature);
+    species = aliasIdx(source.species);
+    nSpecies = source.nSpecies;
+    firstFrame = source.firstFrame;
+    lastFrame = source.lastFrame;
+    nFrames = source.nFrames;
+    nFrameLocs = source.nFrameLocs;
+    frameLocIdx = source.frameLocIdx;
+    tracks.clear();
+    trackAssignment.set_size(N);
+    trackAssignment.fill(-1);
+    queryIndex = QueryIndexT();
+}
+
+/**
+ * Append localizations in frames after lastFrame, extending the frame index without changing the tracks.
+ * 
+ * The new localizations are unassigned.  Subclasses decide how to link them.
+ */
+void Tracker::extendLocalizations(const IVecT &frameIdx_, const MatT &position_, const MatT &SE_position_, const MatT &feature_, const MatT &SE_feature_)
+{
+    IdxT nNew = static_cast<IdxT>(frameIdx_.n_elem);
+    checkedIndex<IdxT>(2*(frameIdx_.n_elem+N), "extendLocalizations: padded gap-close size");
+    if(position_.n_rows != frameIdx_.n_elem || SE_position_.n_rows != frameIdx_.n_elem || 
+       position_.n_cols != position.n_cols || SE_position_.n_cols != SE_position.n_cols){
+        std::ostringstream msg;
+        msg<<"Bad appended position sizing. Expected "<<frameIdx_.n_elem<<" x "<<position.n_cols<<" position and SE_position";
+        throw ParameterValueError(msg.str());
+    }
+    if(feature_.n_cols != feature.n_cols || SE_feature_.n_cols != SE_feature.n_cols ||
+       (!feature.is_empty() && (feature_.n_rows != frameIdx_.n_elem || SE_feature_.n_rows != frameIdx_.n_elem))){
+        std::ostringstream msg;
+        msg<<"Bad appended feature sizing. Expected "<<frameIdx_.n_elem<<" x "<<feature.n_cols<<" feature and SE_feature";
+        throw ParameterValueError(msg.str());
+    }
+    if(nNew==0) return;
+    if(!species.is_empty()) throw ParameterValueError("Appending localizations is not supported with species labels");
+    if(frameIdx_.min() <= lastFrame){
+        std::ostringstream msg;
+        msg<<"Appended localizations must be in frames after lastFrame="<<lastFrame<<". Got frameIdx="<<frameIdx_.min();
+        throw ParameterValueError(msg.str());
+    }
+    IdxT oldN = N;
+    N += nNew;
+    frameIdx = arma::join_cols(frameIdx, frameIdx_);
+    position = arma::join_cols(position, position_);
+    SE_position = arma::join_cols(SE_position, SE_position_);
+    if(!feature.is_empty()) {
+        feature = arma::join_cols(feature, feature_);
+        SE_feature = arma::join_cols(SE_feature, SE_feature_);
+    }
+    trackAssignment.resize(N);
+    trackAssignment.tail(nNew).fill(-1);
+
+    //Extend frameLocIdx with the new frames
+    IdxT oldNFrames = nFrames;
+    lastFrame = frameIdx_.max();
+    nFrames = lastFrame-firstFrame+1;
+    IVecFieldT newFrameLocIdx(nFrames);
+    for(IdxT n=0; n<oldNFrames; n++) newFrameLocIdx(n) = std::move(frameLocIdx(n));
+    frameLocIdx = std::move(newFrameLocIdx);
+    nFrameLocs.resize(nFrames);
+    nFrameLocs.tail(nFrames-oldNFrames).zeros();
+    arma::uvec sFrameIdx = arma::stable_sort_index(frameIdx_);
+    for(IdxT n=0; n<nNew; ) {
+        IdxT frame = frameIdx_(sFrameIdx(n));
+        IdxT nFrame = 0;
+        while(n+nFrame<nNew && frameIdx_(sFrameIdx(n+nFrame))==frame) nFrame++;
+        IVecT &locs = frameLocIdx(frame-firstFrame);
+        locs.set_size(nFrame);
+        for(IdxT k=0; k<nFrame; k++) locs(k) = oldN + static_cast<IdxT>(sFrameIdx(n+k));
+        nFrameLocs(frame-firstFrame) = nFrame;
+        n += nFrame;
+    }
+    sortFrameLocs(oldNFrames);
+}
+
+/**
+ * Group the localizations of each frame from firstSortFrame on by species, and sort each group along the
+ * spatialOrder curve.
+ * 
+ * Positions are quantized on the bounding box of all localizations, so a particle keeps about the same
+ * curve position from frame to frame and the F2F cost matrices cluster near the diagonal.  Tracks are
+ * numbered in birth-frame order, so the gap-close track starts inherit the ordering within each frame.
+ * Ties keep the input order.
+ */
+void Tracker::sortFrameLocs(IdxT firstSortFrame)
+{
+    bool bySpecies = nSpecies>1;
+    IdxT nBits = (spatialOrder==ORDER_INPUT || nDims<=0) ? 0 : std::min<IdxT>(16, 64/nDims); //Curve key bits per dimension
+    if((!bySpecies && nBits<=0) || N==0) return;
+    FloatT maxCoord = static_cast<FloatT>((uint64_t(1)<<nBits)-1);
+    VecT low(nDims), scale(nDims);
+    for(IdxT d=0; d<nDims && nBits>0; d++) {
+        FloatT lo = std::numeric_limits<FloatT>::infinity(), hi = -lo;
+        for(IdxT n=0; n<N; n++) if(std::isfinite(position(n,d))) {
+            lo = std::min(lo, position(n,d));
+            hi = std::max(hi, position(n,d));
+        }
+        low(d) = hi>lo ? lo : 0;
+        scale(d) = hi>lo ? maxCoord/(hi-lo) : 0;
+    }
+    bool hilbert = spatialOrder==ORDER_HILBERT;
+    #pragma omp parallel for schedule(dynamic,64)
+    for(IdxT f=firstSortFrame; f<nFrames; f++) {
+        IVecT &locs = frameLocIdx(f);
+        std::vector<std::pair<uint64_t,IdxT>> keys(locs.n_elem); //(curve key, localization)
+        std::vector<uint32_t> coords(nDims);
+        for(IdxT n=0; n<static_cast<IdxT>(locs.n_elem); n++) {
+            uint64_t key = 0;
+            if(nBits>0) {
+                for(IdxT d=0; d<nDims; d++) {
+                    FloatT q = (position(locs(n),d)-low(d))*scale(d);
+                    coords[d] = q>0 ? static_cast<uint32_t>(std::min(q, maxCoord)) : 0; //NaN goes to 0
+                }
+                key = curveKey(coords, nBits, hilbert);
+            }
+            keys[n] = {key, locs(n)};
+        }
+        std::stable_sort(keys.begin(), keys.end(), [&](const std::pair<uint64_t,IdxT> &a, const std::pair<uint64_t,IdxT> &b) {
+            if(bySpecies && species(a.second) != species(b.second)) return species(a.second) < species(b.second);
+            return a.first < b.first;
+        });
+        for(IdxT n=0; n<static_cast<IdxT>(locs.n_elem); n++) locs(n) = keys[n].second;
+    }
+}
+
+/**
+ * The position along a Morton or Hilbert curve of a point with nBits bit integer coordinates.
+ * 
+ * The Hilbert key uses Skilling's transform to the transposed Hilbert index, which works in any number of
+ * dimensions, before the bits are interleaved.  coords.size()*nBits must be at most 64.
+ * 
+ * @param[in,out] coords integer coordinates, overwritten by the Hilbert transform
+ */
+uint64_t Tracker::curveKey(std::vector<uint32_t> &coords, IdxT nBits, bool hilbert)
+{
+    IdxT n = static_cast<IdxT>(coords.size());
+    if(hilbert) {
+        uint32_t M = uint32_t(1)<<(nBits-1);
+        for(uint32_t Q=M; Q>1; Q>>=1) { //Inverse undo
+            uint32_t P = Q-1;
+            for(IdxT i=0; i<n; i++) {
+                if(coords[i] & Q) {
+                    coords[0] ^= P;
+                } else {
+                    uint32_t t = (coords[0]^coords[i]) & P;
+                    coords[0] ^= t;
+                    coords[i] ^= t;
+                }
+            }
+        }
+        for(IdxT i=1; i<n; i++) coords[i] ^= coords[i-1]; //Gray encode
+        uint32_t t = 0;
+        for(uint32_t Q=M; Q>1; Q>>=1) if(coords[n-1] & Q) t ^= Q-1;
+        for(IdxT i=0; i<n; i++) coords[i] ^= t;
+    }
+    uint64_t key = 0;
+    for(IdxT b=nBits-1; b>=0; b--) for(IdxT i=0; i<n; i++) key = (key<<1) | ((coords[i]>>b) & 1);
+    return key;
+}
+
+/**
+ * Run generateTracks() on a background worker thread and return immediately.
+ * 
+ * Use getProgress() to poll, cancelTracking() to request a cooperative stop, and waitTracking() to
+ * collect the result.  The tracker must not be otherwise used until waitTracking() returns.
+ */
+void Tracker::startGenerateTracks()
+{
+    if(workerRunning) throw LogicalError("startGenerateTracks: tracking is already running");
+    if(worker.joinable()) worker.join(); //Finished but not yet waited on
+    cancelRequested = false;
+    workerError = nullptr;
+    workerRunning = true;
+    worker = std::thread([this]() {
+        try {
+            generateTracks();
+        } catch(...) {
+            workerError = std::current_exception();
+        }
+        workerRunning = false;
+    });
+}
+
+/**
+ * Ask the background tracking to stop at its next check.  waitTracking() will throw CancelledError.
+ */
+void Tracker::cancelTracking()
+{
+    cancelRequested = true;
+}
+
+bool Tracker::isTrackingRunning() const
+{
+    return workerRunning;
+}
+
+/**
+ * Wait for the background tracking to finish, re-throwing any exception it raised.
+ */
+void Tracker::waitTracking()
+{
+    if(worker.joinable()) worker.join();
+    cancelRequested = false;
+    if(workerError) {
+        std::exception_ptr error = workerError;
+        workerError = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+Tracker::VecParamT Tracker::getProgress() const
+{
+    VecParamT progress;
+    progress["running"] = static_cast<FloatT>(workerRunning);
+    progress["cancelRequested"] = static_cast<FloatT>(cancelRequested);
+    return progress;
+}
+
+void Tracker::checkCancelled() const
+{
+    if(cancelRequested) throw CancelledError("Tracking cancelled");
+}
+
+void Tracker::stopWorker()
+{
+    if(!worker.joinable()) return;
+    cancelRequested = true;
+    worker.join();
+}
+
+/**
+ * Save the full tracker state to a binary checkpoint file.
+ * 
+ * The checkpoint holds the localization data, the frame index and the tracks along with any
+ * intermediate tracking state of the subclass, so tracking can be resumed with loadState() from the
+ * same point.  Parameters are not stored and are taken from the object loading the checkpoint.
+ */
+void Tracker::saveState(const std::string &filename) const
+{
+    std::ofstream out(filename, std::ios::binary);
+    if(!out) throw ParameterValueError("saveState: unable to open file: "+filename);
+    out.write(checkpointMagic, sizeof(checkpointMagic));
+    writeValue(out, checkpointVersion);
+    writeValue(out, static_cast<uint32_t>(sizeof(FloatT)));
+    writeValue(out, static_cast<uint32_t>(sizeof(IdxT)));
+    writeState(out);
+    if(!out) throw ParameterValueError("saveState: error writing file: "+filename);
+}
+
+/**
+ * Load a tracker state saved by saveState(), replacing any current localizations and tracks.
+ */
+void Tracker::loadState(const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) throw ParameterValueError("loadState: unable to open file: "+filename);
+    char magic[sizeof(checkpointMagic)];
+    uint32_t version, float_size, idx_size;
+    if(!in.read(magic, sizeof(magic)) || std::memcmp(magic, checkpointMagic, sizeof(magic))) 
+        throw ParameterValueError("loadState: not a Tracker checkpoint file: "+filename);
+    readValue(in, version);
+    readValue(in, float_size);
+    readValue(in, idx_size);
+    if(version != checkpointVersion || float_size != sizeof(FloatT) || idx_size != sizeof(IdxT)) {
+        std::ostringstream msg;
+        msg<<"loadState: incompatible checkpoint. version:"<<version<<" sizeof(FloatT):"<<float_size<<" sizeof(IdxT):"<<idx_size;
+        throw ParameterValueError(msg.str());
+    }
+    readState(in);
+}
+
+void Tracker::writeState(std::ostream &out) const
+{
+    writeValue(out, N);
+    writeValue(out, nDims);
+    writeValue(out, nFeatures);
+    writeValue(out, firstFrame);
+    writeValue(out, lastFrame);
+    writeValue(out, nFrames);
+    writeArray(out, frameIdx);
+    writeArray(out, position);
+    writeArray(out, SE_position);
+    writeArray(out, feature);
+    writeArray(out, SE_feature);
+    writeArray(out, species);
+    writeArray(out, nFrameLocs);
+    //frameLocIdx is stored concatenated in frame order and split using nFrameLocs
+    IndexVectorT frame_locs;
+    frame_locs.reserve(N);
+    for(IdxT n=0; n<nFrames; n++) frame_locs.insert(frame_locs.end(), frameLocIdx(n).begin(), frameLocIdx(n).end());
+    writeVector(out, frame_locs);
+    IVecT track_offsets, track_locs;
+    getTrackOffsets(track_offsets, track_locs);
+    writeArray(out, track_offsets);
+    writeArray(out, track_locs);
+    writeArray(out, trackAssignment);
+}
+
+void Tracker::readState(std::istream &in)
+{
+    SavedStateT saved;
+    readSavedState(in, saved);
+    commitSavedState(saved);
+}
+
+/**
+ * Throw if nElem elements of elemSize bytes cannot fit in the rest of the checkpoint, so a corrupt size
+ * fails before the array is allocated.
+ */
+void Tracker::checkSavedSize(std::istream &in, uint64_t nElem, size_t elemSize)
+{
+    auto pos = in.tellg();
+    if(pos < 0) return; //Not seekable.  The read itself will fail at the end of the stream.
+    in.seekg(0, std::ios::end);
+    auto end = in.tellg();
+    in.seekg(pos);
+    uint64_t remaining = static_cast<uint64_t>(end-pos);
+    if(nElem > remaining/elemSize) throw ParameterValueError("Checkpoint: corrupt array size");
+}
+
+/**
+ * Read the Tracker part of a checkpoint into saved and check that the arrays are consistent with each other.
+ * No member is changed, so a corrupt checkpoint leaves this object as it was.
+ */
+void Tracker::readSavedState(std::istream &in, SavedStateT &saved) const
+{
+    readValue(in, saved.N);
+    readValue(in, saved.nDims);
+    readValue(in, saved.nFeatures);
+    readValue(in, saved.firstFrame);
+    readValue(in, saved.lastFrame);
+    readValue(in, saved.nFrames);
+    IdxT N_ = saved.N;
+    if(N_<0 || saved.nDims<0 || saved.nFeatures<0 || saved.nFrames<0 || saved.nFrames!=saved.lastFrame-saved.firstFrame+1)
+        throw ParameterValueError("loadState: invalid sizes");
+    auto nRows = static_cast<arma::uword>(N_);
+    readArray(in, saved.frameIdx);
+    readArray(in, saved.position);
+    readArray(in, saved.SE_position);
+    readArray(in, saved.feature);
+    readArray(in, saved.SE_feature);
+    readArray(in, saved.species);
+    if(saved.frameIdx.n_elem != nRows 
+            || saved.position.n_rows != nRows || saved.position.n_cols != static_cast<arma::uword>(saved.nDims)
+            || saved.SE_position.n_rows != nRows || saved.SE_position.n_cols != saved.position.n_cols
+            || saved.feature.n_cols != static_cast<arma::uword>(saved.nFeatures) || saved.SE_feature.n_cols != saved.feature.n_cols
+            || (saved.nFeatures>0 && (saved.feature.n_rows != nRows || saved.SE_feature.n_rows != nRows))
+            || (!saved.species.is_empty() && saved.species.n_elem != nRows))
+        throw ParameterValueError("loadState: inconsistent localization arrays");
+    if(N_>0 && (saved.frameIdx.min()<saved.firstFrame || saved.frameIdx.max()>saved.lastFrame)) 
+        throw ParameterValueError("loadState: frame index out of range");
+    if(!saved.species.is_empty() && saved.species.min()<0) throw ParameterValueError("loadState: negative species");
+    saved.nSpecies = saved.species.is_empty() ? 1 : saved.species.max()+1;
+
+    auto validLocs = [N_](const IdxT *begin, const IdxT *end) {
+        return std::all_of(begin, end, [N_](IdxT loc) {return loc>=0 && loc<N_;});
+    };
+    readArray(in, saved.nFrameLocs);
+    IndexVectorT frame_locs;
+    readVector(in, frame_locs);
+    if(static_cast<IdxT>(saved.nFrameLocs.n_elem) != saved.nFrames || (saved.nFrames>0 && saved.nFrameLocs.min()<0)
+            || static_cast<size_t>(arma::accu(saved.nFrameLocs)) != frame_locs.size() 
+            || !validLocs(frame_locs.data(), frame_locs.data()+frame_locs.size()))
+        throw ParameterValueError("loadState: inconsistent frame localization index");
+    saved.frameLocIdx.set_size(saved.nFrames);
+    IdxT pos = 0;
+    for(IdxT n=0; n<saved.nFrames; n++) {
+        saved.frameLocIdx(n) = IVecT(frame_locs.data()+pos, saved.nFrameLocs(n));
+        pos += saved.nFrameLocs(n);
+    }
+
+    IVecT track_offsets, track_locs;
+    readArray(in, track_offsets);
+    readArray(in, track_locs);
+    if(track_offsets.is_empty() || track_offsets(0) != 0 
+            || static_cast<arma::uword>(track_offsets(track_offsets.n_elem-1)) != track_locs.n_elem
+            || !std::is_sorted(track_offsets.begin(), track_offsets.end())
+            || !validLocs(track_locs.memptr(), track_locs.memptr()+track_locs.n_elem))
+        throw ParameterValueError("loadState: inconsistent tracks");
+    saved.tracks.reserve(track_offsets.n_elem-1);
+    for(arma::uword t=0; t+1<track_offsets.n_elem; t++) 
+        saved.tracks.emplace_back(track_locs.begin()+track_offsets(t), track_locs.begin()+track_offsets(t+1));
+    readArray(in, saved.trackAssignment);
+    //closeGaps() leaves the assignment empty
+    auto nTracks = static_cast<IdxT>(saved.tracks.size());
+    if((!saved.trackAssignment.is_empty() && saved.trackAssignment.n_elem != nRows)
+            || (N_>0 && !saved.trackAssignment.is_empty() && (saved.trackAssignment.min()<-1 || saved.trackAssignment.max()>=nTracks)))
+        throw ParameterValueError("loadState: inconsistent track assignment");
+}
+
+/**
+ * Replace the Tracker members with a state from readSavedState().  The arrays are swapped, so saved is left empty.
+ */
+void Tracker::commitSavedState(SavedStateT &saved)
+{
+    N = saved.N;
+    nDims = saved.nDims;
+    nFeatures = saved.nFeatures;
+    firstFrame = saved.firstFrame;
+    lastFrame = saved.lastFrame;
+    nFrames = saved.nFrames;
+    nSpecies = saved.nSpecies;
+    frameIdx.swap(saved.frameIdx);
+    position.swap(saved.position);
+    SE_position.swap(saved.SE_position);
+    feature.swap(saved.feature);
+    SE_feature.swap(saved.SE_feature);
+    species.swap(saved.species);
+    nFrameLocs.swap(saved.nFrameLocs);
+    std::swap(frameLocIdx, saved.frameLocIdx);
+    tracks.swap(saved.tracks);
+    trackAssignment.swap(saved.trackAssignment);
+    queryIndex = QueryIndexT();
+}
+
 } /* namespace tracker */
@@ -0,0 +1,287 @@
+/** @file ChunkedTracking.cpp
+ *  @author Mark J. Olah (mjo at cs.unm.edu)
+ *  @date 2015-2019
+ *  @brief Tracking long movies in overlapping temporal chunks with worker processes
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+#ifndef _WIN32
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#include "Tracker/LAPTrack.h"
+#include "TrackerCLI.h"
+
+namespace tracker {
+namespace cli {
+
+/**
+ * Run each command as a separate process, with at most nWorkers running at once.  Empty commands are
+ * skipped.  Throws after all processes have finished if any could not be started or exited with an error.
+ */
+static void runWorkers(const std::vector<std::vector<std::string>> &commands, IdxT nWorkers)
+{
+#ifdef _WIN32
+    throw ParameterValueError("trackChunked: worker processes require a POSIX system");
+#else
+    std::map<pid_t, size_t> running; //Command index of each running worker
+    std::vector<size_t> failed;
+    size_t next = 0;
+    while(next < commands.size() || !running.empty()) {
+        while(next < commands.size() && static_cast<IdxT>(running.size()) < std::max(nWorkers, IdxT(1))) {
+            size_t k = next++;
+            if(commands[k].empty()) continue;
+            std::vector<char*> argv;
+            for(auto &arg: commands[k]) argv.push_back(const_cast<char*>(arg.c_str()));
+            argv.push_back(nullptr);
+            pid_t pid;
+            if(posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) failed.push_back(k);
+            else running[pid] = k;
+        }
+        if(running.empty()) break;
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid < 0) {
+            if(errno == EINTR) continue;
+            throw ParameterValueError(std::string("trackChunked: waiting for workers: ")+std::strerror(errno));
+        }
+        auto worker = running.find(pid);
+        if(worker == running.end()) continue;
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed.push_back(worker->second);
+        running.erase(worker);
+    }
+    if(!failed.empty()) {
+        std::sort(failed.begin(), failed.end());
+        std::ostringstream msg;
+        msg<<"trackChunked: worker failed for chunk";
+        for(size_t k: failed) msg<<" "<<k;
+        throw ParameterValueError(msg.str());
+    }
+#endif
+}
+
+/* The rows of m selected by sel.  Matrices without columns keep their shape. */
+static MatT selectRows(const MatT &m, const arma::uvec &sel)
+{
+    if(m.n_cols == 0) return MatT(sel.n_elem, 0);
+    return m.rows(sel);
+}
+
+/**
+ * Write the worker config and chunk inputs and run a worker on each non-empty chunk.  Chunk k covers the frames
+ * from coreStart(k) to coreStart(k+1)+overlap, and its localizations are in input order.  The names of the files
+ * written are recorded as they are created, so the caller can remove them if this throws.
+ */
+static void runChunkWorkers(const LocalizationsT &locs, const VecParamT &params, const ChunkOptionsT &opts,
+                            const IVecT &coreStart, IdxT overlap, const std::string &configFile,
+                            std::vector<arma::uvec> &chunkLocs, std::vector<std::string> &inputFiles,
+                            std::vector<std::string> &outputFiles)
+{
+    IdxT nChunks = static_cast<IdxT>(chunkLocs.size());
+    //The workers keep every track, as minFinalTrackLength is applied after stitching
+    VecParamT workerParams = params;
+    workerParams["minFinalTrackLength"] = Tracker::VecT{1};
+    writeConfigFile(configFile, workerParams);
+
+    std::vector<std::vector<std::string>> commands(nChunks);
+    for(IdxT k=0; k<nChunks; k++) {
+        IdxT end = coreStart(k+1) + (k+1<nChunks ? overlap : 0);
+        chunkLocs[k] = arma::find((locs.frameIdx >= coreStart(k)) % (locs.frameIdx < end));
+        if(chunkLocs[k].is_empty()) continue;
+        LocalizationsT chunk;
+        chunk.frameIdx = locs.frameIdx.elem(chunkLocs[k]);
+        chunk.position = selectRows(locs.position, chunkLocs[k]);
+        chunk.SE_position = selectRows(locs.SE_position, chunkLocs[k]);
+        chunk.feature = selectRows(locs.feature, chunkLocs[k]);
+        chunk.SE_feature = selectRows(locs.SE_feature, chunkLocs[k]);
+        inputFiles[k] = opts.workDir+"/chunk"+std::to_string(k)+".bin";
+        outputFiles[k] = opts.workDir+"/chunk"+std::to_string(k)+".csr";
+        writeLocalizationsBinary(inputFiles[k], chunk);
+        commands[k] = {opts.executable, "-c", configFile, "-o", "csr"};
+        if(opts.nWorkerThreads > 0) {
+            commands[k].push_back("-t");
+            commands[k].push_back(std::to_string(opts.nWorkerThreads));
+        }
+        commands[k].push_back(inputFiles[k]);
+        commands[k].push_back(outputFiles[k]);
+    }
+    runWorkers(commands, opts.nWorkers);
+}
+
+/**
+ * Track localizations in overlapping temporal chunks, each in a separate worker process, and stitch the
+ * chunk tracks into global tracks.
+ *
+ * The frame range is split into opts.nChunks core ranges, at most one per maxGapCloseFrames frames so each core is
+ * at least as long as the overlap.  Chunk k is given the localizations of its core
+ * frames and the following maxGapCloseFrames frames, so every F2F and gap-closing connection out of its core
+ * can be made.  The chunk inputs, a worker config, and the chunk tracks are exchanged as files in
+ * opts.workDir.  Each worker is the opts.executable tracker run on one chunk with -o csr, so the workers can
+ * be placed on other nodes by running the same commands there.  Unless opts.keepFiles is set, the chunk files
+ * are removed once the chunk tracks are read, or if a worker fails.
+ *
+ * Each localization belongs to the chunk whose core holds its frame.  The tracks of a chunk keep only
+ * their core localizations, and a chunk track is joined to the later chunk track holding most of its
+ * overlap localizations, when each is the other's best match.  minFinalTrackLength is applied to the
+ * stitched tracks, not within the chunks.  The stitched tracks are ordered by their first frame.
+ *
+ * @param[in] locs All the localizations
+ * @param[in] params LAPTrack parameters
+ * @param[in] opts Chunking options
+ * @param[out] offsets (nTracks+1) offsets of the tracks in trackLocs as from Tracker::getTrackOffsets()
+ * @param[out] trackLocs localization indexes of the tracks
+ * @param[out] stats Chunking statistics
+ */
+void trackChunked(const LocalizationsT &locs, const VecParamT &params, const ChunkOptionsT &opts,
+                  IVecT &offsets, IVecT &trackLocs, VecParamT &stats)
+{
+    IdxT N = static_cast<IdxT>(locs.frameIdx.n_elem);
+    if(N == 0) throw ParameterValueError("trackChunked: no localizations");
+    if(opts.workDir.empty()) throw ParameterValueError("trackChunked: no work directory");
+    if(opts.executable.empty()) throw ParameterValueError("trackChunked: no worker executable");
+    LAPTrack defaults(params); //The parameter values used by the workers
+    IdxT overlap = std::max(defaults.maxGapCloseFrames, IdxT(1));
+    IdxT minFinalTrackLength = defaults.minFinalTrackLength;
+    IdxT firstFrame = locs.frameIdx.min();
+    IdxT nFrames = locs.frameIdx.max() - firstFrame + 1;
+    //Each core is at least overlap frames long, so a chunk's overlap frames never reach past the next chunk's core
+    IdxT nChunks = std::max(IdxT(1), std::min(opts.nChunks, nFrames/overlap));
+    IVecT coreStart(nChunks+1);
+    for(IdxT k=0; k<=nChunks; k++) coreStart(k) = firstFrame + static_cast<IdxT>((static_cast<int64_t>(nFrames)*k)/nChunks);
+    IVecT chunkOf(N);
+    for(IdxT n=0; n<N; n++) chunkOf(n) = static_cast<IdxT>(std::upper_bound(coreStart.begin(), coreStart.end(), locs.frameIdx(n)) - coreStart.begin()) - 1;
+
+#ifndef _WIN32
+    bool createdDir = mkdir(opts.workDir.c_str(), 0777) == 0;
+    if(!createdDir && errno != EEXIST)
+        throw ParameterValueError("trackChunked: unable to create work directory: "+opts.workDir+": "+std::strerror(errno));
+#else
+    bool createdDir = false;
+#endif
+    std::string configFile = opts.workDir+"/worker.cfg";
+    std::vector<std::string> inputFiles(nChunks), outputFiles(nChunks);
+    auto removeChunkFiles = [&]() {
+        for(IdxT k=0; k<nChunks; k++) {
+            if(!inputFiles[k].empty()) std::remove(inputFiles[k].c_str());
+            if(!outputFiles[k].empty()) std::remove(outputFiles[k].c_str());
+        }
+        std::remove(configFile.c_str());
+#ifndef _WIN32
+        if(createdDir) rmdir(opts.workDir.c_str());
+#endif
+    };
+
+    //Run the workers and read the chunk tracks.  Node t of chunk k is chunk track nodeStart[k]+t.
+    std::vector<arma::uvec> chunkLocs(nChunks);
+    std::vector<IVecT> chunkOffsets(nChunks), chunkTrackLocs(nChunks);
+    IndexVectorT nodeStart(nChunks+1, 0);
+    try {
+        runChunkWorkers(locs, params, opts, coreStart, overlap, configFile, chunkLocs, inputFiles, outputFiles);
+        for(IdxT k=0; k<nChunks; k++) {
+            if(!outputFiles[k].empty()) {
+                readTrackOffsets(outputFiles[k], chunkOffsets[k], chunkTrackLocs[k]);
+                for(IdxT &loc: chunkTrackLocs[k]) loc = static_cast<IdxT>(chunkLocs[k](loc)); //Global localization indexes
+            }
+            IdxT nTracks = chunkOffsets[k].is_empty() ? 0 : static_cast<IdxT>(chunkOffsets[k].n_elem)-1;
+            nodeStart[k+1] = nodeStart[k] + nTracks;
+        }
+    } catch(...) {
+        if(!opts.keepFiles) removeChunkFiles();
+        throw;
+    }
+    if(!opts.keepFiles) removeChunkFiles();
+    IdxT nNodes = nodeStart[nChunks];
+    //The chunk track holding each localization in the chunk that owns it
+    IVecT ownerNode(N);
+    ownerNode.fill(-1);
+    for(IdxT k=0; k<nChunks; k++) for(IdxT t=0; t+nodeStart[k]<nodeStart[k+1]; t++)
+        for(IdxT e=chunkOffsets[k](t); e<chunkOffsets[k](t+1); e++) {
+            IdxT loc = chunkTrackLocs[k](e);
+            if(chunkOf(loc)==k) ownerNode(loc) = nodeStart[k]+t;
+        }
+
+    //Count the overlap localizations each chunk track shares with the later chunk tracks owning them
+    std::map<std::pair<IdxT,IdxT>, IdxT> shared; //(node, later node) -> count
+    std::vector<bool> hasCore(nNodes, false);
+    for(IdxT k=0; k<nChunks; k++) for(IdxT t=0; t+nodeStart[k]<nodeStart[k+1]; t++) {
+        IdxT node = nodeStart[k]+t;
+        for(IdxT e=chunkOffsets[k](t); e<chunkOffsets[k](t+1); e++) {
+            IdxT loc = chunkTrackLocs[k](e);
+            if(chunkOf(loc)==k) hasCore[node] = true;
+            else if(ownerNode(loc)>=0) shared[std::make_pair(node, ownerNode(loc))]++;
+        }
+    }
+    //Join mutual best matches.  Ties go to the lower node index.
+    IndexVectorT bestNext(nNodes,-1), bestPrev(nNodes,-1), nextCount(nNodes,0), prevCount(nNodes,0);
+    for(auto &pair: shared) {
+        IdxT a = pair.first.first, b = pair.first.second, count = pair.second;
+        if(!hasCore[a]) continue; //Tracks only in the overlap are replaced by the later chunk's tracks
+        if(count > nextCount[a]) {
+            nextCount[a] = count;
+            bestNext[a] = b;
+        }
+        if(count > prevCount[b]) {
+            prevCount[b] = count;
+            bestPrev[b] = a;
+        }
+    }
+    IdxT nJoins = 0;
+    IndexVectorT successor(nNodes,-1);
+    std::vector<bool> joined(nNodes,false); //Has a joined predecessor
+    for(IdxT a=0; a<nNodes; a++) {
+        IdxT b = bestNext[a];
+        if(b>=0 && bestPrev[b]==a) {
+            successor[a] = b;
+            joined[b] = true;
+            nJoins++;
+        }
+    }
+
+    //Follow each chain of joined chunk tracks to assemble the stitched tracks from their owned localizations
+    TrackVecT tracks;
+    for(IdxT k=0; k<nChunks; k++) for(IdxT t=0; t+nodeStart[k]<nodeStart[k+1]; t++) {
+        IdxT node = nodeStart[k]+t;
+        if(joined[node]) continue; //Part of an earlier chain
+        Tracker::TrackT track;
+        for(IdxT chainNode=node; chainNode>=0; chainNode=successor[chainNode]) {
+            IdxT c = static_cast<IdxT>(std::upper_bound(nodeStart.begin(), nodeStart.end(), chainNode) - nodeStart.begin()) - 1;
+            IdxT ct = chainNode - nodeStart[c];
+            for(IdxT e=chunkOffsets[c](ct); e<chunkOffsets[c](ct+1); e++) {
+                IdxT loc = chunkTrackLocs[c](e);
+                if(chunkOf(loc)==c) track.push_back(loc);
+            }
+        }
+        if(track.empty()) continue;
+        if(minFinalTrackLength>1 && static_cast<IdxT>(track.size())<=minFinalTrackLength) continue;
+        tracks.push_back(std::move(track));
+    }
+    std::stable_sort(tracks.begin(), tracks.end(), [&](const Tracker::TrackT &a, const Tracker::TrackT &b) {
+        return locs.frameIdx(a.front()) < locs.frameIdx(b.front());
+    });
+
+    IdxT nTracks = static_cast<IdxT>(tracks.size());
+    offsets.set_size(nTracks+1);
+    offsets(0) = 0;
+    for(IdxT t=0; t<nTracks; t++) offsets(t+1) = offsets(t) + static_cast<IdxT>(tracks[t].size());
+    trackLocs.set_size(offsets(nTracks));
+    for(IdxT t=0; t<nTracks; t++) std::copy(tracks[t].begin(), tracks[t].end(), trackLocs.begin()+offsets(t));
+
+    stats["nChunks"] = nChunks;
+    stats["chunkOverlapFrames"] = overlap;
+    stats["nChunkTracks"] = nNodes;
+    stats["nStitchedJoins"] = nJoins;
+    stats["nTracks"] = nTracks;
+}
+
+} /* namespace tracker::cli */
+} /* namespace tracker */
@@ -0,0 +1,358 @@
+/** @file TrackerCLI.cpp
+ *  @author Mark J. Olah (mjo at cs.unm.edu)
+ *  @date 2015-2019
+ *  @brief File input and output for the command-line tracker
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <omp.h>
+
+#include "TrackerCLI.h"
+
+namespace tracker {
+namespace cli {
+
+static const char localizationsMagic[8] = {'T','R','K','L','O','C','1','\0'};
+static const char trackOffsetsMagic[8] = {'T','R','K','C','S','R','1','\0'};
+
+/**
+ * Read parameters from a config file.
+ *
+ * Each line is a parameter name followed by one or more numeric values, using the names read by the
+ * LAPTrack constructor.  Values may be separated by whitespace, '=' or ','.  Text after '#' is a comment.
+ *
+ *     D = 0.3
+ *     featureVar = 0.1, 0.2
+ */
+VecParamT readConfigFile(const std::string &filename)
+{
+    std::ifstream in(filename);
+    if(!in) throw ParameterValueError("readConfigFile: unable to open file: "+filename);
+    VecParamT params;
+    std::string line;
+    for(IdxT lineNum=1; std::getline(in, line); lineNum++) {
+        line = line.substr(0, line.find('#'));
+        for(char &c: line) if(c=='=' || c==',') c = ' ';
+        std::istringstream fields(line);
+        std::string name;
+        if(!(fields>>name)) continue; //Blank line
+        std::vector<FloatT> values;
+        std::string token;
+        while(fields>>token) {
+            char *end;
+            FloatT val = std::strtod(token.c_str(), &end);
+            if(end == token.c_str() || *end != '\0') {
+                std::ostringstream msg;
+                msg<<"readConfigFile: "<<filename<<":"<<lineNum<<": parameter "<<name<<" has non-numeric value: "<<token;
+                throw ParameterValueError(msg.str());
+            }
+            values.push_back(val);
+        }
+        if(values.empty()) {
+            std::ostringstream msg;
+            msg<<"readConfigFile: "<<filename<<":"<<lineNum<<": parameter "<<name<<" has no value";
+            throw ParameterValueError(msg.str());
+        }
+        params[name] = Tracker::VecT(values);
+    }
+    return params;
+}
+
+/**
+ * Write parameters in the format read by readConfigFile().  Values are written to full precision.
+ */
+void writeConfigFile(const std::string &filename, const VecParamT &params)
+{
+    std::ofstream out(filename);
+    if(!out) throw ParameterValueError("writeConfigFile: unable to open file: "+filename);
+    char field[32];
+    for(auto &param: params) {
+        out<<param.first<<" =";
+        for(arma::uword n=0; n<param.second.n_elem; n++) {
+            std::snprintf(field, sizeof(field), "%.17g", param.second(n));
+            out<<(n ? ", " : " ")<<field;
+        }
+        out<<"\n";
+    }
+    if(!out) throw ParameterValueError("writeConfigFile: error writing file: "+filename);
+}
+
+/* Read a whole file into buf with a terminating '\0' so the parsers can run off the end of a line safely */
+static void readFile(const std::string &filename, std::vector<char> &buf)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) throw ParameterValueError("readLocalizations: unable to open file: "+filename);
+    in.seekg(0, std::ios::end);
+    size_t size = static_cast<size_t>(in.tellg());
+    in.seekg(0, std::ios::beg);
+    buf.resize(size+1);
+    in.read(buf.data(), size);
+    if(!in) throw ParameterValueError("readLocalizations: error reading file: "+filename);
+    buf[size] = '\0';
+}
+
+template<class T>
+static void writeValue(std::ostream &out, const T &val)
+{
+    out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<class T>
+static void readValue(std::istream &in, T &val)
+{
+    in.read(reinterpret_cast<char*>(&val), sizeof(T));
+}
+
+/* Offset of the start of the line after the one containing pos, or size */
+static inline size_t nextLine(const char *data, size_t pos, size_t size)
+{
+    const char *nl = static_cast<const char*>(std::memchr(data+pos, '\n', size-pos));
+    return nl ? static_cast<size_t>(nl-data)+1 : size;
+}
+
+/* Advance past blanks within a line */
+static inline const char* skipBlanks(const char *p)
+{
+    while(*p==' ' || *p=='\t' || *p=='\r') p++;
+    return p;
+}
+
+/* Advance past a field separator: blanks with at most one ',' or ';' */
+static inline const char* skipSeparator(const char *p)
+{
+    p = skipBlanks(p);
+    if(*p==',' || *p==';') p = skipBlanks(p+1);
+    return p;
+}
+
+/* A line holds data unless it is blank or a '#' comment */
+static inline bool isDataLine(const char *p)
+{
+    p = skipBlanks(p);
+    return *p!='\n' && *p!='\0' && *p!='#';
+}
+
+bool isLocalizationsBinaryFile(const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    char magic[sizeof(localizationsMagic)];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, localizationsMagic, sizeof(magic))==0;
+}
+
+/**
+ * Read localizations from a CSV file.
+ *
+ * Each line is one localization: the frame index, nPositionCols positions, nPositionCols position SEs,
+ * nFeatureCols features, and nFeatureCols feature SEs.  Fields are separated by ',', ';' or blanks.  Blank
+ * lines, '#' comments, and a non-numeric header line are skipped.
+ *
+ * The file is read in one block.  The line starts are found and the lines parsed in parallel directly into
+ * the output matrices, so no per-line or per-field allocation is made.
+ */
+void readLocalizationsCSV(const std::string &filename, IdxT nPositionCols, IdxT nFeatureCols, LocalizationsT &locs)
+{
+    std::vector<char> buf;
+    readFile(filename, buf);
+    const char *data = buf.data();
+    size_t size = buf.size()-1;
+
+    //Skip a header line starting with a non-numeric field
+    size_t begin = 0;
+    while(begin<size && !isDataLine(data+begin)) begin = nextLine(data, begin, size);
+    if(begin<size) {
+        const char *p = skipBlanks(data+begin);
+        char *end;
+        std::strtol(p, &end, 10);
+        if(end == p) begin = nextLine(data, begin, size);
+    }
+
+    //Find the data line starts.  Each chunk takes the lines starting within it.
+    IdxT nChunks = omp_get_max_threads();
+    std::vector<std::vector<size_t>> chunkStarts(nChunks);
+    #pragma omp parallel for schedule(static,1)
+    for(IdxT k=0; k<nChunks; k++) {
+        size_t lo = begin + (size-begin)*k/nChunks;
+        size_t hi = begin + (size-begin)*(k+1)/nChunks;
+        size_t pos = lo;
+        if(pos>begin && data[pos-1]!='\n') pos = nextLine(data, pos, size); //First line starting in this chunk
+        for(; pos<hi; pos = nextLine(data, pos, size)) if(isDataLine(data+pos)) chunkStarts[k].push_back(pos);
+    }
+    std::vector<size_t> lineStarts;
+    for(auto &starts: chunkStarts) lineStarts.insert(lineStarts.end(), starts.begin(), starts.end());
+    chunkStarts.clear();
+
+    IdxT N = static_cast<IdxT>(lineStarts.size());
+    locs.frameIdx.set_size(N);
+    locs.position.set_size(N, nPositionCols);
+    locs.SE_position.set_size(N, nPositionCols);
+    locs.feature.set_size(N, nFeatureCols);
+    locs.SE_feature.set_size(N, nFeatureCols);
+    MatT *cols[4] = {&locs.position, &locs.SE_position, &locs.feature, &locs.SE_feature};
+
+    size_t badLine = size; //Offset of the first line that does not parse
+    #pragma omp parallel for schedule(static)
+    for(IdxT n=0; n<N; n++) {
+        const char *p = skipBlanks(data+lineStarts[n]);
+        char *end;
+        long frame = std::strtol(p, &end, 10);
+        bool ok = end != p;
+        p = skipSeparator(end);
+        locs.frameIdx(n) = static_cast<IdxT>(frame);
+        for(IdxT m=0; m<4 && ok; m++) for(IdxT c=0; c<static_cast<IdxT>(cols[m]->n_cols) && ok; c++) {
+            if(*p=='\n' || *p=='\0') { //strtod would skip ahead to the next line
+                ok = false;
+                break;
+            }
+            (*cols[m])(n,c) = std::strtod(p, &end);
+            ok = end != p;
+            p = skipSeparator(end);
+        }
+        ok = ok && (*p=='\n' || *p=='\0');
+        if(!ok) {
+            #pragma omp critical
+            badLine = std::min(badLine, lineStarts[n]);
+        }
+    }
+    if(badLine < size) {
+        std::ostringstream msg;
+        msg<<"readLocalizationsCSV: "<<filename<<":"<<1+std::count(data, data+badLine, '\n')
+           <<": expected frame index and "<<2*(nPositionCols+nFeatureCols)<<" numeric fields";
+        throw ParameterValueError(msg.str());
+    }
+}
+
+/**
+ * Read localizations from a binary columnar file written by writeLocalizationsBinary().
+ *
+ * The layout is the 8 byte magic "TRKLOC1", uint64 N, uint32 nPositionCols, uint32 nFeatureCols, the
+ * int32 frame indexes, then the position, SE_position, feature, and SE_feature columns as float64 in
+ * column-major order.  The columns are read directly into the output matrices.
+ */
+void readLocalizationsBinary(const std::string &filename, LocalizationsT &locs)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) throw ParameterValueError("readLocalizationsBinary: unable to open file: "+filename);
+    char magic[sizeof(localizationsMagic)];
+    uint64_t N;
+    uint32_t nPositionCols, nFeatureCols;
+    in.read(magic, sizeof(magic));
+    if(!in || std::memcmp(magic, localizationsMagic, sizeof(magic))!=0)
+        throw ParameterValueError("readLocalizationsBinary: not a localizations file: "+filename);
+    readValue(in, N);
+    readValue(in, nPositionCols);
+    readValue(in, nFeatureCols);
+    if(!in) throw ParameterValueError("readLocalizationsBinary: truncated header: "+filename);
+    locs.frameIdx.set_size(N);
+    locs.position.set_size(N, nPositionCols);
+    locs.SE_position.set_size(N, nPositionCols);
+    locs.feature.set_size(N, nFeatureCols);
+    locs.SE_feature.set_size(N, nFeatureCols);
+    arma::Col<int32_t> frames(N); //Frame indexes are int32 on disk regardless of IdxT
+    in.read(reinterpret_cast<char*>(frames.memptr()), N*sizeof(int32_t));
+    locs.frameIdx = arma::conv_to<IVecT>::from(frames);
+    for(MatT *m: {&locs.position, &locs.SE_position, &locs.feature, &locs.SE_feature})
+        in.read(reinterpret_cast<char*>(m->memptr()), m->n_elem*sizeof(FloatT));
+    if(!in) throw ParameterValueError("readLocalizationsBinary: truncated data: "+filename);
+}
+
+void writeLocalizationsBinary(const std::string &filename, const LocalizationsT &locs)
+{
+    std::ofstream out(filename, std::ios::binary);
+    if(!out) throw ParameterValueError("writeLocalizationsBinary: unable to open file: "+filename);
+    out.write(localizationsMagic, sizeof(localizationsMagic));
+    writeValue(out, static_cast<uint64_t>(locs.frameIdx.n_elem));
+    writeValue(out, static_cast<uint32_t>(locs.position.n_cols));
+    writeValue(out, static_cast<uint32_t>(locs.feature.n_cols));
+    if(!locs.frameIdx.is_empty()) checkedIndex<int32_t>(locs.frameIdx.max(), "writeLocalizationsBinary: frame index");
+    arma::Col<int32_t> frames = arma::conv_to<arma::Col<int32_t>>::from(locs.frameIdx);
+    out.write(reinterpret_cast<const char*>(frames.memptr()), frames.n_elem*sizeof(int32_t));
+    for(const MatT *m: {&locs.position, &locs.SE_position, &locs.feature, &locs.SE_feature})
+        out.write(reinterpret_cast<const char*>(m->memptr()), m->n_elem*sizeof(FloatT));
+    if(!out) throw ParameterValueError("writeLocalizationsBinary: error writing file: "+filename);
+}
+
+/**
+ * Write the track id of each localization as text, one per line in input order.  Untracked
+ * localizations are -1.
+ */
+void writeTrackIds(const std::string &filename, const IVecT &ids)
+{
+    std::ofstream out(filename);
+    if(!out) throw ParameterValueError("writeTrackIds: unable to open file: "+filename);
+    std::string text;
+    text.reserve(ids.n_elem*8);
+    char field[24];
+    for(IdxT id: ids) {
+        int len = std::snprintf(field, sizeof(field), "%lld\n", static_cast<long long>(id));
+        text.append(field, len);
+    }
+    out.write(text.data(), text.size());
+    if(!out) throw ParameterValueError("writeTrackIds: error writing file: "+filename);
+}
+
+/**
+ * Write the tracks in binary compressed sparse row form from Tracker::getTrackOffsets().
+ *
+ * The layout is the 8 byte magic "TRKCSR1", uint64 nTracks, uint64 nLocs, uint32 index size in bytes,
+ * then the (nTracks+1) offsets and the nLocs localization indexes as signed integers of that size.  The
+ * index size is 4, or 8 when built with OPT_INDEX64.
+ */
+void writeTrackOffsets(const std::string &filename, const IVecT &offsets, const IVecT &locs)
+{
+    std::ofstream out(filename, std::ios::binary);
+    if(!out) throw ParameterValueError("writeTrackOffsets: unable to open file: "+filename);
+    out.write(trackOffsetsMagic, sizeof(trackOffsetsMagic));
+    writeValue(out, static_cast<uint64_t>(offsets.n_elem-1));
+    writeValue(out, static_cast<uint64_t>(locs.n_elem));
+    writeValue(out, static_cast<uint32_t>(sizeof(IdxT)));
+    out.write(reinterpret_cast<const char*>(offsets.memptr()), offsets.n_elem*sizeof(IdxT));
+    out.write(reinterpret_cast<const char*>(locs.memptr()), locs.n_elem*sizeof(IdxT));
+    if(!out) throw ParameterValueError("writeTrackOffsets: error writing file: "+filename);
+}
+
+/**
+ * Read tracks written by writeTrackOffsets().  Files with either index size are accepted.
+ */
+void readTrackOffsets(const std::string &filename, IVecT &offsets, IVecT &locs)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if(!in) throw ParameterValueError("readTrackOffsets: unable to open file: "+filename);
+    char magic[sizeof(trackOffsetsMagic)];
+    uint64_t nTracks, nLocs;
+    uint32_t indexSize;
+    in.read(magic, sizeof(magic));
+    if(!in || std::memcmp(magic, trackOffsetsMagic, sizeof(magic))!=0)
+        throw ParameterValueError("readTrackOffsets: not a track offsets file: "+filename);
+    readValue(in, nTracks);
+    readValue(in, nLocs);
+    readValue(in, indexSize);
+    if(!in) throw ParameterValueError("readTrackOffsets: truncated header: "+filename);
+    auto readIndexes = [&](uint64_t n, IVecT &out) {
+        if(indexSize==sizeof(int32_t)) {
+            arma::Col<int32_t> vals(n);
+            in.read(reinterpret_cast<char*>(vals.memptr()), n*sizeof(int32_t));
+            out = arma::conv_to<IVecT>::from(vals);
+        } else if(indexSize==sizeof(int64_t)) {
+            arma::Col<int64_t> vals(n);
+            in.read(reinterpret_cast<char*>(vals.memptr()), n*sizeof(int64_t));
+            if(sizeof(IdxT)<sizeof(int64_t) && n>0) checkedIndex<IdxT>(vals.max(), "readTrackOffsets: index");
+            out = arma::conv_to<IVecT>::from(vals);
+        } else {
+            std::ostringstream msg;
+            msg<<"readTrackOffsets: unsupported index size: "<<indexSize<<" in "<<filename;
+            throw ParameterValueError(msg.str());
+        }
+    };
+    readIndexes(nTracks+1, offsets);
+    readIndexes(nLocs, locs);
+    if(!in) throw ParameterValueError("readTrackOffsets: truncated data: "+filename);
+}
+
+} /* namespace tracker::cli */
+} /* namespace tracker */
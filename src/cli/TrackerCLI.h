@@ -0,0 +1,66 @@
+/** @file TrackerCLI.h
+ * @author Mark J. Olah (mjo\@cs.unm.edu)
+ * @date 2015-2019
+ * @brief File input and output for the command-line tracker
+ *
+ * Localizations are read from a CSV file or a binary columnar file into the layout taken by
+ * Tracker::initializeTracks().  Parameters are read from a config file using the same names as the
+ * LAPTrack constructor.  Long movies can be tracked in temporal chunks by worker processes with
+ * trackChunked().
+ */
+#ifndef TRACKER_TRACKERCLI_H
+#define TRACKER_TRACKERCLI_H
+
+#include <string>
+
+#include "Tracker/Tracker.h"
+
+namespace tracker {
+namespace cli {
+
+using FloatT = Tracker::FloatT;
+using IdxT = Tracker::IdxT;
+using IVecT = Tracker::IVecT;
+using MatT = Tracker::MatT;
+using VecParamT = Tracker::VecParamT;
+using IndexVectorT = Tracker::IndexVectorT;
+using TrackVecT = Tracker::TrackVecT;
+
+/** Localizations in the layout passed to Tracker::initializeTracks() */
+struct LocalizationsT {
+    IVecT frameIdx; // N
+    MatT position; // N x nPositionCols
+    MatT SE_position; // N x nPositionCols
+    MatT feature; // N x nFeatureCols
+    MatT SE_feature; // N x nFeatureCols
+};
+
+/** Options for trackChunked() */
+struct ChunkOptionsT {
+    IdxT nChunks = 1; //Number of temporal chunks
+    IdxT nWorkers = 1; //Maximum number of worker processes running at once
+    IdxT nWorkerThreads = 0; //Threads for each worker.  0 uses the OpenMP default.
+    std::string workDir; //Directory for the chunk input and output files
+    std::string executable; //Path of the tracker executable run as the workers
+    bool keepFiles = false; //Keep the chunk files after stitching
+};
+
+VecParamT readConfigFile(const std::string &filename);
+void writeConfigFile(const std::string &filename, const VecParamT &params);
+
+bool isLocalizationsBinaryFile(const std::string &filename);
+void readLocalizationsCSV(const std::string &filename, IdxT nPositionCols, IdxT nFeatureCols, LocalizationsT &locs);
+void readLocalizationsBinary(const std::string &filename, LocalizationsT &locs);
+void writeLocalizationsBinary(const std::string &filename, const LocalizationsT &locs);
+
+void writeTrackIds(const std::string &filename, const IVecT &ids);
+void writeTrackOffsets(const std::string &filename, const IVecT &offsets, const IVecT &locs);
+void readTrackOffsets(const std::string &filename, IVecT &offsets, IVecT &locs);
+
+void trackChunked(const LocalizationsT &locs, const VecParamT &params, const ChunkOptionsT &opts,
+                  IVecT &offsets, IVecT &trackLocs, VecParamT &stats);
+
+} /* namespace tracker::cli */
+} /* namespace tracker */
+
+#endif /* TRACKER_TRACKERCLI_H */
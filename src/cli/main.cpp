@@ -0,0 +1,170 @@
+/** @file main.cpp
+ *  @author Mark J. Olah (mjo at cs.unm.edu)
+ *  @date 2015-2019
+ *  @brief Command-line LAPTrack tracker for batch pipelines
+ *
+ * Usage: tracker [options] <localizations> <output>
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <omp.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "Tracker/LAPTrack.h"
+#include "TrackerCLI.h"
+
+using namespace tracker;
+using namespace tracker::cli;
+
+static void printUsage(std::ostream &out)
+{
+    out<<"Usage: tracker [options] <localizations> <output>\n"
+       <<"\n"
+       <<"Track localizations from a CSV or binary localizations file with LAPTrack.\n"
+       <<"\n"
+       <<"Options:\n"
+       <<"  -c, --config FILE          Parameters, one 'name = values' per line with the LAPTrack names.\n"
+       <<"                             D, kon, koff, and rho are required.\n"
+       <<"  -t, --threads N            Number of threads, for each worker with --chunks.  Default: the OpenMP default.\n"
+       <<"  -p, --position-cols K      CSV position columns.  Default: 2.\n"
+       <<"  -f, --feature-cols F       CSV feature columns.  Default: 0.\n"
+       <<"  -o, --format ids|csr       Output the track id of each localization as text lines (ids),\n"
+       <<"                             or binary track offsets and localizations (csr).  Default: ids.\n"
+       <<"  -b, --write-binary FILE    Also write the localizations in the binary format for faster reloading.\n"
+       <<"  -s, --stats                Print the tracker statistics to stderr.\n"
+       <<"  -k, --chunks K             Track K overlapping temporal chunks in separate worker processes and\n"
+       <<"                             stitch the chunk tracks.  The overlap is maxGapCloseFrames, and K is\n"
+       <<"                             limited to one chunk per maxGapCloseFrames frames.  Default: 1.\n"
+       <<"  -w, --workers N            Worker processes run at once with --chunks.  Default: 1.\n"
+       <<"      --work-dir DIR         Directory for the chunk files.  Default: <output>.chunks\n"
+       <<"      --keep-chunks          Keep the chunk files after stitching.\n"
+       <<"  -h, --help                 Print this message.\n"
+       <<"\n"
+       <<"CSV lines are: frame, K positions, K position SEs, F features, F feature SEs.\n"
+       <<"Binary localization files are recognized by their header.\n";
+}
+
+/* The path of the running executable, for starting the chunk workers */
+static std::string selfExecutable(const char *argv0)
+{
+#ifdef __linux__
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path)-1);
+    if(len > 0) return std::string(path, len);
+#endif
+    return argv0;
+}
+
+static IdxT parseCount(const std::string &option, const char *value)
+{
+    char *end;
+    long count = std::strtol(value, &end, 10);
+    if(end == value || *end != '\0' || count < 0) throw ParameterValueError("Bad count for "+option+": "+value);
+    return static_cast<IdxT>(count);
+}
+
+int main(int argc, char **argv)
+{
+    std::string configFile, binaryFile, format = "ids";
+    IdxT nThreads = 0, nPositionCols = 2, nFeatureCols = 0;
+    bool printStats = false;
+    ChunkOptionsT chunkOpts;
+    chunkOpts.executable = selfExecutable(argv[0]);
+    std::vector<std::string> files;
+    try {
+        for(int i=1; i<argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() -> const char* {
+                if(i+1 >= argc) throw ParameterValueError("Missing value for "+arg);
+                return argv[++i];
+            };
+            if(arg=="-h" || arg=="--help") {
+                printUsage(std::cout);
+                return 0;
+            } else if(arg=="-c" || arg=="--config") {
+                configFile = value();
+            } else if(arg=="-t" || arg=="--threads") {
+                nThreads = parseCount(arg, value());
+            } else if(arg=="-p" || arg=="--position-cols") {
+                nPositionCols = parseCount(arg, value());
+            } else if(arg=="-f" || arg=="--feature-cols") {
+                nFeatureCols = parseCount(arg, value());
+            } else if(arg=="-o" || arg=="--format") {
+                format = value();
+                if(format!="ids" && format!="csr") throw ParameterValueError("Unknown format: "+format);
+            } else if(arg=="-b" || arg=="--write-binary") {
+                binaryFile = value();
+            } else if(arg=="-s" || arg=="--stats") {
+                printStats = true;
+            } else if(arg=="-k" || arg=="--chunks") {
+                chunkOpts.nChunks = parseCount(arg, value());
+            } else if(arg=="-w" || arg=="--workers") {
+                chunkOpts.nWorkers = parseCount(arg, value());
+            } else if(arg=="--work-dir") {
+                chunkOpts.workDir = value();
+            } else if(arg=="--keep-chunks") {
+                chunkOpts.keepFiles = true;
+            } else if(arg.size()>1 && arg[0]=='-') {
+                throw ParameterValueError("Unknown option: "+arg);
+            } else {
+                files.push_back(arg);
+            }
+        }
+        if(files.size() != 2) {
+            printUsage(std::cerr);
+            return 2;
+        }
+        if(nThreads > 0 && chunkOpts.nChunks <= 1) omp_set_num_threads(nThreads);
+
+        Tracker::VecParamT params;
+        if(!configFile.empty()) params = readConfigFile(configFile);
+        for(const char *name: {"D", "kon", "koff", "rho"})
+            if(params.find(name) == params.end()) throw ParameterValueError(std::string("Missing required parameter: ")+name);
+
+        LocalizationsT locs;
+        if(isLocalizationsBinaryFile(files[0])) readLocalizationsBinary(files[0], locs);
+        else readLocalizationsCSV(files[0], nPositionCols, nFeatureCols, locs);
+        if(!binaryFile.empty()) writeLocalizationsBinary(binaryFile, locs);
+
+        if(chunkOpts.nChunks > 1) {
+            chunkOpts.nWorkerThreads = nThreads;
+            if(chunkOpts.workDir.empty()) chunkOpts.workDir = files[1]+".chunks";
+            Tracker::IVecT offsets, trackLocs;
+            VecParamT stats;
+            trackChunked(locs, params, chunkOpts, offsets, trackLocs, stats);
+            if(format=="ids") {
+                Tracker::IVecT ids(locs.frameIdx.n_elem);
+                ids.fill(-1);
+                for(IdxT t=0; t+1<static_cast<IdxT>(offsets.n_elem); t++)
+                    for(IdxT e=offsets(t); e<offsets(t+1); e++) ids(trackLocs(e)) = t;
+                writeTrackIds(files[1], ids);
+            } else {
+                writeTrackOffsets(files[1], offsets, trackLocs);
+            }
+            if(printStats) for(auto &stat: stats) std::cerr<<stat.first<<": "<<stat.second.t();
+            return 0;
+        }
+
+        LAPTrack tracker(params);
+        if(locs.feature.is_empty()) tracker.initializeTracks(locs.frameIdx, locs.position, locs.SE_position);
+        else tracker.initializeTracks(locs.frameIdx, locs.position, locs.SE_position, locs.feature, locs.SE_feature);
+        tracker.generateTracks();
+
+        if(format=="ids") {
+            writeTrackIds(files[1], tracker.getTrackIds());
+        } else {
+            Tracker::IVecT offsets, trackLocs;
+            tracker.getTrackOffsets(offsets, trackLocs);
+            writeTrackOffsets(files[1], offsets, trackLocs);
+        }
+        if(printStats) for(auto &stat: tracker.getStats()) std::cerr<<stat.first<<": "<<stat.second.t();
+    } catch(std::exception &e) {
+        std::cerr<<"tracker: "<<e.what()<<"\n";
+        return 1;
+    }
+    return 0;
+}
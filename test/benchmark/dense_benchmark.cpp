@@ -0,0 +1,67 @@
+/** @file dense_benchmark.cpp
+ *  @author Mark J. Olah (mjo at cs.unm.edu)
+ *  @date 2015-2019
+ *  @brief Timings of the dense and sparse padded LAP kernels for choosing denseLinkMaxSize
+ *
+ * Usage: benchTrackerDenseSolver [reps]
+ *
+ * Random F2F-like problems of padded size n = nR+nC are solved with LAP_JVSparse::solvePadded() and
+ * LAP_JVSparse::solvePaddedDense().  The sparse time includes building the sparse matrix, as linkFrames() must.
+ * The suggested denseLinkMaxSize is the largest n for which the dense kernel is faster at every size up to n.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <armadillo>
+#include "Tracker/LAP_JVSparse.h"
+
+using namespace arma;
+using namespace tracker;
+
+int main(int argc, char **argv)
+{
+    int reps = argc>1 ? std::atoi(argv[1]) : 2000;
+    if(reps<1) {
+        std::cerr<<"Usage: "<<argv[0]<<" [reps]\n";
+        return EXIT_FAILURE;
+    }
+    arma_rng::set_seed(0);
+    int crossover = 0;
+    bool denseFaster = true;
+    for(int n=2; n<=LAP_JVSparse<double>::MaxDenseSize; n+=2) {
+        int nR = n/2, nC = n-nR;
+        double sparseTime = 0, denseTime = 0;
+        for(int rep=0; rep<reps; rep++) {
+            std::vector<IndexT> rows, cols;
+            std::vector<double> costs;
+            for(int j=0; j<nC; j++) for(int i=0; i<nR; i++) if(i==j || randu()<4.0/nR) {
+                rows.push_back(i);
+                cols.push_back(j);
+                costs.push_back(0.01+8*randu());
+            }
+            vec rowUnassigned = randu<vec>(nR)+1;
+            vec colUnassigned = randu<vec>(nC)+1;
+            auto t0 = std::chrono::steady_clock::now();
+            umat locations(2, costs.size());
+            for(uword e=0; e<costs.size(); e++) {
+                locations(0,e) = rows[e];
+                locations(1,e) = cols[e];
+            }
+            sp_mat C(locations, vec(costs), nR, nC);
+            auto sparse = LAP_JVSparse<double>::solvePadded(C, rowUnassigned, colUnassigned, 1e-9);
+            auto t1 = std::chrono::steady_clock::now();
+            auto dense = LAP_JVSparse<double>::solvePaddedDense(nR, nC, rows, cols, costs, rowUnassigned, colUnassigned, 1e-9);
+            auto t2 = std::chrono::steady_clock::now();
+            sparseTime += std::chrono::duration<double,std::micro>(t1-t0).count();
+            denseTime += std::chrono::duration<double,std::micro>(t2-t1).count();
+            if(sparse(0)!=dense(0)) std::cerr<<"Warning: kernels disagree at n: "<<n<<"\n"; //Keeps both results live
+        }
+        denseFaster = denseFaster && denseTime < sparseTime;
+        if(denseFaster) crossover = n;
+        std::cout<<"n: "<<n<<" sparse us: "<<sparseTime/reps<<" dense us: "<<denseTime/reps<<"\n";
+    }
+    std::cout<<"Suggested denseLinkMaxSize: "<<crossover<<"\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include<algorithm>
+#include<cmath>
+#include<cstdio>
+#include<fstream>
+
+#include<iostream>
+#include<armadillo>
+#include "Tracker/LAPTrack.h"
+#include "TrackerCLI.h"
+
+using namespace arma;
+using namespace std;
+using namespace tracker;
+using namespace tracker::cli;
+
+/* Two particles that swap x each frame, separated in y.  Linking on x alone would swap them every frame. */
+void makeSwapData(int nFrames, LocalizationsT &locs)
+{
+    int N = 2*nFrames;
+    locs.frameIdx.set_size(N);
+    locs.position.set_size(N,2);
+    locs.SE_position.set_size(N,2);
+    locs.SE_position.fill(0.01);
+    for(int f=0; f<nFrames; f++) for(int p=0; p<2; p++) {
+        int n = 2*f+p;
+        locs.frameIdx(n) = f;
+        locs.position(n,0) = (f+p)%2;
+        locs.position(n,1) = 10*p;
+    }
+    locs.feature.set_size(N,0);
+    locs.SE_feature.set_size(N,0);
+}
+
+/* Each track must be one particle: a single y value over every frame */
+bool checkSwapTracks(const Tracker::TrackVecT &tracks, const LocalizationsT &locs, int nFrames)
+{
+    bool ok = tracks.size()==2;
+    for(auto &track: tracks) {
+        ok = ok && static_cast<int>(track.size())==nFrames;
+        for(IndexT loc: track) ok = ok && locs.position(loc,1)==locs.position(track.front(),1);
+    }
+    return ok;
+}
+
+Tracker::VecParamT cliParams()
+{
+    Tracker::VecParamT params;
+    params["D"]=1;
+    params["kon"]=0.1;
+    params["koff"]=0.1;
+    params["rho"]=0.02;
+    params["maxSpeed"] = -1;
+    params["maxPositionDisplacementSigma"] = 5;
+    params["maxGapCloseFrames"] = 3;
+    return params;
+}
+
+/* An x,y CSV must round trip through the binary format and be tracked in both dimensions */
+bool testCSVRoundTrip()
+{
+    int nFrames = 10;
+    LocalizationsT expected;
+    makeSwapData(nFrames, expected);
+    const char *csvFile = "cli_test_locs.csv", *binFile = "cli_test_locs.bin";
+    {
+        std::ofstream out(csvFile);
+        out<<"frame,x,y,SEx,SEy\n";
+        for(uword n=0; n<expected.frameIdx.n_elem; n++)
+            out<<expected.frameIdx(n)<<","<<expected.position(n,0)<<","<<expected.position(n,1)<<","
+               <<expected.SE_position(n,0)<<","<<expected.SE_position(n,1)<<"\n";
+    }
+    LocalizationsT csv, bin;
+    readLocalizationsCSV(csvFile, 2, 0, csv);
+    writeLocalizationsBinary(binFile, csv);
+    bool isBinary = isLocalizationsBinaryFile(binFile) && !isLocalizationsBinaryFile(csvFile);
+    readLocalizationsBinary(binFile, bin);
+    std::remove(csvFile);
+    std::remove(binFile);
+    bool ok = isBinary && all(csv.frameIdx==expected.frameIdx) && approx_equal(csv.position, expected.position, "absdiff", 1e-12)
+              && approx_equal(csv.SE_position, expected.SE_position, "absdiff", 1e-12) && csv.feature.n_cols==0;
+    ok = ok && all(bin.frameIdx==csv.frameIdx) && all(all(bin.position==csv.position))
+            && all(all(bin.SE_position==csv.SE_position)) && bin.feature.n_cols==0 && bin.feature.n_rows==csv.feature.n_rows;
+
+    LAPTrack tracker(cliParams());
+    tracker.initializeTracks(bin.frameIdx, bin.position, bin.SE_position, bin.feature, bin.SE_feature);
+    tracker.generateTracks();
+    std::cout<<"CSVRoundTrip: nDims: "<<tracker.getStats()["nDims"](0)<<" nTracks: "<<tracker.tracks.size()<<"\n";
+    return ok && tracker.getStats()["nDims"](0)==2 && checkSwapTracks(tracker.tracks, bin, nFrames);
+}
+
+/* Particles far apart in x, each drifting in y over every frame, with a few missed localizations */
+void makeSeparatedData(int nFrames, int nParticles, LocalizationsT &locs)
+{
+    Tracker::IndexVectorT frames;
+    std::vector<double> xs, ys;
+    for(int f=0; f<nFrames; f++) for(int p=0; p<nParticles; p++) {
+        if((f+3*p)%11 == 5) continue; //A one frame gap for gap closing
+        frames.push_back(f);
+        xs.push_back(100*p + 0.2*std::sin(0.7*f+p));
+        ys.push_back(0.1*f + 0.2*std::cos(0.5*f+p));
+    }
+    uword N = frames.size();
+    locs.frameIdx = Tracker::IVecT(frames);
+    locs.position.set_size(N,2);
+    locs.position.col(0) = vec(xs);
+    locs.position.col(1) = vec(ys);
+    locs.SE_position.set_size(N,2);
+    locs.SE_position.fill(0.01);
+    locs.feature.set_size(N,0);
+    locs.SE_feature.set_size(N,0);
+}
+
+/* The tracks as sorted localization lists in sorted order, to compare track sets */
+Tracker::TrackVecT sortedTracks(Tracker::TrackVecT tracks)
+{
+    for(auto &track: tracks) track.sort();
+    std::sort(tracks.begin(), tracks.end());
+    return tracks;
+}
+
+Tracker::TrackVecT offsetTracks(const Tracker::IVecT &offsets, const Tracker::IVecT &trackLocs)
+{
+    Tracker::TrackVecT tracks;
+    for(uword t=0; t+1<offsets.n_elem; t++) tracks.emplace_back(trackLocs.begin()+offsets(t), trackLocs.begin()+offsets(t+1));
+    return tracks;
+}
+
+Tracker::TrackVecT directTracks(const LocalizationsT &locs, const Tracker::VecParamT &params)
+{
+    LAPTrack tracker(params);
+    tracker.initializeTracks(locs.frameIdx, locs.position, locs.SE_position);
+    tracker.generateTracks();
+    return sortedTracks(tracker.tracks);
+}
+
+/* Chunked tracking with the given number of chunks must give the same tracks as a direct run.
+ * nChunks is limited to one chunk per maxGapCloseFrames frames. */
+bool testChunked(const std::string &executable, IndexT nChunks)
+{
+    int nFrames = 60;
+    LocalizationsT locs;
+    makeSeparatedData(nFrames, 4, locs);
+    auto params = cliParams();
+    IndexT expectedChunks = std::min(nChunks, static_cast<IndexT>(nFrames/params["maxGapCloseFrames"](0)));
+    ChunkOptionsT opts;
+    opts.nChunks = nChunks;
+    opts.nWorkers = 2;
+    opts.executable = executable;
+    opts.workDir = "cli_test_chunks";
+    Tracker::IVecT offsets, trackLocs;
+    Tracker::VecParamT stats;
+    trackChunked(locs, params, opts, offsets, trackLocs, stats);
+    auto chunked = sortedTracks(offsetTracks(offsets, trackLocs));
+    auto direct = directTracks(locs, params);
+    bool removed = !std::ifstream(opts.workDir+"/worker.cfg") && !std::ifstream(opts.workDir+"/chunk0.bin");
+    std::cout<<"Chunked: nChunks: "<<stats["nChunks"](0)<<" direct nTracks: "<<direct.size()<<" chunked nTracks: "<<chunked.size()
+             <<" joins: "<<stats["nStitchedJoins"](0)<<(removed ? "" : " FILES LEFT")<<"\n";
+    return chunked == direct && direct.size() == 4 && removed && stats["nChunks"](0) == expectedChunks;
+}
+
+/* A failed worker must not leave the chunk files behind */
+bool testChunkedFailure()
+{
+    LocalizationsT locs;
+    makeSeparatedData(20, 2, locs);
+    ChunkOptionsT opts;
+    opts.nChunks = 2;
+    opts.executable = "cli_test_missing_tracker";
+    opts.workDir = "cli_test_failed_chunks";
+    Tracker::IVecT offsets, trackLocs;
+    Tracker::VecParamT stats;
+    bool threw = false;
+    try {
+        trackChunked(locs, cliParams(), opts, offsets, trackLocs, stats);
+    } catch(ParameterValueError &) {
+        threw = true;
+    }
+    bool removed = !std::ifstream(opts.workDir+"/worker.cfg") && !std::ifstream(opts.workDir+"/chunk0.bin")
+                   && !std::ifstream(opts.workDir+"/chunk1.bin");
+    std::cout<<"ChunkedFailure: "<<(threw ? "threw" : "DID NOT THROW")<<(removed ? "" : " FILES LEFT")<<"\n";
+    return threw && removed;
+}
+
+int main(int argc, char **argv)
+{
+    cout<<" =========== CSV ROUND TRIP ====================\n";
+    bool ok = testCSVRoundTrip();
+    if(argc < 2) {
+        std::cerr<<"Usage: "<<argv[0]<<" <tracker executable>\n";
+        return 1;
+    }
+#ifndef _WIN32
+    cout<<" =========== CHUNKED ====================\n";
+    ok = testChunked(argv[1], 1) && ok;
+    ok = testChunked(argv[1], 3) && ok;
+    ok = testChunked(argv[1], 100) && ok; //More chunks than fit the overlap
+    cout<<" =========== CHUNKED FAILURE ====================\n";
+    ok = testChunkedFailure() && ok;
+#endif
+    return ok ? 0 : 1;
+}
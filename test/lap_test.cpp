@@ -1,8 +1,16 @@
+#include<algorithm>
+#include<cmath>
+#include<cstdio>
+#include<cstring>
+#include<fstream>
 
 #include<iostream>
+#include<thread>
 #include<armadillo>
+#include<omp.h>
 #include "Tracker/LAPTrack.h"
 #include "Tracker/LAP_JVSparse.h"
+#include "Tracker/LAPTrackCostPolicy.h"
 
 using namespace arma;
 using namespace std;
@@ -72,11 +80,674 @@ void testTracking()
 // //     tracker.getTracks();
 }
 
+/* The implicitly padded rectangular solve must match the explicitly padded square solve */
+bool testSolvePadded()
+{
+    bool ok = true;
+    for(int trial=0; trial<20; trial++) {
+        uword nR = 1+trial%7, nC = 1+(3*trial)%5;
+        sp_mat C = sprandu<sp_mat>(nR, nC, 0.4);
+        vec rowUnassigned = randu<vec>(nR)+1;
+        vec colUnassigned = randu<vec>(nC)+1;
+        double dummy = 1e-9;
+        sp_mat P(nR+nC, nR+nC);
+        P.submat(0, 0, nR-1, nC-1) = C;
+        for(uword i=0; i<nR; i++) P(i, nC+i) = rowUnassigned(i);
+        for(uword j=0; j<nC; j++) P(nR+j, j) = colUnassigned(j);
+        for(auto it=C.begin(); it!=C.end(); ++it) P(nR+it.col(), nC+it.row()) = dummy;
+        auto padded = LAP_JVSparse<double>::solve(P);
+        auto implicit = LAP_JVSparse<double>::solvePadded(C, rowUnassigned, colUnassigned, dummy);
+        ok = ok && all(padded == implicit);
+    }
+    std::cout<<"SolvePadded: "<<(ok ? "match" : "MISMATCH")<<"\n";
+    return ok;
+}
+
+/* The heap augmentation used on large problems must give the same solution and duals as the plain scans */
+bool testSparseAugment()
+{
+    bool ok = true;
+    for(int trial=0; trial<5; trial++) {
+        uword n = 300+100*trial;
+        sp_mat C = sprandu<sp_mat>(n, n, 8.0/n);
+        for(uword i=0; i<n; i++) C(i,i) = 10+randu(); //Always feasible
+        C.sync();
+        Tracker::IVecT xHeap, yHeap, xScan, yScan;
+        vec uHeap, vHeap, uScan, vScan;
+        LAP_JVSparse<double>::solveLAP_orig(C, xHeap, yHeap, uHeap, vHeap);
+        LAP_JVSparse<double>::solveLAP_orig(C, xScan, yScan, uScan, vScan, static_cast<IndexT>(n+1));
+        ok = ok && all(xHeap == xScan) && all(yHeap == yScan);
+        ok = ok && approx_equal(uHeap, uScan, "absdiff", 1e-9) && approx_equal(vHeap, vScan, "absdiff", 1e-9);
+    }
+    std::cout<<"SparseAugment: "<<(ok ? "match" : "MISMATCH")<<"\n";
+    return ok;
+}
+
+/* The dense kernel must match the sparse solve.  The timings are in benchmark/dense_benchmark.cpp. */
+bool testDenseSolver()
+{
+    bool ok = true;
+    for(int n=4; n<=LAP_JVSparse<double>::MaxDenseSize; n+=4) {
+        int nR = n/2, nC = n-nR;
+        for(int rep=0; rep<20; rep++) {
+            std::vector<IndexT> rows, cols;
+            std::vector<double> costs;
+            for(int j=0; j<nC; j++) for(int i=0; i<nR; i++) if(i==j || randu()<4.0/nR) {
+                rows.push_back(i);
+                cols.push_back(j);
+                costs.push_back(0.01+8*randu());
+            }
+            vec rowUnassigned = randu<vec>(nR)+1;
+            vec colUnassigned = randu<vec>(nC)+1;
+            umat locations(2, costs.size());
+            for(uword e=0; e<costs.size(); e++) {
+                locations(0,e) = rows[e];
+                locations(1,e) = cols[e];
+            }
+            sp_mat C(locations, vec(costs), nR, nC);
+            auto sparse = LAP_JVSparse<double>::solvePadded(C, rowUnassigned, colUnassigned, 1e-9);
+            auto dense = LAP_JVSparse<double>::solvePaddedDense(nR, nC, rows, cols, costs, rowUnassigned, colUnassigned, 1e-9);
+            for(int i=0; i<nR; i++) ok = ok && sparse(i)==dense(i);
+            for(int j=0; j<nC; j++) ok = ok && (sparse(nR+j)==j) == (dense(nR+j)==j);
+        }
+    }
+    std::cout<<"DenseSolver: "<<(ok ? "match" : "MISMATCH")<<"\n";
+    return ok;
+}
+
+Tracker::VecParamT testParams()
+{
+    Tracker::VecParamT params;
+    params["D"]=0.3;
+    params["kon"]=0.1;
+    params["koff"]=0.1;
+    params["rho"]=0.02;
+    params["maxSpeed"] = -1;
+    params["maxPositionDisplacementSigma"] = 5;
+    params["maxGapCloseFrames"] = 5;
+    return params;
+}
+
+/* Random localizations in nFrames frames with a few localizations per frame */
+void makeTestData(int nFrames, int nPerFrame, Tracker::IVecT &frameIdx, mat &position, mat &SE_position)
+{
+    int N = nFrames*nPerFrame;
+    frameIdx.set_size(N);
+    for(int n=0; n<N; n++) frameIdx(n) = n/nPerFrame;
+    position = randu<mat>(N,2)*10;
+    SE_position = randu<mat>(N,2)*0.05;
+}
+
+bool testGapCloseModes()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(60, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack global(params);
+    global.initializeTracks(frameIdx, position, SE_position);
+    global.generateTracks();
+    params["gapCloseBlockExact"] = 1;
+    LAPTrack exact(params);
+    exact.initializeTracks(frameIdx, position, SE_position);
+    exact.generateTracks();
+    params["gapCloseBlockExact"] = 0;
+    params["gapCloseBlockFrames"] = 10;
+    LAPTrack blocked(params);
+    blocked.initializeTracks(frameIdx, position, SE_position);
+    blocked.generateTracks();
+    params["gapCloseBlockFrames"] = 0;
+    params["gapCloseImplicit"] = 1;
+    params["gapCloseRowCacheBytes"] = 1024;
+    LAPTrack implicit(params);
+    implicit.initializeTracks(frameIdx, position, SE_position);
+    implicit.generateTracks();
+    params["gapCloseImplicit"] = 0;
+    params["gapCloseMemoryBudget"] = 256; //Small enough to spill several runs
+    LAPTrack budgeted(params);
+    budgeted.initializeTracks(frameIdx, position, SE_position);
+    budgeted.generateTracks();
+    std::cout<<"GapCloseModes: global nTracks: "<<global.tracks.size()<<" exact nTracks: "<<exact.tracks.size()
+             <<" blocked nTracks: "<<blocked.tracks.size()<<" implicit nTracks: "<<implicit.tracks.size()
+             <<" budgeted nTracks: "<<budgeted.tracks.size()<<" spill runs: "<<budgeted.getStats()["nGapCloseSpillRuns"]<<"\n";
+    return global.tracks == exact.tracks && global.tracks == implicit.tracks && global.tracks == budgeted.tracks;
+}
+
+/* Two particles moving 3 per frame in opposite directions, passing each other.  BROWNIAN gating with the
+ * same maxPositionDisplacementSigma rejects every step, while CONSTANT_VELOCITY predicts the next positions. */
+bool testConstantVelocity()
+{
+    int nFrames = 20;
+    Tracker::IVecT frameIdx(2*nFrames);
+    mat position(2*nFrames, 2, fill::zeros);
+    mat SE_position(2*nFrames, 2);
+    SE_position.fill(0.01);
+    for(int f=0; f<nFrames; f++) {
+        frameIdx(2*f) = frameIdx(2*f+1) = f;
+        position(2*f,0) = 3*f;
+        position(2*f+1,0) = 3*(nFrames-f);
+        position(2*f+1,1) = 5;
+    }
+    auto params = testParams();
+    params["D"] = 0.01;
+    LAPTrack brownian(params);
+    brownian.initializeTracks(frameIdx, position, SE_position);
+    brownian.generateTracks();
+    params["motionModel"] = LAPTrack::CONSTANT_VELOCITY;
+    params["velocityVar0"] = 4;
+    LAPTrack velocity(params);
+    velocity.initializeTracks(frameIdx, position, SE_position);
+    velocity.generateTracks();
+    Tracker::TrackT trackA, trackB;
+    for(int f=0; f<nFrames; f++) {
+        trackA.push_back(2*f);
+        trackB.push_back(2*f+1);
+    }
+    std::cout<<"ConstantVelocity: BROWNIAN nTracks: "<<brownian.tracks.size()<<" CONSTANT_VELOCITY nTracks: "<<velocity.tracks.size()<<"\n";
+    bool linked = velocity.tracks.size()==2 &&
+        ((velocity.tracks[0]==trackA && velocity.tracks[1]==trackB) || (velocity.tracks[0]==trackB && velocity.tracks[1]==trackA));
+    return linked && brownian.tracks.size()==frameIdx.n_elem;
+}
+
+/* maxCandidatesPerLoc bounds the F2F edges, and a cap above every row and column count changes nothing */
+bool testCandidateCap()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack uncapped(params);
+    uncapped.initializeTracks(frameIdx, position, SE_position);
+    uncapped.generateTracks();
+    params["maxCandidatesPerLoc"] = 1000;
+    LAPTrack large(params);
+    large.initializeTracks(frameIdx, position, SE_position);
+    large.generateTracks();
+    IndexT k = 2;
+    params["maxCandidatesPerLoc"] = k;
+    LAPTrack capped(params);
+    capped.initializeTracks(frameIdx, position, SE_position);
+    bool bounded = true;
+    for(IndexT f=0; f+1<40; f++) {
+        LAPTrack::SpMatT edges = capped.computeF2FEdgeMat(f, f+1);
+        bounded = bounded && edges.n_nonzero <= k*(edges.n_rows+edges.n_cols);
+    }
+    capped.generateTracks();
+    //The capped gap-close candidates must not depend on the order the parallel blocks finish in
+    int nThreads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    LAPTrack serial(params);
+    serial.initializeTracks(frameIdx, position, SE_position);
+    serial.generateTracks();
+    omp_set_num_threads(nThreads);
+    auto largeStats = large.getStats();
+    auto cappedStats = capped.getStats();
+    std::cout<<"CandidateCap: k="<<k<<" F2F cap hits: "<<cappedStats["nF2FCandidateCapHits"](0)
+             <<" gap-close cap hits: "<<cappedStats["nGapCloseCandidateCapHits"](0)<<(bounded ? "" : " UNBOUNDED")<<"\n";
+    return bounded && large.tracks == uncapped.tracks && serial.tracks == capped.tracks &&
+           largeStats["nF2FCandidateCapHits"](0) == 0 && largeStats["nGapCloseCandidateCapHits"](0) == 0 &&
+           cappedStats["nF2FCandidateCapHits"](0) > 0 && cappedStats["nGapCloseCandidateCapHits"](0) > 0;
+}
+
+/* Greedy linking can only cost more than the optimum it reports.  The F2F LAPs do not depend on the earlier links. */
+bool testGreedy()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    params["reportCostGap"] = 1;
+    LAPTrack optimal(params);
+    optimal.initializeTracks(frameIdx, position, SE_position);
+    optimal.generateTracks();
+    params["linkStrategy"] = LAPTrack::LINK_GREEDY;
+    params["greedySwapPasses"] = 2;
+    LAPTrack greedy(params);
+    greedy.initializeTracks(frameIdx, position, SE_position);
+    greedy.generateTracks();
+    auto optStats = optimal.getStats();
+    auto stats = greedy.getStats();
+    double f2fGap = stats["f2fCostGap"](0), gapCloseGap = stats["gapCloseCostGap"](0);
+    std::cout<<"Greedy: optimal nTracks: "<<optimal.tracks.size()<<" greedy nTracks: "<<greedy.tracks.size()
+             <<" f2fCostGap: "<<f2fGap<<" gapCloseCostGap: "<<gapCloseGap<<"\n";
+    double tol = 1e-9*std::abs(optStats["f2fLinkCost"](0));
+    return optStats["f2fCostGap"](0) == 0 && f2fGap >= -tol && gapCloseGap >= -tol &&
+           std::abs(stats["f2fOptimalCost"](0) - optStats["f2fLinkCost"](0)) <= tol;
+}
+
+/* An expired frameTimeBudget must still give a valid padded solution, and an ample one the optimum */
+bool testBudgeted()
+{
+    bool ok = true;
+    int nDegraded = 0;
+    for(int trial=0; trial<20; trial++) {
+        uword nR = 20+trial, nC = 25+trial;
+        sp_mat C = sprandu<sp_mat>(nR, nC, 0.3);
+        vec rowUnassigned = randu<vec>(nR)+1;
+        vec colUnassigned = randu<vec>(nC)+1;
+        double dummy = 1e-9;
+        auto optimal = LAP_JVSparse<double>::solvePadded(C, rowUnassigned, colUnassigned, dummy);
+        double optCost = LAP_JVSparse<double>::computePaddedCost(C, rowUnassigned, colUnassigned, dummy, optimal);
+        bool completed;
+        auto ample = LAP_JVSparse<double>::solvePaddedBudgeted(C, rowUnassigned, colUnassigned, dummy, 60, completed);
+        ok = ok && completed && all(ample == optimal);
+        auto expired = LAP_JVSparse<double>::solvePaddedBudgeted(C, rowUnassigned, colUnassigned, dummy, 0, completed);
+        double cost = LAP_JVSparse<double>::computePaddedCost(C, rowUnassigned, colUnassigned, dummy, expired);
+        ok = ok && std::isfinite(cost) && cost >= optCost*(1-1e-12);
+        nDegraded += !completed;
+    }
+    std::cout<<"Budgeted: degraded "<<nDegraded<<" of 20 "<<(ok ? "valid" : "INVALID")<<"\n";
+    return ok;
+}
+
+/* Reordering the localizations within frames permutes the F2F LAPs without changing their optimal costs */
+bool testSpatialOrder()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    params["reportCostGap"] = 1;
+    LAPTrack input(params);
+    input.initializeTracks(frameIdx, position, SE_position);
+    input.generateTracks();
+    double inputCost = input.getStats()["f2fOptimalCost"](0);
+    bool ok = true;
+    for(int order: {Tracker::ORDER_MORTON, Tracker::ORDER_HILBERT}) {
+        params["spatialOrder"] = order;
+        LAPTrack sorted(params);
+        sorted.initializeTracks(frameIdx, position, SE_position);
+        sorted.generateTracks();
+        double cost = sorted.getStats()["f2fOptimalCost"](0);
+        std::cout<<"SpatialOrder: "<<order<<" nTracks: "<<sorted.tracks.size()<<" f2fOptimalCost: "<<cost
+                 <<" input order: "<<inputCost<<"\n";
+        ok = ok && std::abs(cost-inputCost) <= 1e-9*std::abs(inputCost);
+    }
+    return ok;
+}
+
+/* Tracking labelled species in one pass with per-species D must match tracking each species alone */
+bool testSpecies()
+{
+    Tracker::IVecT frameIdxA, frameIdxB;
+    mat positionA, SE_positionA, positionB, SE_positionB;
+    makeTestData(40, 8, frameIdxA, positionA, SE_positionA);
+    makeTestData(40, 8, frameIdxB, positionB, SE_positionB);
+    IndexT NA = frameIdxA.n_elem;
+    auto params = testParams();
+    params["D"] = 0.3;
+    LAPTrack trackerA(params);
+    trackerA.initializeTracks(frameIdxA, positionA, SE_positionA);
+    trackerA.generateTracks();
+    params["D"] = 0.5;
+    LAPTrack trackerB(params);
+    trackerB.initializeTracks(frameIdxB, positionB, SE_positionB);
+    trackerB.generateTracks();
+
+    params["D"] = {0.3, 0.5};
+    LAPTrack combined(params);
+    Tracker::IVecT species = join_cols(Tracker::IVecT(NA, fill::zeros), Tracker::IVecT(frameIdxB.n_elem, fill::ones));
+    mat feature, SE_feature;
+    combined.initializeTracks(join_cols(frameIdxA, frameIdxB), join_cols(positionA, positionB), join_cols(SE_positionA, SE_positionB),
+                              feature, SE_feature, species);
+    combined.generateTracks();
+    Tracker::TrackVecT tracksA, tracksB;
+    bool mixed = false;
+    for(auto &track: combined.tracks) {
+        Tracker::TrackT local;
+        for(IndexT loc: track) local.push_back(loc<NA ? loc : loc-NA);
+        bool isA = track.front()<NA;
+        for(IndexT loc: track) mixed = mixed || ((loc<NA) != isA);
+        (isA ? tracksA : tracksB).push_back(local);
+    }
+    std::cout<<"Species: nTracks A: "<<trackerA.tracks.size()<<" B: "<<trackerB.tracks.size()
+             <<" combined: "<<combined.tracks.size()<<(mixed ? " MIXED" : "")<<"\n";
+    return !mixed && tracksA == trackerA.tracks && tracksB == trackerB.tracks;
+}
+
+/* Gap closing a checkpoint saved after linkF2F must match tracking straight through */
+bool testCheckpoint()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack direct(params);
+    direct.initializeTracks(frameIdx, position, SE_position);
+    direct.generateTracks();
+    LAPTrack linked(params);
+    linked.initializeTracks(frameIdx, position, SE_position);
+    linked.linkF2F();
+    std::string filename = "lap_test_checkpoint.bin";
+    linked.saveState(filename);
+    LAPTrack resumed(params);
+    resumed.loadState(filename);
+    //Per-species parameters must match the saved species, as in initializeTracks()
+    auto speciesParams = params;
+    speciesParams["D"] = {0.3, 0.1};
+    LAPTrack mismatched(speciesParams);
+    bool rejected = false;
+    try {
+        mismatched.loadState(filename);
+    } catch(ParameterValueError &) {
+        rejected = true;
+    }
+    //A truncated file or a corrupt array size must be rejected without touching the loaded state
+    std::string bytes;
+    {
+        std::ifstream in(filename, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::string truncated = bytes.substr(0, bytes.size()/2), corrupt = bytes;
+    uint64_t hugeRows = uint64_t(1)<<40;
+    std::memcpy(&corrupt[20+6*sizeof(IndexT)], &hugeRows, sizeof(hugeRows)); //frameIdx.n_rows after the header and scalars
+    int nCorruptRejected = 0;
+    for(const std::string *damaged: {&truncated, &corrupt}) {
+        std::ofstream(filename, std::ios::binary)<<*damaged;
+        try {
+            resumed.loadState(filename);
+        } catch(ParameterValueError &) {
+            nCorruptRejected++;
+        }
+    }
+    std::remove(filename.c_str());
+    resumed.closeGaps();
+    std::cout<<"Checkpoint: direct nTracks: "<<direct.tracks.size()<<" resumed nTracks: "<<resumed.tracks.size()
+             <<(rejected ? "" : " species mismatch ACCEPTED")<<(nCorruptRejected==2 ? "" : " corrupt file ACCEPTED")<<"\n";
+    return direct.tracks == resumed.tracks && rejected && nCorruptRejected==2;
+}
+
+/* Each sweep configuration must match tracking with those parameters directly */
+bool testSweep()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    std::vector<Tracker::VecParamT> configs(3);
+    configs[1]["D"] = 0.1;
+    configs[1]["maxGapCloseFrames"] = 3;
+    configs[2]["koff"] = 0.3;
+    configs[2]["maxPositionDisplacementSigma"] = 3;
+    LAPTrack tracker(params);
+    tracker.initializeTracks(frameIdx, position, SE_position);
+    std::vector<Tracker::TrackVecT> configTracks;
+    std::vector<Tracker::VecParamT> configStats;
+    tracker.sweep(configs, configTracks, configStats);
+    bool ok = true;
+    for(size_t k=0; k<configs.size(); k++) {
+        auto config_params = params;
+        for(auto &p: configs[k]) config_params[p.first] = p.second;
+        LAPTrack direct(config_params);
+        direct.initializeTracks(frameIdx, position, SE_position);
+        direct.generateTracks();
+        std::cout<<"Sweep config "<<k<<": direct nTracks: "<<direct.tracks.size()<<" sweep nTracks: "<<configTracks[k].size()<<"\n";
+        ok = ok && direct.tracks == configTracks[k];
+    }
+    //The candidates index this tracker's frame order, so a configuration may not re-sort the frames
+    std::vector<Tracker::VecParamT> reorder(1);
+    reorder[0]["spatialOrder"] = Tracker::ORDER_HILBERT;
+    bool rejected = false;
+    try {
+        tracker.sweep(reorder, configTracks, configStats);
+    } catch(ParameterValueError &) {
+        rejected = true;
+    }
+    std::cout<<"Sweep spatialOrder override: "<<(rejected ? "rejected" : "ACCEPTED")<<"\n";
+    return ok && rejected;
+}
+
+/* Appending frames before gap closing must match tracking all the frames at once */
+bool testAppend()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack direct(params);
+    direct.initializeTracks(frameIdx, position, SE_position);
+    direct.generateTracks();
+    uword nHead = 20*8;
+    uword N = frameIdx.n_elem;
+    LAPTrack appended(params);
+    appended.initializeTracks(frameIdx.head(nHead), position.head_rows(nHead), SE_position.head_rows(nHead));
+    appended.linkF2F();
+    appended.appendLocalizations(frameIdx.tail(N-nHead), position.tail_rows(N-nHead), SE_position.tail_rows(N-nHead));
+    appended.closeGaps();
+    LAPTrack reopened(params);
+    reopened.initializeTracks(frameIdx.head(nHead), position.head_rows(nHead), SE_position.head_rows(nHead));
+    reopened.generateTracks();
+    auto headTracks = reopened.tracks;
+    reopened.appendLocalizations(frameIdx.tail(N-nHead), position.tail_rows(N-nHead), SE_position.tail_rows(N-nHead));
+    //Re-opened gap closing only joins track ends near the boundary, so it is checked for consistency, not against direct
+    IndexT boundary = frameIdx(nHead-1);
+    IndexT maxGap = static_cast<IndexT>(params["maxGapCloseFrames"](0));
+    bool valid = true;
+    int nCrossing = 0;
+    uvec locCount(N, fill::zeros);
+    IndexT lastBirth = 0;
+    for(auto &track: reopened.tracks) {
+        IndexT birth = frameIdx(track.front());
+        valid = valid && birth>=lastBirth; //Tracks stay in birth order
+        lastBirth = birth;
+        IndexT prevFrame = -1;
+        for(IndexT loc: track) {
+            locCount(loc)++;
+            IndexT frame = frameIdx(loc);
+            valid = valid && (prevFrame<0 || (frame>prevFrame && frame-prevFrame<maxGap)); //Joined within maxGapCloseFrames
+            prevFrame = frame;
+        }
+        if(birth<=boundary && frameIdx(track.back())>boundary) nCrossing++;
+    }
+    valid = valid && locCount.max()<=1;
+    int nChanged = 0; //Tracks ending well before the boundary must not be touched
+    for(auto &track: headTracks) 
+        if(frameIdx(track.back())<boundary-maxGap && std::find(reopened.tracks.begin(), reopened.tracks.end(), track)==reopened.tracks.end())
+            nChanged++;
+    std::cout<<"Append: direct nTracks: "<<direct.tracks.size()<<" appended nTracks: "<<appended.tracks.size()
+             <<" re-opened gap close nTracks: "<<reopened.tracks.size()<<" crossing the boundary: "<<nCrossing
+             <<(valid ? "" : " INVALID")<<" early tracks changed: "<<nChanged<<"\n";
+    return direct.tracks == appended.tracks && valid && nCrossing>0 && nChanged==0;
+}
+
+/* Background tracking must match tracking in the calling thread */
+bool testAsync()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(40, 8, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack direct(params);
+    direct.initializeTracks(frameIdx, position, SE_position);
+    direct.generateTracks();
+    LAPTrack background(params);
+    background.initializeTracks(frameIdx, position, SE_position);
+    background.startGenerateTracks();
+    background.waitTracking();
+    auto progress = background.getProgress();
+    std::cout<<"Async: direct nTracks: "<<direct.tracks.size()<<" background nTracks: "<<background.tracks.size()
+             <<" phase: "<<progress["phase"]<<" framesLinked: "<<progress["framesLinked"]<<"\n";
+    return direct.tracks == background.tracks;
+}
+
+/* Exposes the protected tracking state to the tests */
+class StateLAPTrack : public LAPTrack
+{
+public:
+    using LAPTrack::LAPTrack;
+    /* A state generateTracks() can resume, with the progress phase reset to match it */
+    bool isResumable() const
+    {
+        return (state==UNTRACKED && progressPhase.load()==PHASE_IDLE) || (state==F2F_LINKED && progressPhase.load()==PHASE_LINKING);
+    }
+};
+
+/* A cancelled background run must leave a state that tracks to the same result when restarted */
+bool testAsyncCancel()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(2000, 40, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack direct(params);
+    direct.initializeTracks(frameIdx, position, SE_position);
+    direct.generateTracks();
+    StateLAPTrack background(params);
+    background.initializeTracks(frameIdx, position, SE_position);
+    background.startGenerateTracks();
+    while(background.isTrackingRunning() && background.getProgress()["framesLinked"](0)<1) std::this_thread::yield();
+    background.cancelTracking();
+    bool cancelled = false;
+    try {
+        background.waitTracking();
+    } catch(CancelledError &) {
+        cancelled = true;
+    }
+    auto phase = background.getProgress()["phase"](0);
+    bool resumable = background.isResumable();
+    background.startGenerateTracks();
+    background.waitTracking();
+    std::cout<<"AsyncCancel: "<<(cancelled ? "cancelled" : "NOT CANCELLED")<<" phase after cancel: "<<phase
+             <<(resumable ? "" : " NOT RESUMABLE")<<" direct nTracks: "<<direct.tracks.size()
+             <<" restarted nTracks: "<<background.tracks.size()<<"\n";
+    return cancelled && resumable && direct.tracks == background.tracks;
+}
+
+/* Track statistics on hand-built tracks with known values */
+bool testTrackStats()
+{
+    Tracker::IVecT frameIdx = {0, 1, 2, 3};
+    mat position(4,2,fill::zeros);
+    mat SE_position(4,2,fill::zeros);
+    position(1,0) = 1;
+    position(3,0) = 1;
+    position(3,1) = 2;
+    LAPTrack tracker(testParams());
+    tracker.initializeTracks(frameIdx, position, SE_position);
+    tracker.tracks = {{0, 1, 3}, {2}};
+    auto stats = tracker.getTrackStats(3);
+    std::cout<<"TrackStats: D: "<<stats["D"].t()<<"msd: "<<stats["msd"].t();
+    bool ok = stats["lifetime"](0)==4 && stats["nBlinks"](0)==1 && stats["darkFrames"](0)==1 && stats["nLocs"](1)==1;
+    ok = ok && tracker.getStats()["nDims"](0)==2;
+    ok = ok && std::fabs(stats["D"](0)-5./12)<1e-12 && std::isnan(stats["D"](1));
+    //msd is nTracks x 3 column-major: track 0 has one pair at each lag of 1, 4, 5
+    ok = ok && stats["msd"](0)==1 && stats["msd"](2)==4 && stats["msd"](4)==5 && stats["msdCount"](1)==0;
+    return ok;
+}
+
+/* Query index results must match a scan of all the tracks */
+bool testQueryTracks()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(60, 40, frameIdx, position, SE_position);
+    LAPTrack tracker(testParams());
+    tracker.initializeTracks(frameIdx, position, SE_position);
+    tracker.generateTracks();
+    bool ok = true;
+    IndexT nMatches = 0;
+    for(int q=0; q<50; q++) {
+        IndexT a = static_cast<IndexT>(randu()*60), b = a + static_cast<IndexT>(randu()*10);
+        vec roiMin = randu<vec>(2)*8, roiMax = roiMin + 2;
+        if(q==0) { //Frames only
+            roiMin.reset();
+            roiMax.reset();
+        }
+        Tracker::IVecT result = tracker.queryTracks(a, b, roiMin, roiMax);
+        Tracker::IndexVectorT expected;
+        for(IndexT t=0; t<static_cast<IndexT>(tracker.tracks.size()); t++) for(IndexT loc: tracker.tracks[t]) {
+            bool inside = frameIdx(loc)>=a && frameIdx(loc)<=b;
+            for(IndexT d=0; d<2 && inside && q>0; d++) inside = position(loc,d)>=roiMin(d) && position(loc,d)<=roiMax(d);
+            if(inside) {
+                expected.push_back(t);
+                break;
+            }
+        }
+        nMatches += expected.size();
+        ok = ok && result.n_elem==expected.size() && std::equal(expected.begin(), expected.end(), result.begin());
+    }
+    //The ROI has one value per position column
+    bool rejected = false;
+    try {
+        tracker.queryTracks(0, 10, vec(2*position.n_cols, fill::zeros), vec(2*position.n_cols, fill::ones));
+    } catch(ParameterValueError &) {
+        rejected = true;
+    }
+    std::cout<<"QueryTracks: nTracks: "<<tracker.tracks.size()<<" total matches: "<<nMatches<<(ok ? "" : " MISMATCH")
+             <<(rejected ? "" : " BAD ROI ACCEPTED")<<"\n";
+    return ok && rejected && position.n_cols == 2;
+}
+
+/* A custom cost policy that gates out every connection */
+struct NoLinkCostPolicy : public GaussianCostPolicy<LAPTrack::DynamicSize,LAPTrack::DynamicSize>
+{
+    using GaussianCostPolicy<LAPTrack::DynamicSize,LAPTrack::DynamicSize>::GaussianCostPolicy;
+    bool pairCost(IdxT, IdxT, IdxT, FloatT &) const {return false;}
+};
+
+/* The default policy set explicitly must match the default tracking, and a custom policy must be used */
+bool testCostPolicy()
+{
+    Tracker::IVecT frameIdx;
+    mat position, SE_position;
+    makeTestData(30, 6, frameIdx, position, SE_position);
+    auto params = testParams();
+    LAPTrack direct(params);
+    direct.initializeTracks(frameIdx, position, SE_position);
+    direct.generateTracks();
+    LAPTrack gaussian(params);
+    gaussian.setCostPolicy<GaussianCostPolicy<LAPTrack::DynamicSize,LAPTrack::DynamicSize>>();
+    gaussian.initializeTracks(frameIdx, position, SE_position);
+    gaussian.generateTracks();
+    LAPTrack noLink(params);
+    noLink.setCostPolicy<NoLinkCostPolicy>();
+    noLink.initializeTracks(frameIdx, position, SE_position);
+    noLink.generateTracks();
+    std::cout<<"CostPolicy: default nTracks: "<<direct.tracks.size()<<" gaussian nTracks: "<<gaussian.tracks.size()
+             <<" noLink nTracks: "<<noLink.tracks.size()<<"\n";
+    return direct.tracks == gaussian.tracks && noLink.tracks.size() == frameIdx.n_elem;
+}
+
 int main()
 {
     testLAP();
     cout<<" =========== TRACKING ====================\n";
     testTracking();
-    return 0;
+    cout<<" =========== SOLVE PADDED ====================\n";
+    bool ok = testSolvePadded();
+    cout<<" =========== SPARSE AUGMENT ====================\n";
+    ok = testSparseAugment() && ok;
+    cout<<" =========== DENSE SOLVER ====================\n";
+    ok = testDenseSolver() && ok;
+    cout<<" =========== GAP CLOSE MODES ====================\n";
+    ok = testGapCloseModes() && ok;
+    cout<<" =========== CONSTANT VELOCITY ====================\n";
+    ok = testConstantVelocity() && ok;
+    cout<<" =========== CANDIDATE CAP ====================\n";
+    ok = testCandidateCap() && ok;
+    cout<<" =========== GREEDY ====================\n";
+    ok = testGreedy() && ok;
+    cout<<" =========== BUDGETED ====================\n";
+    ok = testBudgeted() && ok;
+    cout<<" =========== SPATIAL ORDER ====================\n";
+    ok = testSpatialOrder() && ok;
+    cout<<" =========== SPECIES ====================\n";
+    ok = testSpecies() && ok;
+    cout<<" =========== COST POLICY ====================\n";
+    ok = testCostPolicy() && ok;
+    cout<<" =========== CHECKPOINT ====================\n";
+    ok = testCheckpoint() && ok;
+    cout<<" =========== SWEEP ====================\n";
+    ok = testSweep() && ok;
+    cout<<" =========== APPEND ====================\n";
+    ok = testAppend() && ok;
+    cout<<" =========== TRACK STATS ====================\n";
+    ok = testTrackStats() && ok;
+    cout<<" =========== ASYNC ====================\n";
+    ok = testAsync() && ok;
+    ok = testAsyncCancel() && ok;
+    cout<<" =========== QUERY TRACKS ====================\n";
+    ok = testQueryTracks() && ok;
+    return ok ? 0 : 1;
 }
 